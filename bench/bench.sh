@@ -0,0 +1,36 @@
+#!/bin/sh
+# End-to-end throughput and loss benchmark. Runs varnishlog-buffer against a
+# synthetic varnishlog, first with a consumer that keeps up and then with one
+# that falls behind. Extra varnishlog-buffer options may be given in
+# VLB_BENCH_ARGS; see varnishlog.c for the generator's settings.
+
+set -e
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+TOPDIR=$(dirname "$BENCHDIR")
+BUFFER="$TOPDIR/src/varnishlog-buffer.exe"
+RUN="$BENCHDIR/bench-run.exe"
+
+# varnishlog-buffer runs whichever varnishlog is first on the PATH.
+BINDIR=$(mktemp -d)
+trap 'rm -rf "$BINDIR"' EXIT
+ln -s "$BENCHDIR/varnishlog.exe" "$BINDIR/varnishlog"
+PATH="$BINDIR:$PATH"
+export PATH
+
+LINES=${VLB_BENCH_LINES:-2000000}
+SLOW_RATE=${VLB_BENCH_SLOW_RATE:-200000}
+SLOW_READ=${VLB_BENCH_SLOW_READ:-5000000}
+SLOW_QUEUE=${VLB_BENCH_SLOW_QUEUE:-33554432}
+
+printf '%-12s %12s %14s %10s %10s %10s %8s %8s %8s\n' \
+	run lines/s bytes/s read dropped rss_kb p50_us p99_us p999_us
+
+# The generator runs flat out and the consumer keeps up.
+VLB_BENCH_LINES=$LINES VLB_BENCH_RATE=0 \
+	"$RUN" fast 0 -- "$BUFFER" -l $VLB_BENCH_ARGS
+
+# The generator is paced and the consumer reads too slowly to keep up, so the
+# queue fills until its byte budget is reached and lines are dropped.
+VLB_BENCH_LINES=$LINES VLB_BENCH_RATE=$SLOW_RATE \
+	"$RUN" slow "$SLOW_READ" -- "$BUFFER" -l --max-queue-bytes "$SLOW_QUEUE" $VLB_BENCH_ARGS
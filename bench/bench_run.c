@@ -0,0 +1,132 @@
+// Runs varnishlog-buffer as a consumer of its output and reports on the run.
+//
+//   bench-run NAME READ_RATE -- varnishlog-buffer [options]
+//
+// READ_RATE limits how fast the output is consumed in bytes per second, with
+// 0 meaning as fast as possible. The buffer is given a --queue-length-file
+// which stays mapped after it exits, so its final statistics can be read.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "die.h"
+#include "stats.h"
+
+#define READ_SIZE (64 * 1024)
+
+static const Stats *map_stats( const char *path ) {
+	int fd = open(path, O_RDONLY);
+	if( fd == -1 ) return NULL;
+
+	const Stats *stats = NULL;
+	struct stat st;
+	if( fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Stats) ) {
+		stats = mmap(NULL, sizeof(Stats), PROT_READ, MAP_SHARED, fd, 0);
+		if( stats == MAP_FAILED ) stats = NULL;
+	}
+	close(fd);
+
+	// The file is created before it is initialized.
+	if( stats != NULL && __atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ) {
+		munmap((void *) stats, sizeof(Stats));
+		stats = NULL;
+	}
+	return stats;
+}
+
+static void throttle( gint64 started, guint64 bytes, guint64 rate ) {
+	gint64 due = started + (gint64) (bytes * G_USEC_PER_SEC / rate);
+	gint64 now = g_get_monotonic_time();
+	if( due > now ) g_usleep(due - now);
+}
+
+int main( int argc, char *argv[] ) {
+	if( argc < 5 || strcmp(argv[3], "--") != 0 )
+		die("Usage: bench-run NAME READ_RATE -- varnishlog-buffer [options]");
+	const char *name = argv[1];
+	guint64 read_rate = g_ascii_strtoull(argv[2], NULL, 10);
+
+	gchar *stats_path = g_strdup_printf("%s/vlb-bench-%d.stats", g_get_tmp_dir(), getpid());
+
+	int pipefd[2];
+	if( pipe(pipefd) == -1 ) dief("pipe: %s", strerror(errno));
+
+	gint64 started = g_get_monotonic_time();
+	pid_t pid = fork();
+	if( pid == -1 ) dief("fork: %s", strerror(errno));
+	if( pid == 0 ) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+
+		int nargs = argc - 4;
+		char **args = g_new0(char *, nargs + 3);
+		memcpy(args, argv + 4, nargs * sizeof(char *));
+		args[nargs] = "-q";
+		args[nargs + 1] = stats_path;
+		execvp(args[0], args);
+		dief("exec %s: %s", args[0], strerror(errno));
+	}
+	close(pipefd[1]);
+
+	const Stats *stats = NULL;
+	guint64 lines = 0, bytes = 0;
+	gchar *buf = g_malloc(READ_SIZE);
+	while( true ) {
+		ssize_t n = read(pipefd[0], buf, READ_SIZE);
+		if( n == -1 ) {
+			if( errno == EINTR ) continue;
+			dief("read: %s", strerror(errno));
+		}
+		if( n == 0 ) break;
+
+		for( gchar *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++ ) lines++;
+		bytes += n;
+
+		if( stats == NULL ) stats = map_stats(stats_path);
+		if( read_rate != 0 ) throttle(started, bytes, read_rate);
+	}
+	double elapsed = (g_get_monotonic_time() - started) / (double) G_USEC_PER_SEC;
+
+	int status;
+	struct rusage usage;
+	if( wait4(pid, &status, 0, &usage) == -1 ) dief("wait4: %s", strerror(errno));
+
+	if( stats == NULL ) dief("%s: no statistics were published to %s", name, stats_path);
+
+	printf(
+		"%-12s %12.0f %14.0f %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10ld %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT "\n",
+		name,
+		lines / elapsed,
+		bytes / elapsed,
+		stats->lines_read,
+		stats->lines_dropped,
+		usage.ru_maxrss,
+		stats_residency_percentile(stats, 0.5),
+		stats_residency_percentile(stats, 0.99),
+		stats_residency_percentile(stats, 0.999)
+	);
+
+	// Lines passed straight through aren't counted, only their bytes.
+	guint64 sent = stats->bytes_written + stats->bytes_spliced;
+	if( sent != bytes )
+		dief("%s: %" G_GUINT64_FORMAT " bytes written but %" G_GUINT64_FORMAT " received", name, sent, bytes);
+
+	g_free(buf);
+	g_free(stats_path);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,6 @@
+BENCH_SOURCES := varnishlog.c bench_run.c
+BENCH_SOURCES := $(BENCH_SOURCES:%=$(CURDIR)/%)
+
+BENCH_OBJECTS := $(BENCH_SOURCES:.c=.o)
+
+BENCH_DEPS := $(BENCH_OBJECTS:.o=.d)
@@ -0,0 +1,191 @@
+// A stand-in for varnishlog -Ou which emits synthetic varnish 3 log records.
+// It is configured through the environment, as varnishlog-buffer always
+// starts it with the same arguments:
+//
+//   VLB_BENCH_LINES         Lines to emit before exiting (default 2000000)
+//   VLB_BENCH_RATE          Lines per second, or 0 for as fast as possible
+//   VLB_BENCH_COOKIE_BYTES  Mean size of the Cookie header, which is drawn
+//                           from an exponential distribution (default 200)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "die.h"
+
+#define OUT_BUFFER_SIZE (64 * 1024)
+#define MAX_LINE_SIZE (16 * 1024)
+#define MAX_COOKIE_BYTES 8192
+// How many lines are written between checks of the clock when rate limited.
+#define PACE_LINES 256
+
+typedef struct Generator {
+	guint64 lines, max_lines, rate;
+	double cookie_mean;
+	guint64 rng;
+	guint xid;
+
+	gchar buf[OUT_BUFFER_SIZE];
+	gsize len;
+} Generator;
+
+static guint64 env_u64( const char *name, guint64 def ) {
+	const char *val = getenv(name);
+	if( val == NULL || *val == '\0' ) return def;
+	return g_ascii_strtoull(val, NULL, 10);
+}
+
+// xorshift64*; the quality needed here is low.
+static guint64 rand_next( Generator *g ) {
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * G_GUINT64_CONSTANT(2685821657736338717);
+}
+
+static guint rand_range( Generator *g, guint lo, guint hi ) {
+	return lo + rand_next(g) % (hi - lo + 1);
+}
+
+static guint rand_exp( Generator *g, double mean ) {
+	double u = (rand_next(g) >> 11) * (1.0 / 9007199254740992.0);
+	double v = -mean * log(1.0 - u);
+	return v > MAX_COOKIE_BYTES ? MAX_COOKIE_BYTES : (guint) v;
+}
+
+static void flush_out( Generator *g ) {
+	gsize off = 0;
+	while( off < g->len ) {
+		ssize_t n = write(STDOUT_FILENO, g->buf + off, g->len - off);
+		if( n == -1 ) {
+			if( errno == EINTR ) continue;
+			// The reader went away; there is nobody left to report to.
+			exit(errno == EPIPE ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		off += n;
+	}
+	g->len = 0;
+}
+
+__attribute__((format(printf, 5, 6)))
+static void emit( Generator *g, int fd, const char *tag, char type, const char *fmt, ... ) {
+	if( g->len + MAX_LINE_SIZE > sizeof(g->buf) ) flush_out(g);
+
+	gchar *p = g->buf + g->len;
+	int n = snprintf(p, MAX_LINE_SIZE, "%5d %-12s %c ", fd, tag, type);
+
+	va_list ap;
+	va_start(ap, fmt);
+	n += vsnprintf(p + n, MAX_LINE_SIZE - n - 1, fmt, ap);
+	va_end(ap);
+	if( n > MAX_LINE_SIZE - 2 ) n = MAX_LINE_SIZE - 2;
+
+	p[n++] = '\n';
+	g->len += n;
+	g->lines++;
+}
+
+static void emit_cookie( Generator *g, int fd ) {
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789=;";
+	gchar cookie[MAX_COOKIE_BYTES + 1];
+	guint len = rand_exp(g, g->cookie_mean);
+	for( guint i = 0; i < len; i++ ) cookie[i] = alphabet[rand_next(g) % (sizeof(alphabet) - 1)];
+	cookie[len] = '\0';
+	emit(g, fd, "RxHeader", 'c', "Cookie: %s", cookie);
+}
+
+// One client request as varnish 3 logs it. Lines of a transaction are
+// contiguous here, which -Ou doesn't promise but does most of the time.
+static void emit_transaction( Generator *g ) {
+	int fd = rand_range(g, 10, 2000);
+	guint xid = ++g->xid;
+	guint ip = rand_range(g, 1, 254), port = rand_range(g, 1024, 65535);
+	guint work = rand_range(g, 1, 9999999), page = rand_range(g, 1, 50);
+	bool hit = rand_range(g, 0, 9) < 8;
+	guint length = rand_range(g, 200, 200000);
+	double start = g_get_real_time() / (double) G_USEC_PER_SEC;
+	double service = rand_range(g, 50, hit ? 500 : 200000) / 1e6;
+
+	emit(g, fd, "ReqStart", 'c', "10.0.0.%u %u %u", ip, port, xid);
+	emit(g, fd, "RxRequest", 'c', "GET");
+	emit(g, fd, "RxURL", 'c', "/works/%u?page=%u", work, page);
+	emit(g, fd, "RxProtocol", 'c', "HTTP/1.1");
+	emit(g, fd, "RxHeader", 'c', "Host: www.example.com");
+	emit(g, fd, "RxHeader", 'c', "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Safari/537.36");
+	emit(g, fd, "RxHeader", 'c', "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8");
+	emit(g, fd, "RxHeader", 'c', "Accept-Encoding: gzip, deflate");
+	emit_cookie(g, fd);
+	emit(g, fd, "VCL_call", 'c', "recv lookup");
+	emit(g, fd, "VCL_call", 'c', "hash");
+	emit(g, fd, "Hash", 'c', "/works/%u?page=%u", work, page);
+	emit(g, fd, "Hash", 'c', "www.example.com");
+	emit(g, fd, "VCL_return", 'c', "hash");
+	if( hit ) {
+		emit(g, fd, "Hit", 'c', "%u", rand_range(g, 1, xid));
+		emit(g, fd, "VCL_call", 'c', "hit deliver");
+	} else {
+		emit(g, fd, "VCL_call", 'c', "miss fetch");
+		emit(g, fd, "Backend", 'c', "%d app app", rand_range(g, 10, 2000));
+		emit(g, fd, "TTL", 'c', "%u RFC 120 -1 -1 %.0f 0 %.0f 0 0", xid, start, start);
+		emit(g, fd, "VCL_call", 'c', "fetch deliver");
+		emit(g, fd, "ObjProtocol", 'c', "HTTP/1.1");
+		emit(g, fd, "ObjResponse", 'c', "OK");
+	}
+	emit(g, fd, "VCL_call", 'c', "deliver deliver");
+	emit(g, fd, "TxProtocol", 'c', "HTTP/1.1");
+	emit(g, fd, "TxStatus", 'c', "200");
+	emit(g, fd, "TxResponse", 'c', "OK");
+	emit(g, fd, "TxHeader", 'c', "Content-Type: text/html; charset=utf-8");
+	emit(g, fd, "TxHeader", 'c', "Content-Length: %u", length);
+	emit(g, fd, "TxHeader", 'c', "X-Varnish: %u", xid);
+	emit(g, fd, "TxHeader", 'c', "Age: %u", hit ? rand_range(g, 1, 120) : 0);
+	emit(g, fd, "Length", 'c', "%u", length);
+	emit(g, fd, "ReqEnd", 'c', "%u %.9f %.9f 0.000030000 %.9f %.9f", xid, start, start + service, service / 2, service / 2);
+}
+
+static void pace( Generator *g, gint64 started ) {
+	gint64 due = started + (gint64) (g->lines * G_USEC_PER_SEC / g->rate);
+	gint64 now = g_get_monotonic_time();
+	if( due <= now ) return;
+
+	// Hand over what we have before sleeping so it isn't held back.
+	flush_out(g);
+	struct timespec ts = {
+		.tv_sec = (due - now) / G_USEC_PER_SEC,
+		.tv_nsec = ((due - now) % G_USEC_PER_SEC) * 1000
+	};
+	while( nanosleep(&ts, &ts) == -1 && errno == EINTR );
+}
+
+int main( int argc, char *argv[] ) {
+	(void) argc, (void) argv;
+
+	static Generator g;
+	g.max_lines = env_u64("VLB_BENCH_LINES", 2000000);
+	g.rate = env_u64("VLB_BENCH_RATE", 0);
+	g.cookie_mean = env_u64("VLB_BENCH_COOKIE_BYTES", 200);
+	g.rng = G_GUINT64_CONSTANT(0x9e3779b97f4a7c15) ^ getpid();
+	if( g.max_lines == 0 ) die("VLB_BENCH_LINES must be positive");
+
+	gint64 started = g_get_monotonic_time();
+	guint64 next_pace = PACE_LINES;
+	while( g.lines < g.max_lines ) {
+		emit_transaction(&g);
+		if( g.rate != 0 && g.lines >= next_pace ) {
+			pace(&g, started);
+			next_pace = g.lines + PACE_LINES;
+		}
+	}
+	flush_out(&g);
+
+	return EXIT_SUCCESS;
+}
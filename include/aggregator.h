@@ -0,0 +1,23 @@
+#ifndef _AGGREGATOR_H_
+#define _AGGREGATOR_H_
+
+// Rolls client requests up into counts by status, cache outcome (hit, miss,
+// pass or pipe), backend, host and URL prefix, and a histogram of response
+// times, and passes on one JSON line per interval with the totals. Varnish 3
+// and 4 style logs are both understood. Backends are counted per backend
+// fetch in varnish 4 and per client request that names one in varnish 3.
+
+typedef struct Aggregator Aggregator;
+
+// URLs are counted by their first url_depth path segments.
+Aggregator *aggregator_new( SlabPool *pool, gint64 interval_us, guint url_depth, LineReaderFunc func, gpointer data );
+void aggregator_free( Aggregator *a );
+
+// Looks at a line without keeping it.
+void aggregator_add( Aggregator *a, const gchar *line, gsize len );
+// Passes on the rollup once the current interval is over.
+bool aggregator_tick( Aggregator *a, gint64 now, GError **err );
+// Passes on the rollup for the interval so far.
+bool aggregator_flush( Aggregator *a, GError **err );
+
+#endif
@@ -7,4 +7,9 @@
 #define __has_extension(x) 0
 #endif
 
+// Fields written by different threads are kept this far apart to avoid false
+// sharing.
+#define CACHE_LINE_SIZE 64
+#define cache_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
 #endif
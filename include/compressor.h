@@ -0,0 +1,40 @@
+#ifndef _COMPRESSOR_H_
+#define _COMPRESSOR_H_
+
+// Compresses the slabs of records queued far behind the sender, in a thread of
+// its own, and has the sender decompress them just before they're written.
+// A slab is only compressed once its producer has sealed it, while it starts
+// more than distance bytes of queued records beyond the sender's next write.
+//
+// The reader offers each slab before queuing its first record. From then on
+// the sender has to call compressor_warm before reading it, which claims it
+// back and stops it being compressed. Nothing but the sender may read an
+// offered slab, so this can't be used with --group, which reads lines from
+// the reader's slabs after they are sealed, or with --listen.
+
+typedef enum SlabState {
+	// Not offered, or claimed by the sender.
+	SLAB_WARM,
+	SLAB_COLD,
+	SLAB_COMPRESSED
+} SlabState;
+
+typedef struct Compressor Compressor;
+
+// Starts the thread. Slabs bigger than slab_size are never compressed.
+Compressor *compressor_new( Stats *stats, gsize slab_size, guint64 distance );
+// Stops the thread and lets go of every slab, so only once the queue is
+// drained.
+void compressor_free( Compressor *c );
+
+// Reader side. position is how many bytes of records the reader had queued
+// before this slab's first.
+void compressor_offer( Compressor *c, Slab *slab, guint64 position );
+
+// Sender side. Decompresses the slab if need be. Only fails if there isn't
+// the memory.
+bool compressor_warm( Compressor *c, Slab *slab, GError **err );
+// Sender side, as records are released.
+void compressor_consumed( Compressor *c, guint64 bytes );
+
+#endif
@@ -13,6 +13,6 @@ GQuark varnishlog_buffer_quark();
 GQuark errno_quark();
 bool write_gerror( GIOChannel *channel, GError *e, GError **err );
 GError *read_gerror( GIOChannel *channel, GError **err );
-void set_gerror_getline( FILE *, GError ** );
+void set_gerror_eof( GError ** );
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+// Waits on the reader's input, the signals it handles and a periodic tick all
+// at once, so none of them interrupt a read. On linux this is one epoll set
+// holding a signalfd and a timerfd; elsewhere poll and a self-pipe written by
+// signal handlers. Only one may exist at a time, and it should be created
+// before any other thread is started, so that the signals are only ever taken
+// here.
+
+#define EVENTS_MAX_FDS 64
+
+typedef struct Events Events;
+
+typedef struct EventsReady {
+	// SIGINT, SIGTERM or SIGHUP.
+	bool shutdown;
+	// SIGUSR1.
+	bool dump;
+	// SIGCHLD.
+	bool child;
+	bool tick;
+	// Bit n is set if the fd watched with token n is ready to read, or at end
+	// of file.
+	guint64 fds;
+} EventsReady;
+
+Events *events_new( gint64 tick_us, GError **err );
+// The signals stay blocked, so any which arrive while shutting down are
+// ignored rather than cutting it short.
+void events_free( Events *e );
+
+// Watches fd until events_unwatch. Files which can't be waited on, such as
+// regular files, are always ready.
+bool events_watch( Events *e, int fd, guint token, GError **err );
+void events_unwatch( Events *e, int fd );
+
+// Blocks until at least one thing is ready, though it may return with nothing
+// ready if interrupted.
+bool events_wait( Events *e, EventsReady *ready, GError **err );
+bool events_ready( const EventsReady *ready, guint token );
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+// Decides as lines are read which are worth queueing, by tag and optionally
+// by payload. Tags are matched case insensitively, like varnishlog -i.
+
+typedef struct Filter Filter;
+
+// include and exclude are comma separated lists of tags; either may be NULL.
+// Once include is given, only the tags in it are kept. prefixes and regexes
+// are NULL terminated lists of TAG:PATTERN, and may be NULL. A line with a tag
+// that has patterns is only kept if its payload matches one of them.
+Filter *filter_new( const gchar *include, const gchar *exclude, gchar **prefixes, gchar **regexes, GError **err );
+void filter_free( Filter *f );
+
+// Lines which don't parse as log records are always kept.
+bool filter_line( const Filter *f, const gchar *line, gsize len );
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _GROUPER_H_
+#define _GROUPER_H_
+
+// Reassembles the interleaved records of varnishlog -Ou into transactions,
+// keyed by the fd or vxid column and the c/b marker. Each transaction is
+// copied into a slab as one contiguous record and passed on once its end tag
+// (ReqEnd, StatSess, BackendReuse, BackendClose or End) is seen, or once it
+// has been open for longer than the timeout. Lines which don't belong to a
+// transaction are passed on straight away.
+
+typedef struct Grouper Grouper;
+
+// Transactions larger than max_bytes are passed on in pieces.
+Grouper *grouper_new( SlabPool *pool, gsize max_bytes, gint64 timeout_us, LineReaderFunc func, gpointer data );
+// Drops any transactions still open.
+void grouper_free( Grouper *g );
+
+// Like a LineReaderFunc, returns true if a reference to the slab was kept.
+// err is only set if passing on a transaction failed, in which case it is
+// dropped.
+bool grouper_add( Grouper *g, Slab *slab, gsize offset, gsize len, GError **err );
+// For a line which was filtered out. It isn't kept, but an end tag still
+// closes its transaction.
+bool grouper_skip( Grouper *g, Slab *slab, gsize offset, gsize len, GError **err );
+// Passes on transactions which have been open for longer than the timeout.
+bool grouper_expire( Grouper *g, gint64 now, GError **err );
+// Passes on every open transaction, complete or not.
+bool grouper_flush( Grouper *g, GError **err );
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+// A write-ahead copy of every queued record, in memory-mapped segment files,
+// so that what was queued but not yet written survives a restart. Records are
+// numbered in the order they were queued, and an ack file holds how many of
+// them the sender has written or deliberately discarded. Both are written
+// through shared mappings, so they outlive the process as soon as they're
+// stored; a thread of its own syncs them to disk every sync interval, and
+// deletes segments once all their records are acknowledged.
+//
+// The sender acknowledges by counting the records it releases, so every
+// record queued has to be journaled, and nothing else: spilled records and
+// --listen's clients aren't supported.
+
+typedef struct Journal Journal;
+
+// Opens or creates the journal in dir, keeping whatever the last run left
+// unacknowledged for journal_replay_peek, and starts the thread.
+Journal *journal_open( const gchar *dir, gsize segment_size, gint64 sync_interval_us, Stats *stats, GError **err );
+// Stops the thread and syncs. Only once the sender has stopped. If every
+// record has been acknowledged the segments are deleted, otherwise they're
+// left to be replayed next time.
+void journal_free( Journal *j );
+
+// Reader side, before anything new is written. The record stays mapped until
+// journal_replay_pop.
+bool journal_replay_peek( Journal *j, const gchar **data, gsize *len );
+void journal_replay_pop( Journal *j );
+
+// Reader side. journal_write copies a record in without making it part of the
+// journal; journal_commit then adds it, once it has been queued. Returns
+// false without setting err when the record can never fit in a segment; a
+// full disk is an error.
+bool journal_write( Journal *j, const gchar *data, gsize len, GError **err );
+void journal_commit( Journal *j );
+
+// Sender side, as records are released.
+void journal_ack( Journal *j, guint64 n );
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _LINE_READER_H_
+#define _LINE_READER_H_
+
+// Reads large blocks from a file descriptor into slabs and splits them into
+// lines in place. Lines are handed out as (slab, offset, length) views which
+// include the trailing newline.
+
+typedef struct LineReader LineReader;
+
+// Return true if a reference to the slab was kept for the line.
+typedef bool (*LineReaderFunc)( Slab *slab, gsize offset, gsize len, gpointer data );
+
+LineReader *line_reader_new( int fd, SlabPool *pool );
+void line_reader_free( LineReader *r );
+
+// Performs a single read and passes every completed line to func. Returns the
+// number of bytes read, or -1 on error including end of file.
+gssize line_reader_read( LineReader *r, LineReaderFunc func, gpointer data, GError **err );
+
+// Waits for input and moves it straight to out_fd, which must be a pipe with
+// no other writers, with splice. Each chunk ends on a line boundary; a partial
+// line left over goes out ahead of the next chunk. Anything read which out_fd
+// couldn't take is passed to func as usual. Returns the number of bytes moved
+// to out_fd, which is zero when it is full, at end of file, or when the input
+// can't be spliced, in which case line_reader_read should be used instead.
+// Only safe when nothing from this reader is waiting to be written elsewhere.
+gssize line_reader_splice( LineReader *r, int out_fd, LineReaderFunc func, gpointer data, GError **err );
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+// Gathers queued records into an iovec batch which is written with writev, or
+// copied into a shared-memory ring.
+
+typedef enum OutputFlushPolicy {
+	// Write each record as soon as it is added.
+	OUTPUT_FLUSH_RECORD,
+	// Write whenever the sender has caught up with the queue.
+	OUTPUT_FLUSH_DRAINED,
+	// Write only once the batch is full.
+	OUTPUT_FLUSH_FULL
+} OutputFlushPolicy;
+
+typedef enum OutputFormat {
+	// Each line as it was read.
+	OUTPUT_FORMAT_TEXT,
+	// Framed records, as described in vlb_binary.h.
+	OUTPUT_FORMAT_BINARY
+} OutputFormat;
+
+typedef struct Output Output;
+
+Output *output_new( int fd, OutputFlushPolicy policy, gsize max_bytes, guint max_records );
+// Writes records into a shared-memory ring instead of a file descriptor.
+Output *output_new_ring( ShmRing *ring, OutputFlushPolicy policy, gsize max_bytes, guint max_records );
+void output_free( Output *out );
+OutputFlushPolicy output_policy( const Output *out );
+// Tags every line with the instance it was read from, which in text means
+// prefixing it with the name and a space. Instance n is names[n - 1]. Before
+// output_use_binary, which lists them in the header.
+void output_set_instances( Output *out, gchar **names );
+// Writes the binary stream header and frames every line added after it. Only
+// for file descriptor outputs.
+bool output_use_binary( Output *out, GError **err );
+
+// Returns true when the batch should be flushed before adding more. instance
+// is the one the record was read from, or 0 without output_set_instances.
+// read_at is the monotonic time the record was read, or 0 if unknown.
+bool output_add( Output *out, guint instance, const gchar *data, gsize len, gint64 read_at );
+guint output_pending( const Output *out );
+gsize output_pending_bytes( const Output *out );
+bool output_flush( Output *out, GError **err );
+// The number of writev calls made so far.
+guint64 output_writes( const Output *out );
+// How many records, and their bytes, have been discarded so far for being too
+// large for the ring. They are still flushed as far as the caller is
+// concerned.
+guint64 output_oversize( const Output *out, guint64 *bytes );
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _OVERFLOW_H_
+#define _OVERFLOW_H_
+
+// What to give up when the queue fills faster than the sender empties it.
+
+typedef enum OverflowPolicy {
+	// Drop each line that doesn't fit.
+	OVERFLOW_DROP_NEWEST,
+	// Let the queue run past its limits and have the sender discard the
+	// oldest records to get back under them.
+	OVERFLOW_DROP_OLDEST,
+	// Turn away new transactions once the queue is nearly full, and the rest
+	// of any transaction which has lost a line.
+	OVERFLOW_DROP_TRANSACTIONS,
+	// Drop low priority tags once the queue is half full.
+	OVERFLOW_DROP_TAGS
+} OverflowPolicy;
+
+typedef enum OverflowReason {
+	OVERFLOW_KEEP,
+	OVERFLOW_TRANSACTION,
+	OVERFLOW_PRIORITY
+} OverflowReason;
+
+// How full the queue is, as a fraction of this.
+#define OVERFLOW_PRESSURE_FULL 256
+
+// Decides line by line for OVERFLOW_DROP_TRANSACTIONS and
+// OVERFLOW_DROP_TAGS. The other policies don't need one.
+typedef struct Overflow Overflow;
+
+// low_tags is a comma separated list of the tags to drop first, or NULL for
+// a default list of diagnostic tags. Only used by OVERFLOW_DROP_TAGS.
+Overflow *overflow_new( OverflowPolicy policy, const gchar *low_tags, GError **err );
+void overflow_free( Overflow *o );
+
+// Whether to queue a line. Below the thresholds this doesn't look at the
+// line at all.
+OverflowReason overflow_check( Overflow *o, const gchar *line, gsize len, guint pressure );
+// For a line which was checked but didn't fit in the queue.
+void overflow_dropped( Overflow *o, const gchar *line, gsize len );
+
+#endif
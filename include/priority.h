@@ -6,5 +6,21 @@ bool high_priority_thread( int prio, GError **err );
 
 bool set_thread_priority( pthread_t thread, int sched, int prio, GError **err );
 
+// A set of CPUs to run on. Only supported on linux.
+typedef struct CpuSet CpuSet;
+
+// Parses a list such as "0-3,8", setting G_OPTION_ERROR_BAD_VALUE.
+CpuSet *cpu_set_parse( const gchar *list, GError **err );
+// The CPUs the calling thread may run on.
+CpuSet *cpu_set_current( GError **err );
+void cpu_set_free( CpuSet *set );
+// Fills mask with bit i of word i/64 for CPU i, up to n words.
+void cpu_set_mask( const CpuSet *set, guint64 *mask, guint n );
+
+// Pins the calling thread to set. Called in a child before exec, it pins what
+// the child runs.
+bool pin_thread( const CpuSet *set, GError **err );
+// The NUMA node the calling thread is running on.
+bool current_numa_node( guint *node );
 
 #endif
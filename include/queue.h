@@ -0,0 +1,36 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+// A bounded single-producer/single-consumer ring of record descriptors. The
+// reader thread is the only producer and the sender thread the only consumer.
+
+// A record is a view into a slab, including the trailing newline. Each queued
+// record holds a reference to its slab.
+typedef struct QueueRecord {
+	Slab *slab;
+	guint32 offset, length;
+	// Monotonic time the line was read, in microseconds.
+	gint64 queued_at;
+} QueueRecord;
+
+// What a queued record counts against --max-queue-bytes, besides its slab;
+// see slab_charge.
+#define QUEUE_RECORD_COST ((guint64) sizeof(QueueRecord))
+
+typedef struct Queue Queue;
+
+Queue *queue_new( guint capacity, guint limit, GError **err );
+void queue_free( Queue *q );
+guint queue_capacity( const Queue *q );
+guint queue_length( const Queue *q );
+
+// Producer side.
+bool queue_push( Queue *q, const QueueRecord *rec );
+
+// Consumer side. queue_peek returns how many records may be accessed with
+// queue_at, counted from the oldest. They stay in the queue until released.
+guint queue_peek( Queue *q );
+QueueRecord *queue_at( Queue *q, guint i );
+void queue_release( Queue *q, guint n );
+
+#endif
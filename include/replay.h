@@ -0,0 +1,8 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+// Copies a captured varnishlog file to fd, sleeping so that requests come out
+// as far apart as their recorded timestamps.
+bool replay_file( const gchar *path, int fd, GError **err );
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+// Keeps or drops whole transactions while the queue is under pressure. Each
+// transaction is decided on its begin tag by hashing its fd or vxid with the
+// begin tag's payload, which in varnish 3's ReqStart carries the xid, and
+// everything it logs after that follows the decision. Lines of transactions
+// which began while everything was being kept, and lines outside any
+// transaction, are always kept.
+//
+// The rate backs off while the queue is filling and recovers once it is
+// draining, with a band in between where it holds steady. A sampler whose
+// floor and ceiling are equal keeps a fixed fraction.
+
+#define SAMPLER_RATE_ONE 65536
+
+typedef struct Sampler Sampler;
+
+// The rate starts at ceiling and never backs off below floor, both out of
+// SAMPLER_RATE_ONE.
+Sampler *sampler_new( guint floor, guint ceiling );
+void sampler_free( Sampler *s );
+
+bool sampler_keep( Sampler *s, const gchar *line, gsize len );
+// Called after each read with how full the queue is, from 0 to 1. Only
+// changes the rate once per adjustment interval.
+void sampler_adjust( Sampler *s, gint64 now, gdouble fill );
+// Out of SAMPLER_RATE_ONE.
+guint sampler_rate( const Sampler *s );
+guint64 sampler_transactions_dropped( const Sampler *s );
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _SENDER_H_
+#define _SENDER_H_
+
+// The queue of one varnishd instance.
+typedef struct SenderQueue {
+	Queue *queue;
+	StatsInstance *stats;
+	// Passed to output_add.
+	guint instance;
+
+	// Private to the sender thread. How many of the oldest records are in
+	// the output batch, and their length.
+	guint batched;
+	guint64 batched_bytes;
+} SenderQueue;
+
+typedef struct SenderControl {
+	GThread *thread;
+	// Merged in proportion to their backlogs. Only a single queue is
+	// supported with a spill or a server.
+	SenderQueue *queues;
+	guint nqueues;
+	// NULL unless overflow to disk is enabled.
+	Spill *spill;
+	Output *output;
+	// With --listen, records go to the server's clients instead of output.
+	Server *server;
+	volatile gint shutdown;
+	Stats *stats;
+	gint64 spin_us, park_timeout_us;
+	// Records queued longer than this are discarded unwritten. Zero disables
+	// it. Spilled records aren't timestamped, so never expire.
+	gint64 max_latency_us;
+	// With --drop-policy=oldest, the sender discards the oldest records while
+	// a queue holds more than this many or bytes. Zero disables either.
+	guint shed_records;
+	guint64 shed_bytes;
+	// NULL unless --compress-after is given.
+	Compressor *compressor;
+	// NULL unless --journal-dir is given. Released records are acknowledged,
+	// whether they were written or discarded on purpose.
+	Journal *journal;
+	// NULL unless --sender-cpus or --reader-cpus is given. The sender pins
+	// itself to these CPUs as it starts.
+	const struct CpuSet *cpus;
+
+	// Private to the sender thread. Set while reading from the spill, from
+	// reaching a spill marker in the queue until the end of that spilled run.
+	bool in_spill;
+	gint64 published_at;
+
+	Wakeup wakeup;
+} SenderControl;
+
+GError *sender_main( SenderControl *control );
+// Releases the n oldest records of q. written_at is when they were written
+// out, or zero if they weren't.
+void sender_release( SenderControl *control, SenderQueue *q, guint n, gint64 written_at );
+void stop_sender( SenderControl *control );
+// Only safe once the sender has exited, as this consumes from the queue.
+// Records drained aren't acknowledged, so stay in the journal.
+void drain_sender( SenderControl *control );
+
+#endif
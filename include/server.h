@@ -0,0 +1,19 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+// Serves queued records to any number of clients on a Unix socket, in place
+// of writing them to stdout. Each client has its own cursor into the queue
+// and records are only released once every client has written them. A client
+// which falls more than max_lag records behind is disconnected.
+
+typedef struct Server Server;
+struct SenderControl;
+
+Server *server_new( const gchar *path, guint max_lag, gsize max_bytes, guint max_records, GError **err );
+void server_free( Server *s );
+
+// Runs in the sender thread instead of the usual sender loop. Exits once
+// shut down and every connected client has caught up.
+GError *server_main( struct SenderControl *control );
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+// The producer side of the --shm-ring output; see vlb_ring.h for the layout
+// and vlb_client.h for the consumer side.
+
+typedef struct ShmRing ShmRing;
+
+// size is rounded up to a power of two.
+ShmRing *shm_ring_new( const gchar *path, gsize size, GError **err );
+// Marks the ring closed, so the consumer knows once it has read everything,
+// and removes the file.
+void shm_ring_free( ShmRing *r );
+
+// While *stop is set, a write waiting for room fails once the consumer has
+// stopped taking records, rather than waiting for one that may never come.
+void shm_ring_stop_on( ShmRing *r, volatile gint *stop );
+
+// Whether a record of len bytes can ever be written; larger ones fail with
+// EMSGSIZE.
+bool shm_ring_fits( const ShmRing *r, gsize len );
+// Copies a record in, first waiting for the consumer to make room if need be.
+// The record isn't visible to the consumer until shm_ring_publish.
+bool shm_ring_write( ShmRing *r, const gchar *data, gsize len, GError **err );
+void shm_ring_publish( ShmRing *r );
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+// Slabs are large refcounted buffers that queued records point into. Once every
+// record referencing a slab has been released it goes back to its pool.
+
+typedef struct SlabPool SlabPool;
+
+typedef struct Slab {
+	volatile gint refs;
+	gsize size, len;
+	gchar *data;
+	SlabPool *pool;
+	struct Slab *next;
+
+	// For --compress-after; see compressor.h. data is freed while a slab is
+	// compressed, and a slab whose data is gone isn't reused.
+	volatile gint state;
+	gchar *compressed;
+	gsize compressed_len;
+	// Set by the reader once it has offered the slab for compression.
+	bool offered;
+	// How many of the slab's records are queued; see slab_charge.
+	volatile gint queued;
+} Slab;
+
+SlabPool *slab_pool_new( gsize slab_size, guint max_free );
+void slab_pool_free( SlabPool *pool );
+gsize slab_pool_slab_size( const SlabPool *pool );
+
+// Returns an empty slab of at least min_size bytes holding one reference.
+Slab *slab_pool_get( SlabPool *pool, gsize min_size, GError **err );
+
+void slab_ref_n( Slab *slab, gint n );
+void slab_unref( Slab *slab );
+
+// A producer filling a slab holds a large bias reference rather than taking a
+// reference per record it hands out. slab_settle converts the bias into the
+// number of records actually handed out and drops the producer's reference.
+void slab_hold( Slab *slab );
+void slab_settle( Slab *slab, gint handed_out );
+// Whether the producer has settled the slab, so that nothing more will be
+// written to it.
+bool slab_sealed( Slab *slab );
+
+// A slab counts in full against --max-queue-bytes while any of its records are
+// queued, however few. slab_charge counts a record queued and returns the
+// slab's size if it's the only one, or 0. slab_credit counts one released and
+// returns the size if it was the last.
+gsize slab_charge( Slab *slab );
+gsize slab_credit( Slab *slab );
+
+#endif
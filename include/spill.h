@@ -0,0 +1,33 @@
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+// An overflow tier for the queue backed by memory-mapped segment files. The
+// reader appends records and the sender consumes them in the same order. A
+// run of spilled records is terminated by spill_end, after which the sender
+// goes back to the in-memory queue.
+
+typedef struct Spill Spill;
+
+typedef enum SpillStatus {
+	SPILL_RECORD,
+	SPILL_EMPTY,
+	SPILL_END
+} SpillStatus;
+
+Spill *spill_new( const gchar *dir, gsize segment_size, guint64 max_bytes, GError **err );
+void spill_free( Spill *s );
+
+// Producer side. spill_append returns false without setting err when the disk
+// budget is exhausted or the record can never fit in a segment.
+bool spill_append( Spill *s, const gchar *data, gsize len, GError **err );
+void spill_end( Spill *s );
+// Bytes appended that the consumer has not yet released.
+guint64 spill_pending_bytes( Spill *s );
+
+// Consumer side. Records returned by spill_next stay mapped until
+// spill_release is called.
+bool spill_readable( Spill *s );
+SpillStatus spill_next( Spill *s, const gchar **data, gsize *len );
+void spill_release( Spill *s );
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// Counters published through --queue-length-file for external pollers. The
+// layout is fixed for a given version; fields are only ever appended, with
+// the version bumped. Every field is naturally aligned and updated with a
+// single atomic store or add, so a reader needs no locking, but it should
+// expect fields to be sampled at slightly different moments.
+//
+// lines_queued must stay at offset 0 as a native int: older readers of the
+// file only know about it. The fields before magic predate versioning.
+
+#define STATS_MAGIC 0x53424c56 // "VLBS" in little endian
+#define STATS_VERSION 13
+
+// Bucket 0 counts lines that spent less than 1us in the queue, bucket i
+// those that spent [2^(i-1), 2^i) us. The last bucket also takes the rest.
+#define STATS_RESIDENCY_BUCKETS 32
+
+// The finer histogram splits each power of two above 2^SUB_BITS us into
+// 2^SUB_BITS equal buckets, so a value is off by at most 1/2^SUB_BITS; see
+// stats_histogram_floor. Below that each microsecond has its own bucket.
+// The last bucket takes everything from about 2^MAX_EXP us up.
+#define STATS_RESIDENCY_SUB_BITS 3
+#define STATS_RESIDENCY_MAX_EXP 39
+#define STATS_RESIDENCY_HDR_BUCKETS ((STATS_RESIDENCY_MAX_EXP - STATS_RESIDENCY_SUB_BITS + 2) << STATS_RESIDENCY_SUB_BITS)
+// How often the sender refreshes the residency percentiles.
+#define STATS_PUBLISH_INTERVAL_US 100000
+
+#define STATS_MAX_INSTANCES 16
+// CPU masks cover CPUs 0 to 64*STATS_CPU_MASK_WORDS-1.
+#define STATS_CPU_MASK_WORDS 4
+#define STATS_INSTANCE_NAME_SIZE 64
+
+// The counters of one varnishd instance, each also counted in the totals of
+// Stats. Lines count as in Stats, and bytes_written as read, without the
+// instance name or binary framing.
+typedef struct StatsInstance {
+	// Empty without --instance.
+	gchar name[STATS_INSTANCE_NAME_SIZE];
+
+	// Written by the reader thread. lines_dropped covers every reason the
+	// reader drops lines for.
+	volatile guint64 lines_read, bytes_read;
+	volatile guint64 lines_dropped, bytes_dropped;
+	volatile guint64 child_restarts;
+	// Written by both threads, as bytes_queued is. What is queued counts
+	// against --max-queue-size and --max-queue-bytes for this instance alone.
+	volatile guint64 lines_queued, bytes_queued;
+
+	// Written by the sender thread. Lines the sender discards for
+	// --max-latency or --drop-policy=oldest are counted together.
+	cache_aligned volatile guint64 lines_written, bytes_written;
+	volatile guint64 lines_shed, bytes_shed;
+} StatsInstance;
+
+typedef struct Stats {
+	volatile gint lines_queued;
+	guint32 reserved;
+	volatile guint64 bytes_queued, bytes_queued_high_water;
+
+	guint32 magic, version;
+	// sizeof(Stats), so readers can tell which fields are present.
+	guint32 size;
+	guint32 residency_buckets;
+
+	// Written by the reader thread. With --group, each transaction counts as
+	// a single line once it has been grouped, so only lines_read and
+	// bytes_read count lines as read.
+	volatile guint64 lines_read, bytes_read;
+	volatile guint64 lines_dropped, bytes_dropped;
+	volatile guint64 lines_queued_high_water;
+	volatile guint64 read_syscalls;
+
+	// Written by the sender thread.
+	cache_aligned volatile guint64 lines_written;
+	volatile guint64 bytes_written;
+	volatile guint64 write_syscalls;
+	// Wall clock time in microseconds since the epoch.
+	volatile gint64 last_write_time;
+	// Only covers lines that went through the in-memory queue.
+	volatile guint64 residency_us[STATS_RESIDENCY_BUCKETS];
+
+	// Version 2. Written by the reader thread. Bytes passed straight through
+	// to stdout while the queue was empty; they aren't in bytes_read or
+	// bytes_written.
+	volatile guint64 bytes_spliced;
+	volatile guint64 splice_syscalls;
+
+	// Version 3. Written by the reader thread. Lines left out by the tag and
+	// payload filters; they count as read but not as dropped.
+	volatile guint64 lines_filtered, bytes_filtered;
+
+	// Version 4. Written by the sender thread, only with --listen.
+	// clients_lagged counts clients disconnected for falling behind.
+	cache_aligned volatile guint64 clients_connected;
+	volatile guint64 clients_accepted, clients_lagged;
+
+	// Version 5. Written by the sender thread. The residency times again, in
+	// the finer histogram. The percentiles are over everything since startup
+	// and lag by up to STATS_PUBLISH_INTERVAL_US. Lines shed by --max-latency
+	// count as expired rather than dropped, and not towards residency.
+	cache_aligned guint32 residency_sub_bits, residency_hdr_buckets;
+	volatile guint64 residency_max_us;
+	volatile guint64 residency_p50_us, residency_p99_us;
+	volatile guint64 lines_expired, bytes_expired;
+	volatile guint64 residency_hdr[STATS_RESIDENCY_HDR_BUCKETS];
+
+	// Version 6. Why lines were dropped, for --drop-policy. Written by the
+	// reader thread and included in lines_dropped: lines that didn't fit in
+	// the queue, lines of transactions turned away, and low priority tags.
+	cache_aligned volatile guint64 lines_dropped_full, bytes_dropped_full;
+	volatile guint64 lines_dropped_transaction, bytes_dropped_transaction;
+	volatile guint64 lines_dropped_priority, bytes_dropped_priority;
+	// Written by the sender thread, and not included in lines_dropped: the
+	// oldest records discarded to get back under the queue limits.
+	cache_aligned volatile guint64 lines_dropped_oldest, bytes_dropped_oldest;
+
+	// Version 7. Written by the reader thread, with --sample. The fraction of
+	// new transactions currently kept, in parts per million, for reweighting
+	// counts downstream. Lines of transactions sampled out count as read but
+	// not as dropped.
+	cache_aligned volatile guint64 sample_rate_ppm;
+	volatile guint64 transactions_sampled_out;
+	volatile guint64 lines_sampled_out, bytes_sampled_out;
+
+	// Version 8, with --compress-after. Written by the compressor thread:
+	// slabs compressed, and the bytes they held before and after. Written by
+	// the sender thread: slabs decompressed again to be written. Written by
+	// both: how many bytes compression currently takes off bytes_queued when
+	// checking it against --max-queue-bytes.
+	cache_aligned volatile guint64 slabs_compressed;
+	volatile guint64 bytes_compressed_in, bytes_compressed_out;
+	cache_aligned volatile guint64 slabs_decompressed;
+	volatile guint64 bytes_compression_saved;
+
+	// Version 9, with --journal-dir. Written by the reader thread: records
+	// added to the journal, and those the last run left unacknowledged which
+	// were queued again at startup. Written by the journal thread: how many
+	// times it synced the journal to disk.
+	cache_aligned volatile guint64 lines_journaled, bytes_journaled;
+	volatile guint64 lines_replayed, bytes_replayed;
+	cache_aligned volatile guint64 journal_syncs;
+
+	// Version 10, for a supervised varnishlog. Written by the reader thread:
+	// children started in place of one that exited, and attempts that failed;
+	// how the ones that exited did so; and the time in milliseconds from
+	// losing a child to reading the first output of the next, in total, for
+	// the latest gap and the longest.
+	cache_aligned volatile guint64 child_restarts, child_restart_failures;
+	volatile guint64 child_exits_success, child_exits_failure, child_exits_signaled;
+	volatile guint64 child_downtime_ms, child_last_gap_ms, child_max_gap_ms;
+
+	// Version 11. The first instances entries of instance are in use, one
+	// for each --instance in the order given, or a single unnamed one.
+	// instance_size is sizeof(StatsInstance), for fields appended later.
+	cache_aligned guint32 instances, instance_size;
+	StatsInstance instance[STATS_MAX_INSTANCES];
+
+	// Version 12. The CPUs the reader thread, the sender thread and the
+	// varnishlog child were pinned to, bit i of word i/64 for CPU i; all zero
+	// unless pinned. reader_numa_node is the node the reader started on, where
+	// the queues' memory is, or G_MAXUINT32 if unknown.
+	cache_aligned volatile guint64 reader_cpus[STATS_CPU_MASK_WORDS];
+	volatile guint64 sender_cpus[STATS_CPU_MASK_WORDS];
+	volatile guint64 child_cpus[STATS_CPU_MASK_WORDS];
+	volatile guint32 reader_numa_node;
+
+	// Version 13. Written by the sender thread, only with --shm-ring: records
+	// discarded for being too large for the ring ever to hold. They aren't
+	// counted in lines_written, though an instance's lines_written still
+	// includes them.
+	cache_aligned volatile guint64 lines_dropped_oversize, bytes_dropped_oversize;
+} Stats;
+
+void stats_init( Stats *stats );
+// Only for the thread that owns the field.
+void stats_add( volatile guint64 *field, guint64 n );
+void stats_max( volatile guint64 *field, guint64 value );
+void stats_add_residency( Stats *stats, gint64 us );
+// bytes_queued less what compression saves, for checking against
+// --max-queue-bytes. Safe from any thread.
+guint64 stats_bytes_held( const Stats *stats );
+// The same for one instance. Compression is only used with a single instance,
+// so its saving all comes off that one.
+guint64 stats_instance_bytes_held( const Stats *stats, const StatsInstance *instance );
+// The finer histogram's buckets, for any other microsecond timings too:
+// which bucket a value falls in, and the smallest value counted in bucket i.
+guint stats_histogram_bucket( guint64 us );
+guint64 stats_histogram_floor( guint i );
+// Returns the lower bound of the bucket holding the pth fraction of a
+// histogram of STATS_RESIDENCY_HDR_BUCKETS, or 0 if it is empty.
+guint64 stats_histogram_percentile( const volatile guint64 *buckets, double p );
+// Safe from any thread.
+guint64 stats_residency_percentile( const Stats *stats, double p );
+// Refreshes the published percentiles.
+void stats_publish_residency( Stats *stats );
+
+#endif
@@ -1,10 +1,71 @@
 #ifndef _VARNISHLOG_H_
 #define _VARNISHLOG_H_
 
+typedef enum VarnishlogSource {
+	// Run a command, varnishlog -Ou by default, and read its output.
+	VARNISHLOG_SOURCE_COMMAND,
+	VARNISHLOG_SOURCE_STDIN,
+	// A named pipe which may be written to by one writer after another.
+	VARNISHLOG_SOURCE_FIFO,
+	// Replay a captured log, either as fast as it can be read or paced by the
+	// request timestamps in it.
+	VARNISHLOG_SOURCE_FILE
+} VarnishlogSource;
+
+typedef struct VarnishlogInput {
+	VarnishlogSource source;
+	// For VARNISHLOG_SOURCE_COMMAND; NULL runs varnishlog -Ou.
+	gchar **argv;
+	// For VARNISHLOG_SOURCE_COMMAND. Unless NULL, the varnishd instance to
+	// read, passed to the command as -n INSTANCE.
+	const gchar *instance;
+	// For VARNISHLOG_SOURCE_FIFO and VARNISHLOG_SOURCE_FILE.
+	const gchar *path;
+	bool realtime;
+	gboolean lowprio;
+	// For VARNISHLOG_SOURCE_COMMAND. The longest a restart waits; zero means
+	// the child isn't restarted, and its exit is an error.
+	gint64 max_restart_delay_us;
+	// Unless NULL, the CPUs the child and what it runs are pinned to.
+	const struct CpuSet *cpus;
+} VarnishlogInput;
+
 typedef struct Varnishlog Varnishlog;
 
 bool shutdown_varnishlog( Varnishlog *, int *stat, GError **err );
-Varnishlog *start_varnishlog( gboolean, GError **err );
-GString *read_varnishlog_entry( Varnishlog *v, GError **err );
+Varnishlog *start_varnishlog( const VarnishlogInput *input, SlabPool *pool, GError **err );
+gssize read_varnishlog_entries( Varnishlog *v, LineReaderFunc func, gpointer data, GError **err );
+// See line_reader_splice.
+gssize splice_varnishlog_entries( Varnishlog *v, int out_fd, LineReaderFunc func, gpointer data, GError **err );
+// Whether the end of the input is expected rather than an error.
+bool varnishlog_finite( const Varnishlog *v );
+
+// The input, to wait on before reading, and the pipe a child reports errors
+// over, or -1 if there is no child or it has closed the pipe.
+int varnishlog_fd( const Varnishlog *v );
+int varnishlog_error_fd( const Varnishlog *v );
+// Once the error pipe is readable: returns false with the child's error if it
+// sent one, and otherwise marks the pipe finished, which it is from then on.
+bool varnishlog_read_error( Varnishlog *v, GError **err );
+// Collects the child's exit status if it has exited, for shutdown_varnishlog
+// to return later. Its output is still read to the end as usual.
+bool varnishlog_reap( Varnishlog *v, GError **err );
+
+// A supervised child is restarted when its output ends, rather than that
+// ending the input. Each restart waits twice as long as the last, up to
+// max_restart_delay_us, and a child which ran for longer than that starts the
+// delays over.
+bool varnishlog_supervised( const Varnishlog *v );
+// Whether err, from reading or from the child, means the child should be
+// restarted. The first child's errors are fatal, and so is its output ending
+// before it wrote anything or had run for a second.
+bool varnishlog_lost( const Varnishlog *v, const GError *err );
+// Stops the child, returning how it exited, and closes its fds, which should
+// no longer be watched. A restart is then due at varnishlog_restart_at.
+bool varnishlog_stop_child( Varnishlog *v, int *stat, GError **err );
+// The monotonic time the next child is due, or zero while one is running.
+gint64 varnishlog_restart_at( const Varnishlog *v );
+// Starts the next child. If that fails, the restart after is put off.
+bool varnishlog_restart( Varnishlog *v, GError **err );
 
 #endif
@@ -0,0 +1,56 @@
+#ifndef _VLB_BINARY_H_
+#define _VLB_BINARY_H_
+
+// The layout of --output-format=binary, for consumers, so it only uses
+// standard C types. Everything is in the writer's native byte order; the
+// magic number tells readers which one that is.
+//
+// The stream starts with a VlbBinaryHeader, followed by the tag table: ntags
+// names, each a one byte length and that many characters, tags_size bytes in
+// all. Tag ID n is the nth name, counting from 1. IDs are never reassigned,
+// only appended. From version 2 the instance table follows, ninstances names
+// given to --instance in the same form, instances_size bytes in all.
+//
+// Then each line of the log is a VlbBinaryRecord followed by its payload,
+// length - record_header_size bytes without a trailing newline. Readers
+// should use header_size and record_header_size rather than the sizes of the
+// structs here, so fields can be added to the end of either.
+
+#include <stdint.h>
+
+#define VLB_BINARY_MAGIC 0x42424c56 // "VLBB" in little endian
+#define VLB_BINARY_VERSION 2
+
+typedef struct VlbBinaryHeader {
+	uint32_t magic, version;
+	uint32_t header_size, record_header_size;
+	uint32_t ntags, tags_size;
+	// Version 2.
+	uint32_t ninstances, instances_size;
+} VlbBinaryHeader;
+
+// A line that wasn't a log record, or had a tag missing from the table. The
+// payload is the whole line.
+#define VLB_BINARY_TAG_UNKNOWN 0
+
+#define VLB_BINARY_CLIENT 'c'
+#define VLB_BINARY_BACKEND 'b'
+
+typedef struct VlbBinaryRecord {
+	// Including this header.
+	uint32_t length;
+	uint16_t tag;
+	// VLB_BINARY_CLIENT, VLB_BINARY_BACKEND, '-' for neither, or 0 if the tag
+	// is unknown.
+	uint8_t marker;
+	// Which instance the line was read from, counting from 1 in the instance
+	// table, or 0 without --instance. Always 0 before version 2.
+	uint8_t instance;
+	// The fd (varnish 3) or vxid (varnish 4 and later).
+	uint64_t id;
+	// When varnishlog-buffer read the line, in microseconds, or 0 if that
+	// wasn't kept, such as for lines that overflowed to disk.
+	int64_t monotonic_us, realtime_us;
+} VlbBinaryRecord;
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _VLB_CLIENT_H_
+#define _VLB_CLIENT_H_
+
+// Reads records from a varnishlog-buffer --shm-ring in place. Functions
+// returning int return -1 and set errno on failure. Only one client may read
+// a ring at a time. The ring is opened for writing, to hand space back, and
+// is created readable and writable only by its owner, so the client has to
+// run as the same user as varnishlog-buffer.
+
+#include <stddef.h>
+
+typedef struct vlb_client vlb_client;
+
+vlb_client *vlb_client_open( const char *path );
+void vlb_client_close( vlb_client *c );
+
+// Waits up to timeout_ms, or indefinitely if negative, for the next record
+// and points data at it, including its trailing newline. The record stays
+// valid until vlb_client_release. Returns 1 for a record, 0 on timeout, and
+// -1 with errno set to EPIPE once the buffer has exited and everything it
+// wrote has been read.
+int vlb_client_next( vlb_client *c, const char **data, size_t *len, int timeout_ms );
+
+// Hands back every record returned so far so the space can be reused.
+// Releasing in batches saves the buffer from having to look at the cursor
+// after every record.
+void vlb_client_release( vlb_client *c );
+
+#endif
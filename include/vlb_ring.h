@@ -0,0 +1,51 @@
+#ifndef _VLB_RING_H_
+#define _VLB_RING_H_
+
+// The layout of the --shm-ring file, shared by varnishlog-buffer and the
+// client library, so it only uses standard C types.
+//
+// The header is followed by a data area of size bytes, a power of two. head
+// and tail count bytes written and consumed and only ever increase. Each
+// record is a 32 bit length followed by the line, padded so the next record
+// starts on an 8 byte boundary. Records never wrap; a length of VLB_RING_WRAP
+// means the rest of the data area is unused and the next record is at its
+// start.
+//
+// There is one producer and one consumer. Either side that finds nothing to
+// do sets its waiting flag and sleeps on the other side's sequence word with
+// a futex. The other side bumps the word and wakes it after moving its
+// counter, if the flag is set.
+
+#include <stdint.h>
+
+#define VLB_RING_MAGIC 0x52424c56 // "VLBR" in little endian
+#define VLB_RING_VERSION 1
+#define VLB_RING_ALIGN 8
+#define VLB_RING_WRAP UINT32_MAX
+#define VLB_RING_RECORD_SIZE( len ) (((uint64_t) (len) + sizeof(uint32_t) + VLB_RING_ALIGN - 1) & ~(uint64_t) (VLB_RING_ALIGN - 1))
+
+typedef struct VlbRingHeader {
+	uint32_t magic, version;
+	// Offset of the data area from the start of the file.
+	uint32_t header_size;
+	uint32_t reserved;
+	uint64_t size;
+
+	// Written by the producer.
+	__attribute__((aligned(64))) volatile uint64_t head;
+	volatile uint32_t data_seq;
+	// Set once the producer has exited; nothing more will be written.
+	volatile uint32_t closed;
+
+	// Written by the consumer.
+	__attribute__((aligned(64))) volatile uint64_t tail;
+	volatile uint32_t space_seq;
+
+	// Each written by the side that waits, and cleared by the side that wakes.
+	__attribute__((aligned(64))) volatile uint32_t consumer_waiting;
+	__attribute__((aligned(64))) volatile uint32_t producer_waiting;
+} VlbRingHeader;
+
+#define VLB_RING_HEADER_SIZE 4096
+
+#endif
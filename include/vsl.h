@@ -0,0 +1,30 @@
+#ifndef _VSL_H_
+#define _VSL_H_
+
+// A line of varnishlog -Ou output, "%5d %-12s %c %s": an fd or vxid, the tag,
+// the c/b/- marker and the payload. The pointers are into the line.
+typedef struct VslLine {
+	guint64 id;
+	const gchar *tag;
+	gsize tag_len;
+	gchar marker;
+	// Excludes the trailing newline.
+	const gchar *payload;
+	gsize payload_len;
+} VslLine;
+
+// Returns false if the line doesn't look like a log record, such as varnish
+// 4's group headers. line need not be NUL terminated.
+bool vsl_parse( const gchar *line, gsize len, VslLine *out );
+
+// Stable numeric IDs for the tags of varnish 3 and later, counting from 1.
+// Returns 0 for tags not in the table.
+guint vsl_tag_id( const gchar *tag, gsize len );
+guint vsl_tag_count( void );
+const gchar *vsl_tag_name( guint id );
+// Whether a tag opens or closes a transaction: ReqStart, SessionOpen,
+// BackendOpen or Begin, and the grouper's end tags. False for ID 0.
+bool vsl_tag_begins( guint id );
+bool vsl_tag_ends( guint id );
+
+#endif
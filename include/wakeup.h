@@ -0,0 +1,40 @@
+#ifndef _WAKEUP_H_
+#define _WAKEUP_H_
+
+// Lets one consumer thread park until a producer has work for it. Producers
+// only make a syscall when the consumer is actually parked.
+
+typedef bool (*WakeupReadyFunc)( gpointer data );
+
+typedef struct Wakeup {
+	cache_aligned volatile gint parked;
+	// An eventfd for consumers which wait in epoll, or -1.
+	int fd;
+} Wakeup;
+
+void wakeup_init( Wakeup *w );
+// Makes wakeup_wake signal an eventfd instead, for a consumer that waits in
+// epoll with wakeup_prepare and wakeup_finish rather than in wakeup_wait.
+bool wakeup_use_fd( Wakeup *w, GError **err );
+int wakeup_fd( const Wakeup *w );
+void wakeup_clear( Wakeup *w );
+
+// Consumer side. Parks until woken, ready returns true, or timeout_us passes
+// (negative waits indefinitely). ready is checked after announcing the park so
+// a concurrent wakeup can't be missed. If spin_us is positive ready is polled
+// for that long before parking.
+void wakeup_wait( Wakeup *w, WakeupReadyFunc ready, gpointer data, gint64 spin_us, gint64 timeout_us );
+
+// Consumer side, with wakeup_use_fd. Announces a park and returns true if
+// the caller should go on to wait for wakeup_fd, or false if ready already
+// returned true. Either way wakeup_finish must follow. The eventfd is never
+// reset, so it has to be polled edge triggered.
+bool wakeup_prepare( Wakeup *w, WakeupReadyFunc ready, gpointer data );
+void wakeup_finish( Wakeup *w );
+
+// Producer side. Call wakeup_parked after publishing work; only if it returns
+// true is wakeup_wake (a syscall) needed.
+bool wakeup_parked( Wakeup *w );
+void wakeup_wake( Wakeup *w );
+
+#endif
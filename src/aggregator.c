@@ -0,0 +1,408 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "slab.h"
+#include "line_reader.h"
+#include "stats.h"
+#include "vsl.h"
+#include "aggregator.h"
+
+// Each dimension counts at most this many distinct values per interval, and
+// the rest under "other". Longer values are cut short.
+#define MAX_KEYS 100
+#define MAX_VALUE_LEN 128
+// Wide enough for any timestamp varnish logs.
+#define MAX_NUMBER_LEN 32
+#define MAX_TAG_IDS 256
+
+typedef enum Dimension {
+	DIM_STATUS,
+	DIM_CACHE,
+	DIM_BACKEND,
+	DIM_HOST,
+	DIM_URL,
+	NDIMS
+} Dimension;
+
+static const gchar *const dimension_names[NDIMS] = { "status", "cache", "backend", "host", "url" };
+
+// What a tag tells us about a request.
+typedef enum Role {
+	ROLE_NONE,
+	ROLE_URL,
+	ROLE_HEADER,
+	ROLE_STATUS,
+	ROLE_VCL_CALL,
+	// Varnish 3's Backend tag on client requests.
+	ROLE_BACKEND,
+	// Varnish 4's BackendOpen and BackendReuse on backend fetches.
+	ROLE_FETCH,
+	// Varnish 3's ReqEnd, which also ends the request.
+	ROLE_REQ_END,
+	// Varnish 4's Timestamp.
+	ROLE_TIMESTAMP
+} Role;
+
+typedef struct Request {
+	// Which interval it started in, so abandoned ones can be let go.
+	guint64 interval;
+	guint status;
+	// Negative until known.
+	gint64 response_us;
+	gchar values[NDIMS][MAX_VALUE_LEN];
+} Request;
+
+struct Aggregator {
+	SlabPool *pool;
+	gint64 interval_us;
+	guint url_depth;
+	LineReaderFunc func;
+	gpointer data;
+
+	guint8 roles[MAX_TAG_IDS];
+	// Client requests in progress, keyed like the grouper.
+	GHashTable *requests;
+
+	guint64 interval;
+	gint64 next_at;
+	// Wall clock, for the rollup.
+	gint64 started_at;
+	guint64 nrequests;
+	// Value to a guint64 count, per dimension.
+	GHashTable *counts[NDIMS];
+	guint64 response_us[STATS_RESIDENCY_HDR_BUCKETS];
+	guint64 max_response_us;
+};
+
+static void set_role( Aggregator *a, const gchar *name, Role role ) {
+	guint id = vsl_tag_id(name, strlen(name));
+	g_assert(id != 0);
+	a->roles[id] = role;
+}
+
+static void free_request( gpointer request ) {
+	g_slice_free(Request, request);
+}
+
+Aggregator *aggregator_new( SlabPool *pool, gint64 interval_us, guint url_depth, LineReaderFunc func, gpointer data ) {
+	g_assert(interval_us > 0 && vsl_tag_count() < MAX_TAG_IDS);
+
+	Aggregator *a = g_slice_new0(Aggregator);
+	a->pool = pool;
+	a->interval_us = interval_us;
+	a->url_depth = url_depth;
+	a->func = func;
+	a->data = data;
+
+	set_role(a, "RxURL", ROLE_URL);
+	set_role(a, "ReqURL", ROLE_URL);
+	set_role(a, "RxHeader", ROLE_HEADER);
+	set_role(a, "ReqHeader", ROLE_HEADER);
+	set_role(a, "TxStatus", ROLE_STATUS);
+	set_role(a, "RespStatus", ROLE_STATUS);
+	set_role(a, "VCL_call", ROLE_VCL_CALL);
+	set_role(a, "Backend", ROLE_BACKEND);
+	set_role(a, "BackendOpen", ROLE_FETCH);
+	set_role(a, "BackendReuse", ROLE_FETCH);
+	set_role(a, "ReqEnd", ROLE_REQ_END);
+	set_role(a, "Timestamp", ROLE_TIMESTAMP);
+
+	a->requests = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, free_request);
+	for( guint i = 0; i < NDIMS; i++ )
+		a->counts[i] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	a->next_at = g_get_monotonic_time() + interval_us;
+	a->started_at = g_get_real_time();
+	return a;
+}
+
+void aggregator_free( Aggregator *a ) {
+	g_hash_table_destroy(a->requests);
+	for( guint i = 0; i < NDIMS; i++ ) g_hash_table_destroy(a->counts[i]);
+	g_slice_free(Aggregator, a);
+}
+
+// Finds the nth space separated word.
+static bool word( const gchar *p, gsize len, guint n, const gchar **start, gsize *word_len ) {
+	const gchar *e = p + len;
+	for( guint i = 0; ; i++ ) {
+		while( p < e && g_ascii_isspace(*p) ) p++;
+		if( p == e ) return false;
+		const gchar *w = p;
+		while( p < e && !g_ascii_isspace(*p) ) p++;
+		if( i == n ) {
+			*start = w;
+			*word_len = p - w;
+			return true;
+		}
+	}
+}
+
+static bool is_number( const gchar *p, gsize len ) {
+	if( len == 0 ) return false;
+	for( gsize i = 0; i < len; i++ ) {
+		if( !g_ascii_isdigit(p[i]) ) return false;
+	}
+	return true;
+}
+
+// Seconds, as logged, in microseconds. Negative if it isn't a number.
+static gint64 word_us( const gchar *p, gsize len, guint n ) {
+	const gchar *w;
+	gsize wlen;
+	if( !word(p, len, n, &w, &wlen) || wlen >= MAX_NUMBER_LEN ) return -1;
+
+	gchar buf[MAX_NUMBER_LEN];
+	memcpy(buf, w, wlen);
+	buf[wlen] = '\0';
+	gchar *end;
+	gdouble seconds = g_ascii_strtod(buf, &end);
+	if( end == buf || *end != '\0' ) return -1;
+	return seconds * G_USEC_PER_SEC;
+}
+
+static void set_value( gchar *dst, const gchar *src, gsize len ) {
+	len = MIN(len, MAX_VALUE_LEN - 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+static void count( Aggregator *a, Dimension dim, const gchar *value ) {
+	if( *value == '\0' ) return;
+
+	GHashTable *counts = a->counts[dim];
+	guint64 *n = g_hash_table_lookup(counts, value);
+	if( n == NULL ) {
+		if( g_hash_table_size(counts) >= MAX_KEYS ) {
+			value = "other";
+			n = g_hash_table_lookup(counts, value);
+		}
+		if( n == NULL ) {
+			n = g_new0(guint64, 1);
+			g_hash_table_insert(counts, g_strdup(value), n);
+		}
+	}
+	(*n)++;
+}
+
+// Up to the url_depth'th slash after the first, or the query string.
+static void set_url( Aggregator *a, Request *r, const gchar *p, gsize len ) {
+	gsize i = 0;
+	guint segments = 0;
+	if( i < len && p[i] == '/' ) i++;
+	for( ; i < len && p[i] != '?'; i++ ) {
+		if( p[i] == '/' && ++segments >= a->url_depth ) break;
+	}
+	if( a->url_depth == 0 ) i = MIN(len, 1);
+	set_value(r->values[DIM_URL], p, i);
+}
+
+static void finish_request( Aggregator *a, Request *r ) {
+	// Sessions end without ever having a status.
+	if( r->status == 0 ) return;
+
+	gchar status[16];
+	g_snprintf(status, sizeof(status), "%u", r->status);
+	set_value(r->values[DIM_STATUS], status, strlen(status));
+	for( guint i = 0; i < NDIMS; i++ ) count(a, i, r->values[i]);
+	a->nrequests++;
+
+	if( r->response_us >= 0 ) {
+		a->response_us[stats_histogram_bucket(r->response_us)]++;
+		a->max_response_us = MAX(a->max_response_us, (guint64) r->response_us);
+	}
+}
+
+static Request *get_request( Aggregator *a, gint64 key ) {
+	Request *r = g_hash_table_lookup(a->requests, &key);
+	if( r != NULL ) return r;
+
+	r = g_slice_new0(Request);
+	r->interval = a->interval;
+	r->response_us = -1;
+	gint64 *k = g_new(gint64, 1);
+	*k = key;
+	g_hash_table_insert(a->requests, k, r);
+	return r;
+}
+
+static void add_request_line( Aggregator *a, Role role, const VslLine *line, Request *r ) {
+	const gchar *p = line->payload, *w;
+	gsize len = line->payload_len, wlen;
+
+	switch( role ) {
+		case ROLE_URL:
+			set_url(a, r, p, len);
+			break;
+		case ROLE_HEADER:
+			if( len > 5 && g_ascii_strncasecmp(p, "Host:", 5) == 0 && word(p + 5, len - 5, 0, &w, &wlen) )
+				set_value(r->values[DIM_HOST], w, wlen);
+			break;
+		case ROLE_STATUS:
+			if( word(p, len, 0, &w, &wlen) && is_number(w, wlen) && wlen < 4 ) r->status = strtoul(w, NULL, 10);
+			break;
+		case ROLE_VCL_CALL:
+			// The first of these is what happened to the request.
+			if(
+				r->values[DIM_CACHE][0] == '\0' && word(p, len, 0, &w, &wlen) && (
+					(wlen == 3 && (g_ascii_strncasecmp(w, "hit", 3) == 0)) ||
+					(wlen == 4 && (g_ascii_strncasecmp(w, "miss", 4) == 0 || g_ascii_strncasecmp(w, "pass", 4) == 0 || g_ascii_strncasecmp(w, "pipe", 4) == 0))
+				)
+			) {
+				set_value(r->values[DIM_CACHE], w, wlen);
+				for( gchar *c = r->values[DIM_CACHE]; *c != '\0'; c++ ) *c = g_ascii_tolower(*c);
+			}
+			break;
+		case ROLE_BACKEND:
+			// The fd, the director and the backend.
+			if( word(p, len, 2, &w, &wlen) ) set_value(r->values[DIM_BACKEND], w, wlen);
+			break;
+		case ROLE_REQ_END:
+			// The xid, then when the request started and ended.
+			if( r->response_us < 0 ) {
+				gint64 start = word_us(p, len, 1), end = word_us(p, len, 2);
+				if( start >= 0 && end >= start ) r->response_us = end - start;
+			}
+			break;
+		case ROLE_TIMESTAMP:
+			// "Resp: absolute since-start since-last"
+			if( word(p, len, 0, &w, &wlen) && wlen == 5 && memcmp(w, "Resp:", 5) == 0 )
+				r->response_us = word_us(p, len, 2);
+			break;
+		default:
+			break;
+	}
+}
+
+void aggregator_add( Aggregator *a, const gchar *p, gsize len ) {
+	VslLine line;
+	if( !vsl_parse(p, len, &line) ) return;
+	guint tag = vsl_tag_id(line.tag, line.tag_len);
+	Role role = a->roles[tag];
+	bool end = vsl_tag_ends(tag);
+
+	if( line.marker == 'b' ) {
+		// Varnish 3 logs the backend name first and counts on client requests
+		// instead, varnish 4 the fd first.
+		const gchar *w;
+		gsize wlen;
+		gchar backend[MAX_VALUE_LEN];
+		if(
+			role == ROLE_FETCH &&
+			word(line.payload, line.payload_len, 0, &w, &wlen) && is_number(w, wlen) &&
+			word(line.payload, line.payload_len, 1, &w, &wlen)
+		) {
+			set_value(backend, w, wlen);
+			count(a, DIM_BACKEND, backend);
+		}
+		return;
+	}
+	if( line.marker != 'c' || (role == ROLE_NONE && !end) ) return;
+
+	gint64 key = (gint64) (line.id << 8) | line.marker;
+	Request *r;
+	if( role != ROLE_NONE ) {
+		r = get_request(a, key);
+		add_request_line(a, role, &line, r);
+	} else {
+		r = g_hash_table_lookup(a->requests, &key);
+	}
+
+	if( end && r != NULL ) {
+		finish_request(a, r);
+		g_hash_table_remove(a->requests, &key);
+	}
+}
+
+static void append_json_string( GString *out, const gchar *s ) {
+	g_string_append_c(out, '"');
+	for( ; *s != '\0'; s++ ) {
+		guchar c = *s;
+		if( c == '"' || c == '\\' ) {
+			g_string_append_c(out, '\\');
+			g_string_append_c(out, c);
+		} else if( c < 0x20 ) {
+			g_string_append_printf(out, "\\u%04x", c);
+		} else {
+			g_string_append_c(out, c);
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+static GString *format_rollup( Aggregator *a, gint64 ended_at ) {
+	GString *out = g_string_new(NULL);
+	g_string_append_printf(
+		out,
+		"{\"rollup\":{\"start\":%" G_GINT64_FORMAT ",\"end\":%" G_GINT64_FORMAT ",\"requests\":%" G_GUINT64_FORMAT,
+		a->started_at, ended_at, a->nrequests
+	);
+
+	for( guint i = 0; i < NDIMS; i++ ) {
+		g_string_append_printf(out, ",\"%s\":{", dimension_names[i]);
+		GHashTableIter iter;
+		gpointer value, n;
+		bool first = true;
+		g_hash_table_iter_init(&iter, a->counts[i]);
+		while( g_hash_table_iter_next(&iter, &value, &n) ) {
+			if( !first ) g_string_append_c(out, ',');
+			first = false;
+			append_json_string(out, value);
+			g_string_append_printf(out, ":%" G_GUINT64_FORMAT, *(guint64 *) n);
+		}
+		g_string_append_c(out, '}');
+	}
+
+	g_string_append_printf(
+		out,
+		",\"response_us\":{\"p50\":%" G_GUINT64_FORMAT ",\"p90\":%" G_GUINT64_FORMAT ",\"p99\":%" G_GUINT64_FORMAT ",\"max\":%" G_GUINT64_FORMAT "}}}\n",
+		stats_histogram_percentile(a->response_us, 0.5),
+		stats_histogram_percentile(a->response_us, 0.9),
+		stats_histogram_percentile(a->response_us, 0.99),
+		a->max_response_us
+	);
+	return out;
+}
+
+static void reset( Aggregator *a, gint64 started_at ) {
+	a->interval++;
+	a->started_at = started_at;
+	a->nrequests = 0;
+	for( guint i = 0; i < NDIMS; i++ ) g_hash_table_remove_all(a->counts[i]);
+	memset(a->response_us, 0, sizeof(a->response_us));
+	a->max_response_us = 0;
+
+	// Requests which started two intervals ago must have lost their end.
+	GHashTableIter iter;
+	gpointer r;
+	g_hash_table_iter_init(&iter, a->requests);
+	while( g_hash_table_iter_next(&iter, NULL, &r) ) {
+		if( ((Request *) r)->interval + 1 < a->interval ) g_hash_table_iter_remove(&iter);
+	}
+}
+
+// Each rollup gets a slab of its own; there is at most one per interval.
+bool aggregator_flush( Aggregator *a, GError **err ) {
+	gint64 now = g_get_real_time();
+	GString *rollup = format_rollup(a, now);
+	reset(a, now);
+
+	Slab *slab = slab_pool_get(a->pool, rollup->len, err);
+	if( slab != NULL ) {
+		memcpy(slab->data, rollup->str, rollup->len);
+		slab->len = rollup->len;
+		if( !a->func(slab, 0, rollup->len, a->data) ) slab_unref(slab);
+	}
+	g_string_free(rollup, true);
+	return slab != NULL;
+}
+
+bool aggregator_tick( Aggregator *a, gint64 now, GError **err ) {
+	if( now < a->next_at ) return true;
+	// Skip intervals missed entirely rather than emitting empty rollups.
+	a->next_at += a->interval_us * ((now - a->next_at) / a->interval_us + 1);
+	return aggregator_flush(a, err);
+}
@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "slab.h"
+#include "stats.h"
+#include "compressor.h"
+
+// Fast rather than small: text this repetitive compresses well regardless.
+#define COMPRESS_LEVEL 1
+#define SCAN_INTERVAL_US (10 * 1000)
+// Slabs which don't shrink by at least this fraction are left alone.
+#define MIN_SAVING_FRACTION 4
+
+typedef struct Candidate {
+	Slab *slab;
+	guint64 position;
+	// Set once compressing it has been tried, successfully or not.
+	bool tried;
+	struct Candidate *next;
+} Candidate;
+
+struct Compressor {
+	Stats *stats;
+	gsize slab_size;
+	guint64 distance;
+	GThread *thread;
+	volatile gint stopping;
+
+	// Offered by the reader and not yet taken by the thread.
+	GMutex lock;
+	Candidate *offered, **offered_tail;
+
+	// Private to the thread, in the order they were offered.
+	Candidate *candidates, **tail;
+	Bytef *scratch;
+	uLongf scratch_size;
+
+	// Written by the sender.
+	cache_aligned volatile guint64 consumed;
+};
+
+void compressor_offer( Compressor *c, Slab *slab, guint64 position ) {
+	g_assert(!slab->offered);
+	slab->offered = true;
+	g_atomic_int_set(&slab->state, SLAB_COLD);
+	slab_ref_n(slab, 1);
+
+	Candidate *cand = g_slice_new(Candidate);
+	cand->slab = slab;
+	cand->position = position;
+	cand->tried = false;
+	cand->next = NULL;
+
+	g_mutex_lock(&c->lock);
+	*c->offered_tail = cand;
+	c->offered_tail = &cand->next;
+	g_mutex_unlock(&c->lock);
+}
+
+void compressor_consumed( Compressor *c, guint64 bytes ) {
+	__atomic_add_fetch(&c->consumed, bytes, __ATOMIC_RELAXED);
+}
+
+// The queue counts the whole slab, not just what was written to it.
+static guint64 saving( const Slab *slab ) {
+	return slab->size - slab->compressed_len;
+}
+
+bool compressor_warm( Compressor *c, Slab *slab, GError **err ) {
+	if( g_atomic_int_get(&slab->state) == SLAB_WARM ) return true;
+	// Fails only if the slab was compressed in the meantime.
+	if( g_atomic_int_compare_and_exchange(&slab->state, SLAB_COLD, SLAB_WARM) ) return true;
+	g_assert(g_atomic_int_get(&slab->state) == SLAB_COMPRESSED);
+
+	gchar *data = malloc(slab->size);
+	if( data == NULL ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	uLongf len = slab->size;
+	int status = uncompress((Bytef *) data, &len, (const Bytef *) slab->compressed, slab->compressed_len);
+	g_assert(status == Z_OK && len == slab->len);
+
+	__atomic_sub_fetch(&c->stats->bytes_compression_saved, saving(slab), __ATOMIC_RELAXED);
+	stats_add(&c->stats->slabs_decompressed, 1);
+
+	free(slab->compressed);
+	slab->compressed = NULL;
+	slab->compressed_len = 0;
+	slab->data = data;
+	// Only the sender looks at it from here on.
+	g_atomic_int_set(&slab->state, SLAB_WARM);
+	return true;
+}
+
+static void compress_slab( Compressor *c, Slab *slab ) {
+	uLongf len = c->scratch_size;
+	if( compress2(c->scratch, &len, (const Bytef *) slab->data, slab->len, COMPRESS_LEVEL) != Z_OK ) return;
+	if( len > slab->len - slab->len / MIN_SAVING_FRACTION ) return;
+
+	gchar *compressed = malloc(len);
+	if( compressed == NULL ) return;
+	memcpy(compressed, c->scratch, len);
+
+	// Published by the exchange, for the sender to find once it sees the slab
+	// compressed.
+	gchar *data = slab->data;
+	slab->compressed = compressed;
+	slab->compressed_len = len;
+	if( !g_atomic_int_compare_and_exchange(&slab->state, SLAB_COLD, SLAB_COMPRESSED) ) {
+		// The sender claimed it while it was being compressed.
+		slab->compressed = NULL;
+		slab->compressed_len = 0;
+		free(compressed);
+		return;
+	}
+	free(data);
+
+	Stats *stats = c->stats;
+	stats_add(&stats->slabs_compressed, 1);
+	stats_add(&stats->bytes_compressed_in, slab->len);
+	stats_add(&stats->bytes_compressed_out, len);
+	__atomic_add_fetch(&stats->bytes_compression_saved, saving(slab), __ATOMIC_RELAXED);
+}
+
+// Once nothing else refers to the slab.
+static void release( Compressor *c, Candidate *cand ) {
+	Slab *slab = cand->slab;
+	if( g_atomic_int_get(&slab->state) == SLAB_COMPRESSED ) {
+		// Its records were discarded unwritten. There is no data to give back
+		// to the pool, so the slab is freed.
+		__atomic_sub_fetch(&c->stats->bytes_compression_saved, saving(slab), __ATOMIC_RELAXED);
+		free(slab->compressed);
+		slab->compressed = NULL;
+		slab->data = NULL;
+	}
+	slab_unref(slab);
+	g_slice_free(Candidate, cand);
+}
+
+static void scan( Compressor *c ) {
+	g_mutex_lock(&c->lock);
+	*c->tail = c->offered;
+	c->offered = NULL;
+	c->offered_tail = &c->offered;
+	g_mutex_unlock(&c->lock);
+
+	guint64 consumed = __atomic_load_n(&c->consumed, __ATOMIC_RELAXED);
+	Candidate **link = &c->candidates;
+	while( *link != NULL ) {
+		Candidate *cand = *link;
+		Slab *slab = cand->slab;
+		gint state = g_atomic_int_get(&slab->state);
+
+		if( state == SLAB_WARM || g_atomic_int_get(&slab->refs) == 1 ) {
+			*link = cand->next;
+			release(c, cand);
+			continue;
+		}
+
+		if(
+			state == SLAB_COLD && !cand->tried &&
+			slab->size == c->slab_size && slab_sealed(slab) &&
+			cand->position > consumed + c->distance
+		) {
+			cand->tried = true;
+			compress_slab(c, slab);
+		}
+		link = &cand->next;
+	}
+	c->tail = link;
+}
+
+static gpointer compressor_main( Compressor *c ) {
+	while( !g_atomic_int_get(&c->stopping) ) {
+		scan(c);
+		g_usleep(SCAN_INTERVAL_US);
+	}
+	return NULL;
+}
+
+Compressor *compressor_new( Stats *stats, gsize slab_size, guint64 distance ) {
+	Compressor *c = g_slice_new0(Compressor);
+	c->stats = stats;
+	c->slab_size = slab_size;
+	c->distance = distance;
+	g_mutex_init(&c->lock);
+	c->offered_tail = &c->offered;
+	c->tail = &c->candidates;
+	c->scratch_size = compressBound(slab_size);
+	c->scratch = g_malloc(c->scratch_size);
+	c->thread = g_thread_new("Rails Compressor", (GThreadFunc) compressor_main, c);
+	return c;
+}
+
+void compressor_free( Compressor *c ) {
+	g_atomic_int_set(&c->stopping, true);
+	g_thread_join(c->thread);
+
+	// Anything still offered was never taken by the thread.
+	*c->tail = c->offered;
+	Candidate *next;
+	for( Candidate *cand = c->candidates; cand != NULL; cand = next ) {
+		next = cand->next;
+		release(c, cand);
+	}
+
+	g_free(c->scratch);
+	g_mutex_clear(&c->lock);
+	g_slice_free(Compressor, c);
+}
@@ -28,15 +28,6 @@ static void set_error_eof( GError **err ) {
 	);
 }
 
-static void set_error_unspec( GError **err ) {
-	g_set_error_literal(
-		err,
-		VARNISHLOG_BUFFER_QUARK,
-		VARNISHLOG_BUFFER_ERROR_UNSPEC,
-		"Unspecified error"
-	);
-}
-
 bool write_gerror( GIOChannel *channel, GError *e, GError **err ) {
 	GIOStatus status;
 	gsize written;
@@ -110,12 +101,6 @@ out_read_domain:
 	return NULL;
 }
 
-void set_gerror_getline( FILE *strm, GError **err ) {
-	if( errno != 0 ) {
-		g_set_error_errno(err);
-	} else if( feof(strm) ) {
-		set_error_eof(err);
-	} else {
-		set_error_unspec(err);
-	}
+void set_gerror_eof( GError **err ) {
+	set_error_eof(err);
 }
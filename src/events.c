@@ -0,0 +1,341 @@
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "events.h"
+
+#define MAX_EVENTS 16
+
+static const int handled_signals[] = {
+	SIGHUP,
+	SIGINT,
+	SIGTERM,
+	SIGUSR1,
+	SIGCHLD
+};
+
+typedef struct Watched {
+	int fd;
+	guint token;
+	// Set for files epoll won't take, which are reported ready every time.
+	bool always;
+} Watched;
+
+struct Events {
+	Watched watched[EVENTS_MAX_FDS];
+	guint nwatched;
+	guint nalways;
+#ifdef __linux__
+	int epoll_fd, signal_fd, timer_fd;
+#else
+	int pipe[2];
+	gint64 tick_us, next_tick;
+	struct sigaction old_actions[G_N_ELEMENTS(handled_signals)];
+#endif
+};
+
+static void note_signal( EventsReady *ready, int sig ) {
+	switch( sig ) {
+		case SIGHUP:
+		case SIGINT:
+		case SIGTERM:
+			ready->shutdown = true;
+			break;
+		case SIGUSR1:
+			ready->dump = true;
+			break;
+		case SIGCHLD:
+			ready->child = true;
+			break;
+	}
+}
+
+static void note_fd( Events *e, EventsReady *ready, int fd ) {
+	for( guint i = 0; i < e->nwatched; i++ ) {
+		if( e->watched[i].fd == fd ) ready->fds |= G_GUINT64_CONSTANT(1) << e->watched[i].token;
+	}
+}
+
+bool events_ready( const EventsReady *ready, guint token ) {
+	return (ready->fds & (G_GUINT64_CONSTANT(1) << token)) != 0;
+}
+
+#ifdef __linux__
+Events *events_new( gint64 tick_us, GError **err ) {
+	g_assert(tick_us > 0);
+
+	Events *e = g_slice_new0(Events);
+	e->epoll_fd = e->signal_fd = e->timer_fd = -1;
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for( gsize i = 0; i < G_N_ELEMENTS(handled_signals); i++ ) sigaddset(&mask, handled_signals[i]);
+	// Threads started later inherit the mask, so the signals can only be
+	// taken from the signalfd.
+	errno = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if( errno != 0 ) goto err;
+
+	e->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if( e->signal_fd == -1 ) goto err;
+
+	e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if( e->timer_fd == -1 ) goto err;
+	struct itimerspec interval = {
+		.it_interval = { .tv_sec = tick_us / G_USEC_PER_SEC, .tv_nsec = tick_us % G_USEC_PER_SEC * 1000 },
+		.it_value = { .tv_sec = tick_us / G_USEC_PER_SEC, .tv_nsec = tick_us % G_USEC_PER_SEC * 1000 }
+	};
+	if( timerfd_settime(e->timer_fd, 0, &interval, NULL) == -1 ) goto err;
+
+	e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if( e->epoll_fd == -1 ) goto err;
+
+	struct epoll_event ev = { .events = EPOLLIN };
+	ev.data.fd = e->signal_fd;
+	if( epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->signal_fd, &ev) == -1 ) goto err;
+	ev.data.fd = e->timer_fd;
+	if( epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->timer_fd, &ev) == -1 ) goto err;
+
+	return e;
+
+err:
+	g_set_error_errno(err);
+	events_free(e);
+	return NULL;
+}
+
+void events_free( Events *e ) {
+	if( e->epoll_fd != -1 ) close(e->epoll_fd);
+	if( e->timer_fd != -1 ) close(e->timer_fd);
+	if( e->signal_fd != -1 ) close(e->signal_fd);
+	g_slice_free(Events, e);
+}
+
+static bool add_fd( Events *e, int fd, GError **err ) {
+	struct epoll_event ev = { .events = EPOLLIN };
+	ev.data.fd = fd;
+	if( epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 ) return true;
+	// Regular files and the like.
+	if( errno == EPERM ) {
+		e->watched[e->nwatched].always = true;
+		e->nalways++;
+		return true;
+	}
+	g_set_error_errno(err);
+	return false;
+}
+
+static void remove_fd( Events *e, int fd ) {
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static bool read_signals( Events *e, EventsReady *ready, GError **err ) {
+	struct signalfd_siginfo info[MAX_EVENTS];
+	ssize_t n;
+	while( (n = read(e->signal_fd, info, sizeof(info))) > 0 ) {
+		for( gsize i = 0; i < n / sizeof(info[0]); i++ ) note_signal(ready, info[i].ssi_signo);
+	}
+	if( n == -1 && errno != EAGAIN ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	return true;
+}
+
+static void note_always( Events *e, EventsReady *ready ) {
+	for( guint i = 0; i < e->nwatched; i++ ) {
+		if( e->watched[i].always ) ready->fds |= G_GUINT64_CONSTANT(1) << e->watched[i].token;
+	}
+}
+
+bool events_wait( Events *e, EventsReady *ready, GError **err ) {
+	memset(ready, 0, sizeof(*ready));
+
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(e->epoll_fd, events, MAX_EVENTS, e->nalways > 0 ? 0 : -1);
+	if( n == -1 ) {
+		// Being stopped and continued interrupts the wait.
+		if( errno == EINTR ) return true;
+		g_set_error_errno(err);
+		return false;
+	}
+
+	for( int i = 0; i < n; i++ ) {
+		int fd = events[i].data.fd;
+		if( fd == e->signal_fd ) {
+			if( !read_signals(e, ready, err) ) return false;
+		} else if( fd == e->timer_fd ) {
+			uint64_t expirations;
+			if( read(e->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN ) {
+				g_set_error_errno(err);
+				return false;
+			}
+			ready->tick = true;
+		} else {
+			note_fd(e, ready, fd);
+		}
+	}
+	note_always(e, ready);
+
+	return true;
+}
+#else
+// Written to by the signal handlers.
+static int signal_pipe = -1;
+
+// Be careful, this function is called in a signal handler context.
+static void write_signal( int sig ) {
+	int saved_errno = errno;
+	guchar c = sig;
+	if( signal_pipe != -1 && write(signal_pipe, &c, 1) == -1 ) {
+		// The pipe is full, so a wakeup is already on its way.
+	}
+	errno = saved_errno;
+}
+
+static bool set_flags( int fd, GError **err ) {
+	int flags = fcntl(fd, F_GETFL);
+	if( flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ) goto err;
+	flags = fcntl(fd, F_GETFD);
+	if( flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1 ) goto err;
+	return true;
+
+err:
+	g_set_error_errno(err);
+	return false;
+}
+
+Events *events_new( gint64 tick_us, GError **err ) {
+	g_assert(tick_us > 0 && signal_pipe == -1);
+
+	Events *e = g_slice_new0(Events);
+	e->tick_us = tick_us;
+	e->next_tick = g_get_monotonic_time() + tick_us;
+
+	if( pipe(e->pipe) == -1 ) {
+		g_set_error_errno(err);
+		goto err_pipe;
+	}
+	if( !set_flags(e->pipe[0], err) || !set_flags(e->pipe[1], err) ) goto err_set_flags;
+	signal_pipe = e->pipe[1];
+
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = write_signal;
+	// Reads elsewhere carry on; only the wait here should notice.
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	for( gsize i = 0; i < G_N_ELEMENTS(handled_signals); i++ ) {
+		if( sigaction(handled_signals[i], &act, &e->old_actions[i]) == -1 ) {
+			g_set_error_errno(err);
+			for( gsize j = 0; j < i; j++ ) sigaction(handled_signals[j], &e->old_actions[j], NULL);
+			goto err_sigaction;
+		}
+	}
+
+	return e;
+
+err_sigaction:
+	signal_pipe = -1;
+err_set_flags:
+	close(e->pipe[0]);
+	close(e->pipe[1]);
+err_pipe:
+	g_slice_free(Events, e);
+	return NULL;
+}
+
+void events_free( Events *e ) {
+	// The handlers stay, but have nowhere to write.
+	signal_pipe = -1;
+	close(e->pipe[0]);
+	close(e->pipe[1]);
+	g_slice_free(Events, e);
+}
+
+static bool add_fd( Events *e, int fd, GError **err ) {
+	(void) e, (void) fd, (void) err;
+	return true;
+}
+
+static void remove_fd( Events *e, int fd ) {
+	(void) e, (void) fd;
+}
+
+bool events_wait( Events *e, EventsReady *ready, GError **err ) {
+	memset(ready, 0, sizeof(*ready));
+
+	struct pollfd fds[EVENTS_MAX_FDS + 1];
+	fds[0].fd = e->pipe[0];
+	fds[0].events = POLLIN;
+	for( guint i = 0; i < e->nwatched; i++ ) {
+		fds[i + 1].fd = e->watched[i].fd;
+		fds[i + 1].events = POLLIN;
+	}
+
+	gint64 now = g_get_monotonic_time();
+	int timeout_ms = now >= e->next_tick ? 0 : (e->next_tick - now + 999) / 1000;
+	int n = poll(fds, e->nwatched + 1, timeout_ms);
+	if( n == -1 && errno != EINTR ) {
+		g_set_error_errno(err);
+		return false;
+	}
+
+	if( n > 0 ) {
+		for( guint i = 0; i < e->nwatched; i++ ) {
+			if( fds[i + 1].revents != 0 ) note_fd(e, ready, fds[i + 1].fd);
+		}
+	}
+
+	guchar sigs[MAX_EVENTS];
+	ssize_t nsigs;
+	while( (nsigs = read(e->pipe[0], sigs, sizeof(sigs))) > 0 ) {
+		for( ssize_t i = 0; i < nsigs; i++ ) note_signal(ready, sigs[i]);
+	}
+
+	now = g_get_monotonic_time();
+	if( now >= e->next_tick ) {
+		ready->tick = true;
+		e->next_tick += e->tick_us * ((now - e->next_tick) / e->tick_us + 1);
+	}
+
+	return true;
+}
+#endif
+
+bool events_watch( Events *e, int fd, guint token, GError **err ) {
+	g_assert(e->nwatched < EVENTS_MAX_FDS && token < EVENTS_MAX_FDS);
+
+	e->watched[e->nwatched] = (Watched) { .fd = fd, .token = token, .always = false };
+	if( !add_fd(e, fd, err) ) return false;
+	e->nwatched++;
+	return true;
+}
+
+void events_unwatch( Events *e, int fd ) {
+	for( guint i = 0; i < e->nwatched; i++ ) {
+		if( e->watched[i].fd != fd ) continue;
+		if( e->watched[i].always ) {
+			e->nalways--;
+		} else {
+			remove_fd(e, fd);
+		}
+		e->watched[i] = e->watched[--e->nwatched];
+		return;
+	}
+}
@@ -0,0 +1,181 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "vsl.h"
+#include "filter.h"
+
+// A power of two, comfortably more than twice the number of VSL tags so that
+// probes stay short.
+#define FILTER_TABLE_SIZE 512
+#define FILTER_MAX_TAGS (FILTER_TABLE_SIZE / 2)
+
+typedef struct PayloadRule {
+	// NULL for a prefix rule.
+	GRegex *regex;
+	gchar *prefix;
+	gsize prefix_len;
+	struct PayloadRule *next;
+} PayloadRule;
+
+typedef struct FilterTag {
+	gchar *name;
+	gsize len;
+	bool keep;
+	PayloadRule *rules;
+} FilterTag;
+
+struct Filter {
+	// Whether tags not in the table are kept.
+	bool keep_others;
+	guint ntags;
+	// Open addressing over tag_hash, so a lookup is a hash of three bytes
+	// and usually a single compare.
+	FilterTag *table[FILTER_TABLE_SIZE];
+};
+
+static guint tag_hash( const gchar *tag, gsize len ) {
+	guint h = len * 31;
+	h = h * 33 + g_ascii_tolower(tag[0]);
+	h = h * 33 + g_ascii_tolower(tag[len / 2]);
+	h = h * 33 + g_ascii_tolower(tag[len - 1]);
+	return h & (FILTER_TABLE_SIZE - 1);
+}
+
+static FilterTag **find_slot( const Filter *f, const gchar *tag, gsize len ) {
+	guint i = tag_hash(tag, len);
+	FilterTag *const *slot;
+	while( *(slot = &f->table[i]) != NULL ) {
+		if( (*slot)->len == len && g_ascii_strncasecmp((*slot)->name, tag, len) == 0 ) break;
+		i = (i + 1) & (FILTER_TABLE_SIZE - 1);
+	}
+	return (FilterTag **) slot;
+}
+
+static FilterTag *get_tag( Filter *f, const gchar *tag, GError **err ) {
+	gsize len = strlen(tag);
+	if( len == 0 ) {
+		g_set_error_literal(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Empty tag name");
+		return NULL;
+	}
+
+	FilterTag **slot = find_slot(f, tag, len);
+	if( *slot != NULL ) return *slot;
+
+	if( f->ntags == FILTER_MAX_TAGS ) {
+		g_set_error_literal(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Too many tags to filter on");
+		return NULL;
+	}
+	FilterTag *t = g_slice_new0(FilterTag);
+	t->name = g_strdup(tag);
+	t->len = len;
+	t->keep = f->keep_others;
+	*slot = t;
+	f->ntags++;
+	return t;
+}
+
+static bool set_tags( Filter *f, const gchar *list, bool keep, GError **err ) {
+	gchar **tags = g_strsplit(list, ",", -1);
+	bool ok = true;
+	for( gchar **tag = tags; *tag != NULL && ok; tag++ ) {
+		g_strstrip(*tag);
+		if( **tag == '\0' ) continue;
+		FilterTag *t = get_tag(f, *tag, err);
+		if( t == NULL ) {
+			ok = false;
+		} else {
+			t->keep = keep;
+		}
+	}
+	g_strfreev(tags);
+	return ok;
+}
+
+static bool add_rules( Filter *f, gchar **specs, bool regex, GError **err ) {
+	for( ; specs != NULL && *specs != NULL; specs++ ) {
+		const gchar *sep = strchr(*specs, ':');
+		if( sep == NULL ) {
+			g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Expected TAG:PATTERN, got %s", *specs);
+			return false;
+		}
+
+		gchar *name = g_strndup(*specs, sep - *specs);
+		FilterTag *t = get_tag(f, name, err);
+		g_free(name);
+		if( t == NULL ) return false;
+
+		PayloadRule *rule = g_slice_new0(PayloadRule);
+		if( regex ) {
+			rule->regex = g_regex_new(sep + 1, G_REGEX_OPTIMIZE, 0, err);
+			if( rule->regex == NULL ) {
+				g_slice_free(PayloadRule, rule);
+				return false;
+			}
+		} else {
+			rule->prefix = g_strdup(sep + 1);
+			rule->prefix_len = strlen(rule->prefix);
+		}
+		rule->next = t->rules;
+		t->rules = rule;
+	}
+	return true;
+}
+
+Filter *filter_new( const gchar *include, const gchar *exclude, gchar **prefixes, gchar **regexes, GError **err ) {
+	Filter *f = g_slice_new0(Filter);
+	f->keep_others = include == NULL;
+
+	if( include != NULL && !set_tags(f, include, true, err) ) goto err;
+	if( exclude != NULL && !set_tags(f, exclude, false, err) ) goto err;
+	if( !add_rules(f, prefixes, false, err) ) goto err;
+	if( !add_rules(f, regexes, true, err) ) goto err;
+
+	return f;
+
+err:
+	filter_free(f);
+	return NULL;
+}
+
+void filter_free( Filter *f ) {
+	for( guint i = 0; i < FILTER_TABLE_SIZE; i++ ) {
+		FilterTag *t = f->table[i];
+		if( t == NULL ) continue;
+
+		PayloadRule *next;
+		for( PayloadRule *rule = t->rules; rule != NULL; rule = next ) {
+			next = rule->next;
+			if( rule->regex != NULL ) g_regex_unref(rule->regex);
+			g_free(rule->prefix);
+			g_slice_free(PayloadRule, rule);
+		}
+		g_free(t->name);
+		g_slice_free(FilterTag, t);
+	}
+	g_slice_free(Filter, f);
+}
+
+static bool rule_matches( const PayloadRule *rule, const VslLine *line ) {
+	if( rule->regex != NULL )
+		return g_regex_match_full(rule->regex, line->payload, line->payload_len, 0, 0, NULL, NULL);
+	// glibc's memcmp is SIMD accelerated.
+	return line->payload_len >= rule->prefix_len && memcmp(line->payload, rule->prefix, rule->prefix_len) == 0;
+}
+
+bool filter_line( const Filter *f, const gchar *data, gsize len ) {
+	VslLine line;
+	if( !vsl_parse(data, len, &line) ) return true;
+
+	const FilterTag *t = *find_slot(f, line.tag, line.tag_len);
+	if( t == NULL ) return f->keep_others;
+	if( !t->keep ) return false;
+	if( t->rules == NULL ) return true;
+
+	for( const PayloadRule *rule = t->rules; rule != NULL; rule = rule->next ) {
+		if( rule_matches(rule, &line) ) return true;
+	}
+	return false;
+}
@@ -0,0 +1,240 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "slab.h"
+#include "line_reader.h"
+#include "vsl.h"
+#include "grouper.h"
+
+typedef struct GroupLine {
+	Slab *slab;
+	guint32 offset, length;
+} GroupLine;
+
+// Transactions are recycled along with their line arrays, so a steady state
+// of open transactions doesn't allocate.
+typedef struct Transaction {
+	// The id in the high bits, the c/b marker in the low byte.
+	gint64 key;
+	gint64 opened_at;
+	GroupLine *lines;
+	guint nlines, capacity;
+	gsize bytes;
+	// Open transactions in the order they were opened, oldest first. Only
+	// next is used on the free list.
+	struct Transaction *prev, *next;
+} Transaction;
+
+struct Grouper {
+	SlabPool *pool;
+	gsize max_bytes;
+	gint64 timeout_us;
+	LineReaderFunc func;
+	gpointer data;
+
+	GHashTable *open;
+	Transaction *oldest, *newest;
+	Transaction *free;
+
+	// Completed transactions are copied in here, with the same bias
+	// reference scheme as LineReader.
+	Slab *slab;
+	gint handed_out;
+};
+
+#define INITIAL_LINES 16
+
+Grouper *grouper_new( SlabPool *pool, gsize max_bytes, gint64 timeout_us, LineReaderFunc func, gpointer data ) {
+	Grouper *g = g_slice_new0(Grouper);
+	g->pool = pool;
+	g->max_bytes = max_bytes;
+	g->timeout_us = timeout_us;
+	g->func = func;
+	g->data = data;
+	g->open = g_hash_table_new(g_int64_hash, g_int64_equal);
+	return g;
+}
+
+static void release_lines( Transaction *tx ) {
+	for( guint i = 0; i < tx->nlines; i++ ) slab_unref(tx->lines[i].slab);
+	tx->nlines = 0;
+	tx->bytes = 0;
+}
+
+static void free_transaction( Transaction *tx ) {
+	g_free(tx->lines);
+	g_slice_free(Transaction, tx);
+}
+
+void grouper_free( Grouper *g ) {
+	Transaction *next;
+	for( Transaction *tx = g->oldest; tx != NULL; tx = next ) {
+		next = tx->next;
+		release_lines(tx);
+		free_transaction(tx);
+	}
+	for( Transaction *tx = g->free; tx != NULL; tx = next ) {
+		next = tx->next;
+		free_transaction(tx);
+	}
+
+	if( g->slab != NULL ) slab_settle(g->slab, g->handed_out);
+	g_hash_table_destroy(g->open);
+	g_slice_free(Grouper, g);
+}
+
+static bool tag_is( const VslLine *line, const char *name ) {
+	return line->tag_len == strlen(name) && memcmp(line->tag, name, line->tag_len) == 0;
+}
+
+// The tags which close a transaction: a varnish 3 request, client session or
+// backend connection, or any varnish 4 transaction.
+static bool is_end_tag( const VslLine *line ) {
+	return
+		tag_is(line, "ReqEnd") ||
+		tag_is(line, "StatSess") ||
+		tag_is(line, "BackendReuse") ||
+		tag_is(line, "BackendClose") ||
+		tag_is(line, "End");
+}
+
+// Lines marked '-' aren't part of a transaction.
+static bool parse_line( const gchar *p, gsize len, gint64 *key, bool *end ) {
+	VslLine line;
+	if( !vsl_parse(p, len, &line) || (line.marker != 'c' && line.marker != 'b') ) return false;
+
+	*key = (gint64) ((line.id << 8) | (guchar) line.marker);
+	*end = is_end_tag(&line);
+	return true;
+}
+
+static Transaction *open_transaction( Grouper *g, gint64 key ) {
+	Transaction *tx = g->free;
+	if( tx != NULL ) {
+		g->free = tx->next;
+	} else {
+		tx = g_slice_new0(Transaction);
+		tx->capacity = INITIAL_LINES;
+		tx->lines = g_new(GroupLine, tx->capacity);
+	}
+
+	tx->key = key;
+	tx->opened_at = g_get_monotonic_time();
+	tx->prev = g->newest;
+	tx->next = NULL;
+	if( g->newest != NULL ) {
+		g->newest->next = tx;
+	} else {
+		g->oldest = tx;
+	}
+	g->newest = tx;
+
+	g_hash_table_insert(g->open, &tx->key, tx);
+	return tx;
+}
+
+static void close_transaction( Grouper *g, Transaction *tx ) {
+	g_hash_table_remove(g->open, &tx->key);
+
+	if( tx->prev != NULL ) {
+		tx->prev->next = tx->next;
+	} else {
+		g->oldest = tx->next;
+	}
+	if( tx->next != NULL ) {
+		tx->next->prev = tx->prev;
+	} else {
+		g->newest = tx->prev;
+	}
+
+	tx->next = g->free;
+	g->free = tx;
+}
+
+static bool next_slab( Grouper *g, gsize need, GError **err ) {
+	Slab *slab = slab_pool_get(g->pool, need, err);
+	if( slab == NULL ) return false;
+	slab_hold(slab);
+
+	if( g->slab != NULL ) slab_settle(g->slab, g->handed_out);
+	g->slab = slab;
+	g->handed_out = 0;
+	return true;
+}
+
+// Copies the transaction's lines into one record and passes it on. The lines
+// are released and the transaction closed whether or not that succeeds.
+static bool emit( Grouper *g, Transaction *tx, GError **err ) {
+	bool ok = true;
+
+	if( g->slab == NULL || g->slab->size - g->slab->len < tx->bytes )
+		ok = next_slab(g, tx->bytes, err);
+
+	if( ok ) {
+		Slab *slab = g->slab;
+		gsize offset = slab->len;
+		for( guint i = 0; i < tx->nlines; i++ ) {
+			const GroupLine *line = &tx->lines[i];
+			memcpy(slab->data + slab->len, line->slab->data + line->offset, line->length);
+			slab->len += line->length;
+		}
+		if( g->func(slab, offset, tx->bytes, g->data) ) g->handed_out++;
+	}
+
+	release_lines(tx);
+	close_transaction(g, tx);
+	return ok;
+}
+
+bool grouper_add( Grouper *g, Slab *slab, gsize offset, gsize len, GError **err ) {
+	gint64 key;
+	bool end;
+	if( !parse_line(slab->data + offset, len, &key, &end) )
+		return g->func(slab, offset, len, g->data);
+
+	Transaction *tx = g_hash_table_lookup(g->open, &key);
+	if( tx != NULL && tx->bytes + len > g->max_bytes ) {
+		// Pass on what we have and carry on in a new record.
+		if( !emit(g, tx, err) ) return false;
+		tx = NULL;
+	}
+	if( tx == NULL ) tx = open_transaction(g, key);
+
+	if( tx->nlines == tx->capacity ) {
+		tx->capacity *= 2;
+		tx->lines = g_renew(GroupLine, tx->lines, tx->capacity);
+	}
+	tx->lines[tx->nlines++] = (GroupLine) { .slab = slab, .offset = offset, .length = len };
+	tx->bytes += len;
+
+	// The line is held by the transaction from here on, even if it is dropped
+	// along with the transaction.
+	if( end ) emit(g, tx, err);
+	return true;
+}
+
+bool grouper_skip( Grouper *g, Slab *slab, gsize offset, gsize len, GError **err ) {
+	gint64 key;
+	bool end;
+	if( !parse_line(slab->data + offset, len, &key, &end) || !end ) return true;
+
+	Transaction *tx = g_hash_table_lookup(g->open, &key);
+	return tx == NULL || emit(g, tx, err);
+}
+
+bool grouper_expire( Grouper *g, gint64 now, GError **err ) {
+	while( g->oldest != NULL && now - g->oldest->opened_at >= g->timeout_us ) {
+		if( !emit(g, g->oldest, err) ) return false;
+	}
+	return true;
+}
+
+bool grouper_flush( Grouper *g, GError **err ) {
+	while( g->oldest != NULL ) {
+		if( !emit(g, g->oldest, err) ) return false;
+	}
+	return true;
+}
@@ -0,0 +1,540 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "errors.h"
+#include "stats.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4e4a4c56 // "VLJN" in little endian
+#define JOURNAL_VERSION 1
+#define RECORD_ALIGN 8
+// How often the thread looks for a segment to prepare or delete. Syncs are
+// further apart.
+#define POLL_INTERVAL_US (10 * 1000)
+
+typedef struct JournalSegmentHeader {
+	// Written last, once the segment is in use.
+	guint32 magic, version;
+	guint64 first_seq;
+} JournalSegmentHeader;
+
+// A zero length ends a segment's records; the rest of it is still zeroed.
+typedef struct JournalRecordHeader {
+	guint32 length, reserved;
+} JournalRecordHeader;
+
+typedef struct JournalAck {
+	guint32 magic, version;
+	// Written by the sender.
+	volatile guint64 acked;
+} JournalAck;
+
+typedef struct JournalSegment {
+	gchar *path;
+	int fd;
+	gchar *base;
+	gsize size;
+	guint64 first_seq, count;
+	// Both published by the producer with release semantics. next is set
+	// once the producer has moved on.
+	volatile gsize committed;
+	struct JournalSegment *volatile next;
+	// Private to the thread.
+	gsize synced;
+} JournalSegment;
+
+struct Journal {
+	gchar *dir;
+	gsize segment_size;
+	gint64 sync_interval_us;
+	Stats *stats;
+	volatile gint next_id;
+
+	int ack_fd;
+	JournalAck *ack;
+
+	GThread *thread;
+	volatile gint stopping;
+	// Created ahead by the thread, for the producer to move on to.
+	JournalSegment *volatile prepared;
+	// The oldest segment still on disk. Private to the thread once started.
+	JournalSegment *head;
+	guint64 synced_ack;
+
+	// What the last run left unacknowledged, up to the first segment of this
+	// one. Nothing is deleted until all of it has been replayed.
+	struct {
+		JournalSegment *seg, *end;
+		gsize off;
+	} replay;
+	volatile gint replayed;
+
+	cache_aligned struct {
+		JournalSegment *seg;
+		gsize off;
+		// The length of a record written but not yet committed.
+		guint32 pending;
+		guint64 seq;
+	} producer;
+};
+
+static gsize record_size( gsize len ) {
+	return (sizeof(JournalRecordHeader) + len + RECORD_ALIGN - 1) & ~(gsize) (RECORD_ALIGN - 1);
+}
+
+static bool record_at( const JournalSegment *seg, gsize off, const gchar **data, gsize *len ) {
+	if( off + sizeof(JournalRecordHeader) > seg->size ) return false;
+	const JournalRecordHeader *hdr = (const JournalRecordHeader *) (seg->base + off);
+	if( hdr->length == 0 || off + record_size(hdr->length) > seg->size ) return false;
+	*data = (const gchar *) (hdr + 1);
+	*len = hdr->length;
+	return true;
+}
+
+static void segment_free( JournalSegment *seg, bool remove ) {
+	munmap(seg->base, seg->size);
+	close(seg->fd);
+	if( remove ) unlink(seg->path);
+	g_free(seg->path);
+	g_slice_free(JournalSegment, seg);
+}
+
+static JournalSegment *segment_new( Journal *j, GError **err ) {
+	JournalSegment *seg = g_slice_new0(JournalSegment);
+	seg->path = g_strdup_printf("%s/journal-%08u.seg", j->dir, (guint) g_atomic_int_add(&j->next_id, 1));
+	seg->size = j->segment_size;
+
+	seg->fd = open(seg->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if( seg->fd == -1 ) {
+		g_set_error_errno(err);
+		goto err_open;
+	}
+
+	// As for the spill, so a full disk can't raise SIGBUS.
+	if( (errno = posix_fallocate(seg->fd, 0, seg->size)) != 0 ) {
+		g_set_error_errno(err);
+		goto err_fallocate;
+	}
+
+	int flags = MAP_SHARED;
+#ifdef __linux__
+	// Mostly created ahead by the thread, so the producer doesn't take the
+	// page faults.
+	flags |= MAP_POPULATE;
+#endif
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, flags, seg->fd, 0);
+	if( seg->base == MAP_FAILED ) {
+		g_set_error_errno(err);
+		goto err_mmap;
+	}
+
+	return seg;
+
+err_mmap:
+err_fallocate:
+	close(seg->fd);
+	unlink(seg->path);
+err_open:
+	g_free(seg->path);
+	g_slice_free(JournalSegment, seg);
+	return NULL;
+}
+
+// Returns NULL without setting err if the file was never put to use.
+static JournalSegment *segment_load( const gchar *path, GError **err ) {
+	JournalSegment *seg = g_slice_new0(JournalSegment);
+
+	seg->fd = open(path, O_RDWR | O_CLOEXEC);
+	if( seg->fd == -1 ) {
+		g_set_error_errno(err);
+		goto err_open;
+	}
+
+	struct stat st;
+	if( fstat(seg->fd, &st) == -1 ) {
+		g_set_error_errno(err);
+		goto err_fstat;
+	}
+	if( (gsize) st.st_size < sizeof(JournalSegmentHeader) ) goto err_fstat;
+	seg->size = st.st_size;
+
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if( seg->base == MAP_FAILED ) {
+		g_set_error_errno(err);
+		goto err_mmap;
+	}
+
+	const JournalSegmentHeader *hdr = (const JournalSegmentHeader *) seg->base;
+	if( hdr->magic != JOURNAL_MAGIC ) goto err_header;
+	if( hdr->version != JOURNAL_VERSION ) {
+		g_set_error(err, VARNISHLOG_BUFFER_QUARK, VARNISHLOG_BUFFER_ERROR_UNSPEC, "Journal segment %s has unknown version %u", path, hdr->version);
+		goto err_header;
+	}
+	seg->first_seq = hdr->first_seq;
+
+	gsize off = sizeof(*hdr), len;
+	const gchar *data;
+	while( record_at(seg, off, &data, &len) ) {
+		off += record_size(len);
+		seg->count++;
+	}
+	seg->committed = seg->synced = off;
+	seg->path = g_strdup(path);
+
+	return seg;
+
+err_header:
+	munmap(seg->base, seg->size);
+err_mmap:
+err_fstat:
+	close(seg->fd);
+err_open:
+	g_slice_free(JournalSegment, seg);
+	return NULL;
+}
+
+static gint compare_segments( gconstpointer a, gconstpointer b ) {
+	const JournalSegment *x = *(JournalSegment *const *) a, *y = *(JournalSegment *const *) b;
+	return x->first_seq < y->first_seq ? -1 : x->first_seq > y->first_seq;
+}
+
+static bool open_ack( Journal *j, GError **err ) {
+	gchar *path = g_strdup_printf("%s/ack", j->dir);
+	j->ack_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	g_free(path);
+	if( j->ack_fd == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+
+	if( (errno = posix_fallocate(j->ack_fd, 0, sizeof(JournalAck))) != 0 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+
+	j->ack = mmap(NULL, sizeof(JournalAck), PROT_READ | PROT_WRITE, MAP_SHARED, j->ack_fd, 0);
+	if( j->ack == MAP_FAILED ) {
+		j->ack = NULL;
+		g_set_error_errno(err);
+		return false;
+	}
+
+	if( j->ack->magic != JOURNAL_MAGIC ) {
+		j->ack->acked = 0;
+		j->ack->version = JOURNAL_VERSION;
+		j->ack->magic = JOURNAL_MAGIC;
+	} else if( j->ack->version != JOURNAL_VERSION ) {
+		g_set_error(err, VARNISHLOG_BUFFER_QUARK, VARNISHLOG_BUFFER_ERROR_UNSPEC, "Journal in %s has unknown version %u", j->dir, j->ack->version);
+		return false;
+	}
+	return true;
+}
+
+// Links the segments left by the last run in order, as far as their records
+// are numbered without a gap, and finds the first one not acknowledged.
+static bool load_segments( Journal *j, GError **err ) {
+	GDir *dir = g_dir_open(j->dir, 0, err);
+	if( dir == NULL ) return false;
+
+	GPtrArray *segs = g_ptr_array_new();
+	const gchar *name;
+	while( (name = g_dir_read_name(dir)) != NULL ) {
+		if( !g_str_has_prefix(name, "journal-") || !g_str_has_suffix(name, ".seg") ) continue;
+		guint id = strtoul(name + strlen("journal-"), NULL, 10);
+		j->next_id = MAX((guint) j->next_id, id + 1);
+
+		gchar *path = g_strdup_printf("%s/%s", j->dir, name);
+		GError *_err = NULL;
+		JournalSegment *seg = segment_load(path, &_err);
+		if( seg == NULL && _err != NULL ) {
+			g_propagate_error(err, _err);
+			g_free(path);
+			goto err;
+		}
+		if( seg == NULL ) {
+			unlink(path);
+		} else if( seg->count == 0 ) {
+			segment_free(seg, true);
+		} else {
+			g_ptr_array_add(segs, seg);
+		}
+		g_free(path);
+	}
+	g_dir_close(dir);
+	dir = NULL;
+
+	g_ptr_array_sort(segs, compare_segments);
+
+	guint64 acked = j->ack->acked, end = acked;
+	JournalSegment *tail = NULL;
+	for( guint i = 0; i < segs->len; i++ ) {
+		JournalSegment *seg = g_ptr_array_index(segs, i);
+		// Anything after a gap followed records lost without a sync, and
+		// can't be numbered.
+		if( tail != NULL && seg->first_seq != tail->first_seq + tail->count ) {
+			segment_free(seg, true);
+			continue;
+		}
+		if( tail == NULL ) {
+			j->head = seg;
+			acked = MAX(acked, seg->first_seq);
+		} else {
+			tail->next = seg;
+		}
+		tail = seg;
+		end = MAX(acked, seg->first_seq + seg->count);
+	}
+	g_ptr_array_free(segs, true);
+
+	while( j->head != NULL && j->head->first_seq + j->head->count <= acked ) {
+		JournalSegment *next = j->head->next;
+		segment_free(j->head, true);
+		j->head = next;
+	}
+	if( j->head == NULL ) tail = NULL;
+
+	j->replay.seg = j->head;
+	j->producer.seg = tail;
+	j->producer.seq = end;
+	j->ack->acked = acked;
+
+	if( j->head != NULL ) {
+		j->replay.off = sizeof(JournalSegmentHeader);
+		const gchar *data;
+		gsize len;
+		for( guint64 seq = j->head->first_seq; seq < acked && record_at(j->head, j->replay.off, &data, &len); seq++ )
+			j->replay.off += record_size(len);
+	}
+	return true;
+
+err:
+	g_dir_close(dir);
+	for( guint i = 0; i < segs->len; i++ ) segment_free(g_ptr_array_index(segs, i), false);
+	g_ptr_array_free(segs, true);
+	return false;
+}
+
+// Starts numbering the producer's records in seg.
+static void link_segment( Journal *j, JournalSegment *seg ) {
+	JournalSegmentHeader *hdr = (JournalSegmentHeader *) seg->base;
+	hdr->first_seq = j->producer.seq;
+	hdr->version = JOURNAL_VERSION;
+	__atomic_store_n(&hdr->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+
+	seg->first_seq = j->producer.seq;
+	seg->committed = sizeof(*hdr);
+	if( j->producer.seg != NULL ) {
+		__atomic_store_n(&j->producer.seg->next, seg, __ATOMIC_RELEASE);
+	} else {
+		j->head = seg;
+	}
+	j->producer.seg = seg;
+	j->producer.off = sizeof(*hdr);
+}
+
+static void prepare( Journal *j ) {
+	if( __atomic_load_n(&j->prepared, __ATOMIC_ACQUIRE) != NULL ) return;
+	// Failures are left for the producer to run into and report.
+	JournalSegment *seg = segment_new(j, NULL);
+	if( seg != NULL ) __atomic_store_n(&j->prepared, seg, __ATOMIC_RELEASE);
+}
+
+static void sync_journal( Journal *j ) {
+	bool synced = false;
+	for( JournalSegment *seg = j->head; seg != NULL; seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE) ) {
+		gsize committed = __atomic_load_n(&seg->committed, __ATOMIC_ACQUIRE);
+		if( committed == seg->synced ) continue;
+		// A failure would only show again on the next sync, and the records
+		// are in the page cache regardless, so it's not worth stopping for.
+		fdatasync(seg->fd);
+		seg->synced = committed;
+		synced = true;
+	}
+
+	guint64 acked = __atomic_load_n(&j->ack->acked, __ATOMIC_RELAXED);
+	if( acked != j->synced_ack ) {
+		fdatasync(j->ack_fd);
+		j->synced_ack = acked;
+		synced = true;
+	}
+
+	if( synced ) stats_add(&j->stats->journal_syncs, 1);
+}
+
+// Deletes the segments before the first with records still unacknowledged.
+static void trim( Journal *j ) {
+	if( !g_atomic_int_get(&j->replayed) ) return;
+
+	guint64 acked = __atomic_load_n(&j->ack->acked, __ATOMIC_RELAXED);
+	JournalSegment *next;
+	while( (next = __atomic_load_n(&j->head->next, __ATOMIC_ACQUIRE)) != NULL && next->first_seq <= acked ) {
+		segment_free(j->head, true);
+		j->head = next;
+	}
+}
+
+static gpointer journal_main( Journal *j ) {
+	gint64 next_sync = g_get_monotonic_time() + j->sync_interval_us;
+	while( !g_atomic_int_get(&j->stopping) ) {
+		prepare(j);
+		trim(j);
+
+		gint64 now = g_get_monotonic_time();
+		if( now >= next_sync ) {
+			sync_journal(j);
+			next_sync = now + j->sync_interval_us;
+		}
+		g_usleep(POLL_INTERVAL_US);
+	}
+	return NULL;
+}
+
+static void close_journal( Journal *j, bool remove ) {
+	JournalSegment *next;
+	for( JournalSegment *seg = j->head; seg != NULL; seg = next ) {
+		next = seg->next;
+		segment_free(seg, remove);
+	}
+	if( j->prepared != NULL ) segment_free(j->prepared, true);
+
+	if( j->ack != NULL ) munmap(j->ack, sizeof(JournalAck));
+	if( j->ack_fd != -1 ) close(j->ack_fd);
+	g_free(j->dir);
+	free(j);
+}
+
+Journal *journal_open( const gchar *dir, gsize segment_size, gint64 sync_interval_us, Stats *stats, GError **err ) {
+	g_assert(segment_size % RECORD_ALIGN == 0 && sync_interval_us > 0);
+
+	if( g_mkdir_with_parents(dir, S_IRWXU) == -1 ) {
+		g_set_error_errno(err);
+		return NULL;
+	}
+
+	Journal *j;
+	if( (errno = posix_memalign((void **) &j, CACHE_LINE_SIZE, sizeof(Journal))) != 0 ) {
+		g_set_error_errno(err);
+		return NULL;
+	}
+	memset(j, 0, sizeof(*j));
+
+	j->dir = g_strdup(dir);
+	j->segment_size = segment_size;
+	j->sync_interval_us = sync_interval_us;
+	j->stats = stats;
+	j->ack_fd = -1;
+
+	if( !open_ack(j, err) || !load_segments(j, err) ) goto err;
+
+	// New records always go in a segment of their own, rather than after
+	// whatever was last written before a crash.
+	JournalSegment *seg = segment_new(j, err);
+	if( seg == NULL ) goto err;
+	link_segment(j, seg);
+	j->replay.end = seg;
+	if( j->replay.seg == NULL ) j->replay.seg = seg;
+	j->synced_ack = j->ack->acked;
+
+	j->thread = g_thread_new("Rails Journal", (GThreadFunc) journal_main, j);
+	return j;
+
+err:
+	close_journal(j, false);
+	return NULL;
+}
+
+void journal_free( Journal *j ) {
+	g_atomic_int_set(&j->stopping, true);
+	g_thread_join(j->thread);
+
+	sync_journal(j);
+	close_journal(j, j->ack->acked >= j->producer.seq);
+}
+
+bool journal_replay_peek( Journal *j, const gchar **data, gsize *len ) {
+	while( j->replay.seg != j->replay.end ) {
+		if( record_at(j->replay.seg, j->replay.off, data, len) ) return true;
+		j->replay.seg = j->replay.seg->next;
+		j->replay.off = sizeof(JournalSegmentHeader);
+	}
+	g_atomic_int_set(&j->replayed, true);
+	return false;
+}
+
+void journal_replay_pop( Journal *j ) {
+	const gchar *data;
+	gsize len;
+	if( !record_at(j->replay.seg, j->replay.off, &data, &len) ) g_assert_not_reached();
+	j->replay.off += record_size(len);
+
+	stats_add(&j->stats->lines_replayed, 1);
+	stats_add(&j->stats->bytes_replayed, len);
+}
+
+// Moves the producer on to a new segment, the one the thread prepared if it
+// has. A full disk is an error like any other: records can't be queued
+// without being journaled, and dropping every one of them until there's room
+// again would lose far more than stopping does.
+static bool roll( Journal *j, GError **err ) {
+	JournalSegment *seg = __atomic_exchange_n(&j->prepared, NULL, __ATOMIC_ACQUIRE);
+	if( seg == NULL ) {
+		seg = segment_new(j, err);
+		if( seg == NULL ) return false;
+	}
+	link_segment(j, seg);
+	return true;
+}
+
+bool journal_write( Journal *j, const gchar *data, gsize len, GError **err ) {
+	g_assert(len > 0 && len <= G_MAXUINT32);
+
+	gsize size = record_size(len);
+	if( sizeof(JournalSegmentHeader) + size > j->segment_size ) return false;
+	if( j->producer.off + size > j->producer.seg->size && !roll(j, err) ) return false;
+
+	JournalRecordHeader *hdr = (JournalRecordHeader *) (j->producer.seg->base + j->producer.off);
+	memcpy(hdr + 1, data, len);
+	j->producer.pending = len;
+	return true;
+}
+
+void journal_commit( Journal *j ) {
+	guint32 len = j->producer.pending;
+	g_assert(len != 0);
+
+	// A record written but never committed may have left its payload past
+	// this one's end, so the next length is cleared first; otherwise it could
+	// be read as a record.
+	JournalSegment *seg = j->producer.seg;
+	gsize next = j->producer.off + record_size(len);
+	if( next + sizeof(JournalRecordHeader) <= seg->size ) {
+		JournalRecordHeader *next_hdr = (JournalRecordHeader *) (seg->base + next);
+		__atomic_store_n(&next_hdr->length, 0, __ATOMIC_RELAXED);
+	}
+
+	// The length goes in last, so that a record is never found half written.
+	JournalRecordHeader *hdr = (JournalRecordHeader *) (seg->base + j->producer.off);
+	__atomic_store_n(&hdr->length, len, __ATOMIC_RELEASE);
+	j->producer.off = next;
+	__atomic_store_n(&j->producer.seg->committed, j->producer.off, __ATOMIC_RELEASE);
+	j->producer.seq++;
+	j->producer.pending = 0;
+
+	stats_add(&j->stats->lines_journaled, 1);
+	stats_add(&j->stats->bytes_journaled, len);
+}
+
+void journal_ack( Journal *j, guint64 n ) {
+	__atomic_store_n(&j->ack->acked, j->ack->acked + n, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,235 @@
+#ifdef __linux__
+// For splice.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#endif
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "errors.h"
+#include "slab.h"
+#include "line_reader.h"
+
+// A slab is retired once less than this fraction of it is left to read into.
+#define MIN_READ_FRACTION 8
+
+// When passing input straight through, at most this much of the end of each
+// chunk is copied in to find the last line boundary.
+#define SPLICE_TAIL_BYTES 4096
+
+struct LineReader {
+	int fd;
+	SlabPool *pool;
+	gsize min_read;
+
+	Slab *slab;
+	// Offset of the first byte in slab not yet handed out as part of a line.
+	gsize start;
+	gint handed_out;
+	// Set once splice has failed on fd, which is then only ever read.
+	bool no_splice;
+};
+
+LineReader *line_reader_new( int fd, SlabPool *pool ) {
+	LineReader *r = g_slice_new0(LineReader);
+	r->fd = fd;
+	r->pool = pool;
+	r->min_read = MAX(slab_pool_slab_size(pool) / MIN_READ_FRACTION, 1);
+	return r;
+}
+
+void line_reader_free( LineReader *r ) {
+	if( r->slab != NULL ) slab_settle(r->slab, r->handed_out);
+	g_slice_free(LineReader, r);
+}
+
+// Moves any partial line into a fresh slab and retires the current one.
+static bool next_slab( LineReader *r, GError **err ) {
+	gsize partial = 0;
+	if( r->slab != NULL ) partial = r->slab->len - r->start;
+
+	// One spare byte is kept so a final unterminated line can be terminated.
+	gsize need = partial + r->min_read + 1;
+	if( need > slab_pool_slab_size(r->pool) ) need = MAX(need, 2 * partial);
+
+	Slab *slab = slab_pool_get(r->pool, need, err);
+	if( slab == NULL ) return false;
+	slab_hold(slab);
+
+	if( r->slab != NULL ) {
+		memcpy(slab->data, r->slab->data + r->start, partial);
+		slab_settle(r->slab, r->handed_out);
+	}
+	slab->len = partial;
+
+	r->slab = slab;
+	r->start = 0;
+	r->handed_out = 0;
+
+	return true;
+}
+
+static void split_lines( LineReader *r, gsize scan_from, LineReaderFunc func, gpointer data ) {
+	Slab *slab = r->slab;
+	const gchar *end = slab->data + slab->len;
+	const gchar *p = slab->data + scan_from, *nl;
+
+	// glibc's memchr is SIMD accelerated, which matters as this scan is the
+	// only pass over the data the reader makes.
+	while( (nl = memchr(p, '\n', end - p)) != NULL ) {
+		gsize line_end = nl + 1 - slab->data;
+		if( func(slab, r->start, line_end - r->start, data) ) r->handed_out++;
+		r->start = line_end;
+		p = nl + 1;
+	}
+}
+
+gssize line_reader_read( LineReader *r, LineReaderFunc func, gpointer data, GError **err ) {
+	if( r->slab == NULL || r->slab->size - r->slab->len <= r->min_read ) {
+		if( !next_slab(r, err) ) return -1;
+	}
+	Slab *slab = r->slab;
+
+	ssize_t nread = read(r->fd, slab->data + slab->len, slab->size - slab->len - 1);
+	if( nread == -1 ) {
+		g_set_error_errno(err);
+		return -1;
+	} else if( nread == 0 ) {
+		if( slab->len > r->start ) {
+			slab->data[slab->len++] = '\n';
+			split_lines(r, slab->len - 1, func, data);
+		}
+		set_gerror_eof(err);
+		return -1;
+	}
+
+	gsize scan_from = slab->len;
+	slab->len += nread;
+	split_lines(r, scan_from, func, data);
+
+	return nread;
+}
+
+#ifdef __linux__
+// Writes as much of buf as out_fd, a pipe, will take without blocking. Each
+// write is at most PIPE_BUF bytes and only made once poll says there is room,
+// which is enough as long as we are the pipe's only writer. vmsplice would
+// avoid the copy, but would leave the pipe pointing into a slab that gets
+// reused.
+static gssize write_pipe( int out_fd, const gchar *buf, gsize len, GError **err ) {
+	gsize written = 0;
+	while( written < len ) {
+		struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+		int ready = poll(&pfd, 1, 0);
+		if( ready == -1 ) {
+			g_set_error_errno(err);
+			return -1;
+		} else if( ready == 0 ) {
+			break;
+		}
+
+		ssize_t n = write(out_fd, buf + written, MIN(len - written, PIPE_BUF));
+		if( n == -1 ) {
+			if( errno == EAGAIN ) break;
+			g_set_error_errno(err);
+			return -1;
+		}
+		written += n;
+	}
+	return written;
+}
+
+gssize line_reader_splice( LineReader *r, int out_fd, LineReaderFunc func, gpointer data, GError **err ) {
+	if( r->no_splice ) return 0;
+
+	struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+	if( poll(&pfd, 1, -1) == -1 ) {
+		g_set_error_errno(err);
+		return -1;
+	}
+
+	int avail;
+	if( ioctl(r->fd, FIONREAD, &avail) == -1 ) {
+		g_set_error_errno(err);
+		return -1;
+	}
+	// End of file, which line_reader_read deals with.
+	if( avail <= 0 ) return 0;
+
+	gsize passed = 0;
+
+	// A partial line left from before has to go out ahead of anything new.
+	if( r->slab != NULL && r->slab->len > r->start ) {
+		gssize n = write_pipe(out_fd, r->slab->data + r->start, r->slab->len - r->start, err);
+		if( n == -1 ) return -1;
+		r->start += n;
+		if( r->start < r->slab->len ) return n;
+		passed += n;
+	}
+
+	if( r->slab == NULL || r->slab->size - r->slab->len <= r->min_read ) {
+		if( !next_slab(r, err) ) return -1;
+	}
+	Slab *slab = r->slab;
+	gsize tail = MIN(MIN((gsize) avail, SPLICE_TAIL_BYTES), r->min_read);
+
+	if( (gsize) avail > tail ) {
+		gsize want = avail - tail;
+		ssize_t n = splice(r->fd, NULL, out_fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if( n == -1 ) {
+			if( errno == EAGAIN ) return passed;
+			// The input can't be spliced from, a terminal for instance. Nothing
+			// was moved, so just stick to reading.
+			if( errno == EINVAL ) {
+				r->no_splice = true;
+				return passed;
+			}
+			g_set_error_errno(err);
+			return -1;
+		}
+		passed += n;
+		// out_fd is full. Whatever is left of the line being passed is picked
+		// up by the next read.
+		if( (gsize) n < want ) return passed;
+	}
+
+	// This can't block: we are the only reader and the bytes are there.
+	ssize_t nread = read(r->fd, slab->data + slab->len, tail);
+	if( nread == -1 ) {
+		g_set_error_errno(err);
+		return -1;
+	}
+	gsize scan_from = slab->len;
+	slab->len += nread;
+
+	// Pass everything up to the last newline so the chunk ends on a line
+	// boundary. The rest waits for the next chunk.
+	gsize line_end = slab->len;
+	while( line_end > scan_from && slab->data[line_end - 1] != '\n' ) line_end--;
+	if( line_end > scan_from ) {
+		gssize n = write_pipe(out_fd, slab->data + scan_from, line_end - scan_from, err);
+		if( n == -1 ) return -1;
+		r->start = scan_from + n;
+		passed += n;
+	}
+
+	// Only has lines to hand out if out_fd filled up part way.
+	split_lines(r, r->start, func, data);
+
+	return passed;
+}
+#else
+gssize line_reader_splice( LineReader *r, int out_fd, LineReaderFunc func, gpointer data, GError **err ) {
+	(void) r, (void) out_fd, (void) func, (void) data, (void) err;
+	return 0;
+}
+#endif
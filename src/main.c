@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 
 #define GLIB_VERSION_MIN_REQUIRED GLIB_VERSION_2_32
@@ -19,207 +20,897 @@
 #include "glib_extra.h"
 #include "errors.h"
 #include "die.h"
-#include "varnishlog.h"
+#include "slab.h"
+#include "line_reader.h"
+#include "grouper.h"
+#include "aggregator.h"
+#include "filter.h"
+#include "overflow.h"
+#include "sampler.h"
+#include "events.h"
 #include "priority.h"
+#include "varnishlog.h"
+#include "queue.h"
+#include "stats.h"
+#include "compressor.h"
+#include "journal.h"
+#include "spill.h"
+#include "shm_ring.h"
+#include "output.h"
+#include "wakeup.h"
+#include "server.h"
+#include "sender.h"
 #include "strings.h"
 
 // Priority is arbitrary chosen, but should be lower than varnishlog's
 #define HIGH_THREAD_PRIORITY 9
 
-#define SENDER_SLEEP_NS (50*1000)
+// Without --queue-capacity the queue is sized to --max-queue-size, up to
+// this. MAX_QUEUE_CAPACITY is the most queue_new can take.
+#define DEFAULT_QUEUE_CAPACITY (1 << 20)
+#define MAX_QUEUE_CAPACITY (G_MAXINT / 2 + 1)
+#define DEFAULT_SLAB_SIZE (1 << 20)
+// Enough free slabs to absorb bursts without going back to malloc.
+#define MAX_FREE_SLABS 64
+
+#define DEFAULT_BATCH_BYTES (256 * 1024)
+#define DEFAULT_BATCH_LINES 1024
+
+#define DEFAULT_WAKE_LATENCY_US (10 * 1000)
+
+#define DEFAULT_SPILL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_SPILL_MAX_BYTES (G_GINT64_CONSTANT(1024) * 1024 * 1024)
+// Once the sender is this close to the end of the spill, new lines go back
+// to the in-memory queue.
+#define SPILL_RESUME_BYTES (256 * 1024)
+
+#define DEFAULT_JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_JOURNAL_SYNC_INTERVAL_MS 1000
+
+#define DEFAULT_MAX_RESTART_DELAY_MS (10 * 1000)
+
+#define DEFAULT_SHM_RING_SIZE (64 * 1024 * 1024)
+#define MIN_SHM_RING_SIZE (1024 * 1024)
+
+#define DEFAULT_GROUP_TIMEOUT_MS 1000
+// Grouped transactions bigger than this fraction of a slab are passed on in
+// pieces.
+#define GROUP_MAX_FRACTION 4
+#define DEFAULT_SAMPLE_FLOOR_PERCENT 10
+#define DEFAULT_AGGREGATE_URL_DEPTH 1
+
+// How often timeouts, rollups and the sampling rate are looked at while no
+// input arrives.
+#define TICK_INTERVAL_US (100 * 1000)
 
-static volatile gint shutdown = false;
+#define MAX_INSTANCES STATS_MAX_INSTANCES
 
-typedef struct SenderControl {
-	GThread *thread;
-	GSList *lines;
-	volatile gint shutdown;
-	volatile gint *lines_len;
-} SenderControl;
+// Tokens the reader's fds are watched with, two for each instance.
+#define INPUT_TOKEN( i ) (2 * (i))
+#define CHILD_ERROR_TOKEN( i ) (2 * (i) + 1)
 
 typedef struct VarnishlogBufferOptions {
-	gint queue_length_fd, max_queue_size;
-	gboolean low_priority;
+	gint queue_length_fd, max_queue_size, queue_capacity, slab_size;
+	gint batch_bytes, batch_lines;
+	gint wake_threshold, wake_latency_us, spin_us;
+	gchar *spill_dir;
+	gint spill_segment_size, spill_high_water;
+	gint64 spill_max_bytes, max_queue_bytes;
+	gint64 compress_after;
+	gchar *journal_dir;
+	gint journal_segment_size, journal_sync_interval_ms;
+	OutputFlushPolicy flush_policy;
+	OutputFormat output_format;
+	VarnishlogInput input;
+	// NULL unless --instance is given, when input is run once for each.
+	gchar **instances;
+	guint ninstances;
+	gint max_restart_delay_ms;
+	gboolean low_priority, no_splice;
+	gboolean group;
+	gint group_timeout_ms;
+	gint max_latency_ms;
+	OverflowPolicy drop_policy;
+	// NULL unless the drop policy looks at each line.
+	Overflow *overflow;
+	gboolean sample;
+	gint sample_floor_percent, raw_percent;
+	gint aggregate_s, aggregate_url_depth;
+	Filter *filter;
+	gchar *listen_path;
+	gint client_max_lag;
+	gchar *shm_ring_path;
+	gint64 shm_ring_size;
+	// NULL unless pinned. When the reader is, the others are pinned to the
+	// CPUs the program started on unless given their own.
+	CpuSet *reader_cpus, *sender_cpus, *child_cpus;
 } VarnishlogBufferOptions;
 
-static void shutdown_sigaction() {
-	// Ignore SIGPIPE. The return codes of writes will be checked.
-	// stdout may have just gone away. We will still try to write any remaining
-	// buffer, but if stdout is gone that will cause a SIGPIPE. We'll exit
-	// gracefully if that happens rather than segfault.
-	signal(SIGPIPE, SIG_IGN);
-	g_atomic_int_set(&shutdown, true);
+// Set by --buffer-mode. Negative means pick the mode stdio would have used.
+static gint buffer_mode = -1;
+// Set by --output-format.
+static OutputFormat output_format = OUTPUT_FORMAT_TEXT;
+// Set by --drop-policy.
+static OverflowPolicy drop_policy = OVERFLOW_DROP_NEWEST;
+
+static void dump_stats( const Stats *stats ) {
+	fprintf(stderr,
+		"read %" G_GUINT64_FORMAT " lines, wrote %" G_GUINT64_FORMAT ", dropped %" G_GUINT64_FORMAT ", expired %" G_GUINT64_FORMAT ", %d queued; "
+		"residency p50 %" G_GUINT64_FORMAT "us, p99 %" G_GUINT64_FORMAT "us, max %" G_GUINT64_FORMAT "us\n",
+		__atomic_load_n(&stats->lines_read, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats->lines_written, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats->lines_dropped, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats->lines_expired, __ATOMIC_RELAXED),
+		g_atomic_int_get(&stats->lines_queued),
+		stats_residency_percentile(stats, 0.5),
+		stats_residency_percentile(stats, 0.99),
+		__atomic_load_n(&stats->residency_max_us, __ATOMIC_RELAXED)
+	);
 }
 
-static bool register_signal_handlers( GError **err ) {
-	struct sigaction act;
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = (void (*)( int )) shutdown_sigaction;
-	sigemptyset(&act.sa_mask);
-	sigaddset(&act.sa_mask, SIGPIPE);
-
-	static const int shutdown_signals[] = {
-		SIGHUP,
-		SIGINT,
-		SIGTERM
-	};
+static Stats *new_stats( int fd, GError **error ) {
+	int mmap_flags = MAP_SHARED;
+	if( fd == -1 ) mmap_flags |= MAP_ANON;
+#ifdef __linux__
+	mmap_flags |= MAP_LOCKED;
+#endif
+	Stats *stats = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+	if( stats == MAP_FAILED ) {
+		g_set_error_errno(error);
+		return NULL;
+	}
+	stats_init(stats);
+	return stats;
+}
 
-	// Register signal handlers to kill varnishlog if we die.
-	for( size_t i = 0; i < sizeof(shutdown_signals) / sizeof(int); i++ ) {
-		struct sigaction oact;
-		if( sigaction(shutdown_signals[i], &act, &oact) == -1 ) {
-			// NOTE: Failure here doesn't reset signal handlers.
-			g_set_error_errno(err);
+static bool free_stats( Stats *stats, GError **error ) {
+	if( munmap(stats, sizeof(Stats)) == -1 ) {
+		g_set_error_errno(error);
+		return false;
+	}
+	return true;
+}
+
+typedef struct ReaderContext {
+	Queue *queue;
+	Stats *stats;
+	// The counters of this instance, within stats.
+	StatsInstance *instance;
+	// Taken when the first line of each read block is queued.
+	gint64 block_time;
+	// Zero means no byte limit.
+	guint64 max_bytes;
+	guint queue_limit;
+	// NULL unless --compress-after is given.
+	Compressor *compressor;
+	// The length of every record queued so far.
+	guint64 queued_total;
+	// NULL unless --journal-dir is given.
+	Journal *journal;
+	GError *journal_error;
+	Overflow *overflow;
+	// NULL unless --sample or --raw-percent is given.
+	Sampler *sampler;
+	// Set by --raw-percent=0, where lines are only aggregated.
+	bool drop_raw;
+	// NULL unless --aggregate is given.
+	Aggregator *aggregator;
+	GError *aggregate_error;
+
+	Spill *spill;
+	guint spill_high_water, spill_low_water;
+	guint64 spill_high_water_bytes, spill_low_water_bytes;
+	bool spilling;
+	GError *spill_error;
+
+	// NULL unless any filtering options are given.
+	Filter *filter;
+	// NULL unless --group is given.
+	Grouper *grouper;
+	GError *group_error;
+} ReaderContext;
+
+static void drop_line( gsize len, ReaderContext *ctx ) {
+	stats_add(&ctx->stats->lines_dropped, 1);
+	stats_add(&ctx->stats->bytes_dropped, len);
+	stats_add(&ctx->instance->lines_dropped, 1);
+	stats_add(&ctx->instance->bytes_dropped, len);
+}
+
+// The queue or its byte limit is full.
+static void drop_full( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	drop_line(len, ctx);
+	stats_add(&ctx->stats->lines_dropped_full, 1);
+	stats_add(&ctx->stats->bytes_dropped_full, len);
+	if( ctx->overflow != NULL ) overflow_dropped(ctx->overflow, slab->data + offset, len);
+}
+
+// Once spilling starts every line goes to disk until the sender has nearly
+// caught up, so lines are always written in the order they were read.
+static bool spill_line( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	if( !ctx->spilling ) {
+		// The queue limit is above the high water mark, so the marker fits.
+		QueueRecord marker = { .slab = NULL };
+		if( !queue_push(ctx->queue, &marker) ) {
+			drop_line(len, ctx);
 			return false;
 		}
+		ctx->spilling = true;
 	}
 
+	if( ctx->spill_error != NULL || !spill_append(ctx->spill, slab->data + offset, len, &ctx->spill_error) )
+		drop_line(len, ctx);
+
+	// The line was copied out, so no reference to the slab is kept either way.
+	return false;
+}
+
+static void maybe_stop_spilling( ReaderContext *ctx ) {
+	if(
+		ctx->spilling &&
+		queue_length(ctx->queue) <= ctx->spill_low_water &&
+		stats_instance_bytes_held(ctx->stats, ctx->instance) <= ctx->spill_low_water_bytes &&
+		spill_pending_bytes(ctx->spill) <= SPILL_RESUME_BYTES
+	) {
+		spill_end(ctx->spill);
+		ctx->spilling = false;
+	}
+}
+
+// What queuing one more record from the slab would count against
+// --max-queue-bytes. If the sender releases the slab's last queued record in
+// the meantime, the slab is charged again, but what it held comes off first.
+static guint64 record_cost( Slab *slab ) {
+	return QUEUE_RECORD_COST + (g_atomic_int_get(&slab->queued) == 0 ? slab->size : 0);
+}
+
+// Puts a record on the queue, without checking any limits.
+static bool push_record( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	Stats *stats = ctx->stats;
+
+	// Offered before the sender could see any of its records.
+	if( ctx->compressor != NULL && !slab->offered ) compressor_offer(ctx->compressor, slab, ctx->queued_total);
+
+	if( ctx->block_time == 0 ) ctx->block_time = g_get_monotonic_time();
+	QueueRecord rec = {
+		.slab = slab,
+		.offset = offset,
+		.length = len,
+		.queued_at = ctx->block_time
+	};
+	if( !queue_push(ctx->queue, &rec) ) return false;
+	guint64 cost = QUEUE_RECORD_COST + slab_charge(slab);
+
+	g_assert_cmpint(g_atomic_int_get(&stats->lines_queued), <, G_MAXINT);
+	g_assert_cmpint(g_atomic_int_get(&stats->lines_queued), >=, 0);
+	g_atomic_int_inc(&stats->lines_queued);
+	stats_max(&stats->lines_queued_high_water, queue_length(ctx->queue));
+
+	guint64 bytes = __atomic_add_fetch(&stats->bytes_queued, cost, __ATOMIC_RELAXED);
+	stats_max(&stats->bytes_queued_high_water, bytes);
+	__atomic_add_fetch(&ctx->instance->lines_queued, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->instance->bytes_queued, cost, __ATOMIC_RELAXED);
+	ctx->queued_total += len;
+
 	return true;
 }
 
-typedef struct PrintLogEntryContext {
-	GError **error;
-	volatile gint *lines_len;
-} PrintLogEntryContext;
+// Queues a line, or a whole transaction with --group.
+static bool queue_record( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	Stats *stats = ctx->stats;
+	// The sender only ever lowers this, and the compressor only ever raises
+	// what it saves, so it's safe to check before pushing.
+	guint64 bytes = stats_instance_bytes_held(stats, ctx->instance) + record_cost(slab);
+
+	if(
+		ctx->spill != NULL && (
+			ctx->spilling ||
+			queue_length(ctx->queue) >= ctx->spill_high_water ||
+			bytes > ctx->spill_high_water_bytes
+		)
+	) {
+		return spill_line(slab, offset, len, ctx);
+	}
+
+	// A slab can be bigger than the limit on its own, so a record always goes
+	// on an empty queue.
+	if( ctx->max_bytes != 0 && bytes > ctx->max_bytes && queue_length(ctx->queue) != 0 ) {
+		drop_full(slab, offset, len, ctx);
+		return false;
+	}
 
-static void print_log_entry( GString *line, PrintLogEntryContext *ctx ) {
-	g_assert(line != NULL);
-	if( ctx->error != NULL && *ctx->error != NULL ) return;
+	// Only committed once queued, so that the journal holds exactly the
+	// records the sender will acknowledge.
+	if(
+		ctx->journal != NULL &&
+		(ctx->journal_error != NULL || !journal_write(ctx->journal, slab->data + offset, len, &ctx->journal_error))
+	) {
+		drop_line(len, ctx);
+		return false;
+	}
 
-	if( printf("%s\n", line->str) < 0 )
-		g_set_error_errno(ctx->error);
+	if( !push_record(slab, offset, len, ctx) ) {
+		drop_full(slab, offset, len, ctx);
+		return false;
+	}
+	if( ctx->journal != NULL ) journal_commit(ctx->journal);
 
-	g_atomic_int_dec_and_test(ctx->lines_len);
+	return true;
 }
 
-static void string_free( GString *str ) {
-	g_string_free(str, true);
+// Queues what the last run left unacknowledged in the journal, for as long as
+// the queue has room. Returns true once all of it has been queued.
+static bool replay_journal( SlabPool *pool, ReaderContext *ctx ) {
+	Slab *slab = NULL;
+	gint handed_out = 0;
+	bool done = false;
+
+	const gchar *data;
+	gsize len;
+	while( ctx->journal_error == NULL ) {
+		if( !journal_replay_peek(ctx->journal, &data, &len) ) {
+			done = true;
+			break;
+		}
+
+		// The record starts a new slab unless it fits in this one.
+		if( slab != NULL && slab->size - slab->len < len ) {
+			slab_settle(slab, handed_out);
+			slab = NULL;
+		}
+		guint64 cost = slab != NULL ? record_cost(slab) : QUEUE_RECORD_COST + MAX(len, slab_pool_slab_size(pool));
+
+		// A record over the byte limit on its own still goes once the queue
+		// is empty.
+		guint length = queue_length(ctx->queue);
+		bool full = length >= ctx->queue_limit || (
+			ctx->max_bytes != 0 && stats_instance_bytes_held(ctx->stats, ctx->instance) + cost > ctx->max_bytes
+		);
+		if( full && length != 0 ) break;
+
+		if( slab == NULL ) {
+			slab = slab_pool_get(pool, len, &ctx->journal_error);
+			if( slab == NULL ) break;
+			slab_hold(slab);
+			handed_out = 0;
+		}
+
+		memcpy(slab->data + slab->len, data, len);
+		// Nothing else is pushed, and there's room.
+		if( !push_record(slab, slab->len, len, ctx) ) g_assert_not_reached();
+		slab->len += len;
+		handed_out++;
+		journal_replay_pop(ctx->journal);
+	}
+
+	if( slab != NULL ) slab_settle(slab, handed_out);
+	return done;
 }
 
-static GError *sender_main( SenderControl *control ) {
-	GError *err = NULL;
+// Counts the line as read, aggregates it, and checks it against the filters
+// and sampling.
+static bool accept_line( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	Stats *stats = ctx->stats;
+	stats_add(&stats->lines_read, 1);
+	stats_add(&stats->bytes_read, len);
+	stats_add(&ctx->instance->lines_read, 1);
+	stats_add(&ctx->instance->bytes_read, len);
+
+	if( ctx->aggregator != NULL ) aggregator_add(ctx->aggregator, slab->data + offset, len);
+	if( ctx->drop_raw ) {
+		stats_add(&stats->lines_sampled_out, 1);
+		stats_add(&stats->bytes_sampled_out, len);
+		return false;
+	}
 
-	PrintLogEntryContext plec = {
-		.error = &err,
-		.lines_len = control->lines_len
-	};
+	if( ctx->filter != NULL && !filter_line(ctx->filter, slab->data + offset, len) ) {
+		stats_add(&stats->lines_filtered, 1);
+		stats_add(&stats->bytes_filtered, len);
+		return false;
+	}
+	if( ctx->sampler != NULL && !sampler_keep(ctx->sampler, slab->data + offset, len) ) {
+		stats_add(&stats->lines_sampled_out, 1);
+		stats_add(&stats->bytes_sampled_out, len);
+		return false;
+	}
+	return true;
+}
 
-	while( true ) {
-		GSList *lines = (GSList *) g_atomic_pointer_and(&control->lines, 0);
-		lines = g_slist_reverse(lines);
+// Whichever of the queue's limits is closer, out of OVERFLOW_PRESSURE_FULL.
+static guint queue_pressure( const ReaderContext *ctx ) {
+	guint64 pressure = (guint64) queue_length(ctx->queue) * OVERFLOW_PRESSURE_FULL / ctx->queue_limit;
+	if( ctx->max_bytes != 0 ) {
+		guint64 bytes = stats_instance_bytes_held(ctx->stats, ctx->instance);
+		pressure = MAX(pressure, bytes * OVERFLOW_PRESSURE_FULL / ctx->max_bytes);
+	}
+	return MIN(pressure, OVERFLOW_PRESSURE_FULL);
+}
 
-		g_slist_foreach(lines, (GFunc) print_log_entry, &plec);
-		if( err != NULL ) goto out_print_log_entry;
-		g_slist_free_full(lines, (GDestroyNotify) string_free);
+static bool queue_line( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	if( !accept_line(slab, offset, len, ctx) ) return false;
 
-		if( g_atomic_int_get(&control->shutdown) ) {
-			if( g_atomic_pointer_get(&control->lines) == NULL ) {
+	if( ctx->overflow != NULL ) {
+		Stats *stats = ctx->stats;
+		switch( overflow_check(ctx->overflow, slab->data + offset, len, queue_pressure(ctx)) ) {
+			case OVERFLOW_KEEP:
 				break;
-			} else {
-				continue;
-			}
+			case OVERFLOW_TRANSACTION:
+				drop_line(len, ctx);
+				stats_add(&stats->lines_dropped_transaction, 1);
+				stats_add(&stats->bytes_dropped_transaction, len);
+				return false;
+			case OVERFLOW_PRIORITY:
+				drop_line(len, ctx);
+				stats_add(&stats->lines_dropped_priority, 1);
+				stats_add(&stats->bytes_dropped_priority, len);
+				return false;
 		}
+	}
 
-		usleep(SENDER_SLEEP_NS);
+	return queue_record(slab, offset, len, ctx);
+}
 
-		continue;
+static bool group_line( Slab *slab, gsize offset, gsize len, ReaderContext *ctx ) {
+	if( !accept_line(slab, offset, len, ctx) ) {
+		if( ctx->group_error == NULL ) grouper_skip(ctx->grouper, slab, offset, len, &ctx->group_error);
+		return false;
+	}
+	if( ctx->group_error != NULL ) {
+		drop_line(len, ctx);
+		return false;
+	}
+	return grouper_add(ctx->grouper, slab, offset, len, &ctx->group_error);
+}
 
-out_print_log_entry:
-		g_slist_free_full(lines, (GDestroyNotify) string_free);
+// One varnishd instance read from, with a queue of its own. Without
+// --instance there is just one, reading whichever input was given.
+typedef struct Instance {
+	guint index;
+	VarnishlogInput input;
+	Varnishlog *v;
+	ReaderContext ctx;
+	// Set from losing a supervised child until the next one's output is read.
+	gint64 lost_at;
+} Instance;
+
+// Stops a supervised child whose output has ended, and counts how it exited.
+static bool stop_child( Instance *in, Events *events, Stats *stats, GError **err ) {
+	Varnishlog *v = in->v;
+	events_unwatch(events, varnishlog_fd(v));
+	int error_fd = varnishlog_error_fd(v);
+	if( error_fd != -1 ) events_unwatch(events, error_fd);
 
-		goto out_loop_error;
+	int stat;
+	if( !varnishlog_stop_child(v, &stat, err) ) return false;
+	if( WIFSIGNALED(stat) ) {
+		stats_add(&stats->child_exits_signaled, 1);
+	} else if( WIFEXITED(stat) && WEXITSTATUS(stat) == 0 ) {
+		stats_add(&stats->child_exits_success, 1);
+	} else {
+		stats_add(&stats->child_exits_failure, 1);
 	}
+	return true;
+}
 
-	return NULL;
+// Starts the next child once it is due. Failing to is only counted; it is
+// tried again later.
+static bool maybe_restart_child( Instance *in, Events *events, bool watch_input, Stats *stats, GError **err ) {
+	Varnishlog *v = in->v;
+	gint64 restart_at = varnishlog_restart_at(v);
+	if( restart_at == 0 || g_get_monotonic_time() < restart_at ) return true;
+
+	GError *_err = NULL;
+	if( !varnishlog_restart(v, &_err) ) {
+		g_error_free(_err);
+		stats_add(&stats->child_restart_failures, 1);
+		return true;
+	}
+	stats_add(&stats->child_restarts, 1);
+	stats_add(&in->ctx.instance->child_restarts, 1);
 
-out_loop_error:
-	return err;
+	if( watch_input && !events_watch(events, varnishlog_fd(v), INPUT_TOKEN(in->index), err) ) return false;
+	return events_watch(events, varnishlog_error_fd(v), CHILD_ERROR_TOKEN(in->index), err);
 }
 
-static gint *new_lines_len_ptr( int fd, GError **error ) {
-	int mmap_flags = MAP_SHARED;
-	if( fd == -1 ) mmap_flags |= MAP_ANON;
-#ifdef __linux__
-	mmap_flags |= MAP_LOCKED;
-#endif
-	gint *lines_len = mmap(NULL, sizeof(gint), PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
-	if( lines_len == MAP_FAILED ) {
-		g_set_error_errno(error);
-		return NULL;
+static void note_resumed( Stats *stats, gint64 lost_at ) {
+	guint64 gap_ms = (g_get_monotonic_time() - lost_at) / 1000;
+	stats_add(&stats->child_downtime_ms, gap_ms);
+	__atomic_store_n(&stats->child_last_gap_ms, gap_ms, __ATOMIC_RELAXED);
+	stats_max(&stats->child_max_gap_ms, gap_ms);
+}
+
+// Hands over an error stashed by the reader's callbacks, in place of any
+// error from the read itself.
+static void take_error( GError **stashed, GError **err ) {
+	if( *stashed == NULL ) return;
+	if( *err != NULL ) g_error_free(*err);
+	*err = *stashed;
+	*stashed = NULL;
+}
+
+// Starts the instance's input and creates its queue, which --max-queue-size
+// limits for this instance alone.
+static bool start_instance( Instance *in, guint i, const VarnishlogBufferOptions *options, guint slack, SlabPool *pool, Events *events, GError **err ) {
+	in->index = i;
+	in->input = options->input;
+	if( options->instances != NULL ) in->input.instance = options->instances[i];
+
+	in->v = start_varnishlog(&in->input, pool, err);
+	if( in->v == NULL ) goto err_start_varnishlog;
+	int error_fd = varnishlog_error_fd(in->v);
+	if( error_fd != -1 && !events_watch(events, error_fd, CHILD_ERROR_TOKEN(i), err) ) goto err_events_watch;
+
+	in->ctx.queue = queue_new((guint) options->queue_capacity * slack, (guint) options->max_queue_size * slack, err);
+	if( in->ctx.queue == NULL ) goto err_queue_new;
+
+	return true;
+
+err_queue_new:
+err_events_watch:
+	shutdown_varnishlog(in->v, NULL, NULL);
+err_start_varnishlog:
+	return false;
+}
+
+static void free_reader_contexts( Instance *instances, guint n ) {
+	for( guint i = 0; i < n; i++ ) {
+		ReaderContext *ctx = &instances[i].ctx;
+		if( ctx->grouper != NULL ) grouper_free(ctx->grouper);
+		if( ctx->sampler != NULL ) sampler_free(ctx->sampler);
+		if( ctx->aggregator != NULL ) aggregator_free(ctx->aggregator);
 	}
-	return lines_len;
 }
 
-static bool free_lines_len_ptr( gint *lines_len, GError **error ) {
-	if( munmap(lines_len, sizeof(gint)) == -1 ) {
-		g_set_error_errno(error);
+// Reads whatever the instance has ready and keeps its child running, then
+// does whatever is due for its queue.
+static bool read_instance( Instance *in, const EventsReady *ready, Events *events, bool watch_input, int splice_fd, LineReaderFunc read_line, GError **err ) {
+	Varnishlog *v = in->v;
+	ReaderContext *ctx = &in->ctx;
+	Stats *stats = ctx->stats;
+	GError *_err = NULL;
+
+	if( ready->child ) varnishlog_reap(v, &_err);
+
+	// Its error is read as soon as it is sent, rather than between lines.
+	int error_fd = varnishlog_error_fd(v);
+	if( _err == NULL && events_ready(ready, CHILD_ERROR_TOKEN(in->index)) && varnishlog_read_error(v, &_err) )
+		events_unwatch(events, error_fd);
+
+	if( _err == NULL && events_ready(ready, INPUT_TOKEN(in->index)) ) {
+		gssize n = 0;
+		// While the sender has nothing left to write, nothing read can be
+		// overtaken by passing the next lines straight through.
+		bool spliced = false;
+		if( splice_fd != -1 && !ctx->spilling && queue_length(ctx->queue) == 0 ) {
+			n = splice_varnishlog_entries(v, splice_fd, read_line, ctx, &_err);
+			stats_add(&stats->splice_syscalls, 1);
+			if( n > 0 ) stats_add(&stats->bytes_spliced, n);
+			// stdout is full, so fall back to the queue. If that already
+			// started, wake the sender before waiting to read again.
+			spliced = n != 0 || queue_length(ctx->queue) != 0;
+		}
+
+		if( !spliced ) {
+			n = read_varnishlog_entries(v, read_line, ctx, &_err);
+			stats_add(&stats->read_syscalls, 1);
+		}
+
+		if( n > 0 && in->lost_at != 0 ) {
+			note_resumed(stats, in->lost_at);
+			in->lost_at = 0;
+		}
+	}
+
+	// The queue and the sender carry on while the child is restarted.
+	if( _err != NULL && varnishlog_lost(v, _err) ) {
+		g_clear_error(&_err);
+		if( in->lost_at == 0 ) in->lost_at = g_get_monotonic_time();
+		stop_child(in, events, stats, &_err);
+	}
+	if( _err == NULL ) maybe_restart_child(in, events, watch_input, stats, &_err);
+	if( ctx->grouper != NULL && ctx->group_error == NULL )
+		grouper_expire(ctx->grouper, g_get_monotonic_time(), &ctx->group_error);
+	if( ctx->aggregator != NULL && ctx->aggregate_error == NULL )
+		aggregator_tick(ctx->aggregator, g_get_monotonic_time(), &ctx->aggregate_error);
+	ctx->block_time = 0;
+
+	// Sampling is only used with a single instance.
+	if( ctx->sampler != NULL ) {
+		Sampler *sampler = ctx->sampler;
+		sampler_adjust(sampler, g_get_monotonic_time(), (gdouble) queue_pressure(ctx) / OVERFLOW_PRESSURE_FULL);
+		__atomic_store_n(&stats->sample_rate_ppm, (guint64) sampler_rate(sampler) * 1000000 / SAMPLER_RATE_ONE, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->transactions_sampled_out, sampler_transactions_dropped(sampler), __ATOMIC_RELAXED);
+	}
+
+	take_error(&ctx->group_error, &_err);
+	take_error(&ctx->aggregate_error, &_err);
+	take_error(&ctx->spill_error, &_err);
+	take_error(&ctx->journal_error, &_err);
+
+	if( ctx->spilling ) maybe_stop_spilling(ctx);
+
+	if( _err != NULL ) {
+		g_propagate_error(err, _err);
 		return false;
 	}
 	return true;
 }
 
+static void publish_cpus( volatile guint64 *field, const CpuSet *set ) {
+	if( set == NULL ) return;
+	guint64 mask[STATS_CPU_MASK_WORDS];
+	cpu_set_mask(set, mask, STATS_CPU_MASK_WORDS);
+	for( guint i = 0; i < STATS_CPU_MASK_WORDS; i++ ) field[i] = mask[i];
+}
+
 static bool reader_and_writer_main( const VarnishlogBufferOptions *options, GError **err ) {
-	Varnishlog *v = start_varnishlog(options->low_priority, err);
-	if( v == NULL ) goto err_setup_start_varnishlog;
-	if( !register_signal_handlers(err) ) goto err_setup_register_signal_handlers;
+	// Before anything is allocated, so that the queues and slabs the reader
+	// touches first are placed on its NUMA node.
+	if( options->reader_cpus != NULL && !pin_thread(options->reader_cpus, err) ) goto err_setup_pin_thread;
+
+	SlabPool *pool = slab_pool_new(options->slab_size, MAX_FREE_SLABS);
+
+	// Before any thread or child is started, so that the signals are only
+	// ever taken by the reader.
+	Events *events = events_new(TICK_INTERVAL_US, err);
+	if( events == NULL ) goto err_setup_events_new;
+
+	Stats *stats = new_stats(options->queue_length_fd, err);
+	if( stats == NULL ) goto err_setup_new_stats;
+	stats->instances = options->ninstances;
+	publish_cpus(stats->reader_cpus, options->reader_cpus);
+	publish_cpus(stats->sender_cpus, options->sender_cpus);
+	publish_cpus(stats->child_cpus, options->child_cpus);
+	guint node;
+	if( current_numa_node(&node) ) stats->reader_numa_node = node;
+
+	// When the sender sheds the oldest records the limits are where it
+	// starts, and the reader gets twice the room, so that it only has to drop
+	// lines itself if the sender is stuck.
+	guint slack = options->drop_policy == OVERFLOW_DROP_OLDEST ? 2 : 1;
+	guint ninstances = options->ninstances;
+	Instance *instances = g_new0(Instance, ninstances);
+	guint started;
+	for( started = 0; started < ninstances; started++ ) {
+		if( !start_instance(&instances[started], started, options, slack, pool, events, err) ) goto err_setup_start_instance;
+	}
 
-	volatile gint *lines_len = new_lines_len_ptr(options->queue_length_fd, err);
-	if( lines_len == NULL ) goto err_setup_new_lines_len_ptr;
+	Spill *spill = NULL;
+	if( options->spill_dir != NULL ) {
+		spill = spill_new(options->spill_dir, options->spill_segment_size, options->spill_max_bytes, err);
+		if( spill == NULL ) goto err_setup_spill_new;
+	}
+
+	// Threads inherit the CPUs of the thread that starts them, so the reader
+	// moves to the sender's while it starts the journal and compression
+	// threads, which would otherwise compete with it.
+	bool pin_helpers = options->reader_cpus != NULL && (options->journal_dir != NULL || options->compress_after != 0);
+	if( pin_helpers && !pin_thread(options->sender_cpus, err) ) goto err_setup_pin_helpers;
+
+	Journal *journal = NULL;
+	if( options->journal_dir != NULL ) {
+		journal = journal_open(
+			options->journal_dir, options->journal_segment_size,
+			(gint64) options->journal_sync_interval_ms * 1000, stats, err
+		);
+		if( journal == NULL ) goto err_setup_journal_open;
+	}
+
+	Compressor *compressor = NULL;
+	if( options->compress_after != 0 )
+		compressor = compressor_new(stats, options->slab_size, options->compress_after);
+
+	if( pin_helpers && !pin_thread(options->reader_cpus, err) ) goto err_setup_pin_reader;
+
+	// Every queue is the same size.
+	guint queue_limit = MIN(queue_capacity(instances[0].ctx.queue) / slack, options->max_queue_size != 0 ? (guint) options->max_queue_size : G_MAXUINT);
+
+	Server *server = NULL;
+	if( options->listen_path != NULL ) {
+		guint max_lag = options->client_max_lag != 0 ? (guint) options->client_max_lag : queue_limit - queue_limit / 4;
+		server = server_new(options->listen_path, max_lag, options->batch_bytes, options->batch_lines, err);
+		if( server == NULL ) goto err_setup_server_new;
+	}
+
+	ShmRing *ring = NULL;
+	if( options->shm_ring_path != NULL ) {
+		ring = shm_ring_new(options->shm_ring_path, options->shm_ring_size, err);
+		if( ring == NULL ) goto err_setup_shm_ring_new;
+	}
+
+	// What each instance's context starts from. The spill, the journal and
+	// the compressor are only used with a single instance.
+	guint spill_high_water = options->spill_high_water != 0 ? (guint) options->spill_high_water : queue_limit - queue_limit / 4;
+	guint64 max_bytes = options->max_queue_bytes;
+	guint64 spill_high_water_bytes = max_bytes != 0 ? max_bytes - max_bytes / 4 : G_MAXUINT64;
+	ReaderContext shared = {
+		.queue = NULL,
+		.stats = stats,
+		.instance = NULL,
+		.block_time = 0,
+		.max_bytes = max_bytes * slack,
+		.queue_limit = queue_limit,
+		.compressor = compressor,
+		.queued_total = 0,
+		.journal = journal,
+		.journal_error = NULL,
+		.overflow = options->overflow,
+		.sampler = NULL,
+		.spill = spill,
+		.spill_high_water = MIN(spill_high_water, queue_limit - 1),
+		.spill_low_water = spill_high_water / 2,
+		.spill_high_water_bytes = spill_high_water_bytes,
+		.spill_low_water_bytes = spill_high_water_bytes / 2,
+		.spilling = false,
+		.spill_error = NULL,
+		.filter = options->filter,
+		.grouper = NULL,
+		.group_error = NULL,
+		.drop_raw = options->raw_percent == 0,
+		.aggregator = NULL,
+		.aggregate_error = NULL
+	};
+	// --raw-percent caps the sampling rate, and fixes it without --sample.
+	guint raw_rate = options->raw_percent * SAMPLER_RATE_ONE / 100;
+	LineReaderFunc read_line = options->group ? (LineReaderFunc) group_line : (LineReaderFunc) queue_line;
+	for( guint i = 0; i < ninstances; i++ ) {
+		ReaderContext *ctx = &instances[i].ctx;
+		Queue *queue = ctx->queue;
+		*ctx = shared;
+		ctx->queue = queue;
+		ctx->instance = &stats->instance[i];
+		if( options->instances != NULL ) g_strlcpy(ctx->instance->name, options->instances[i], sizeof(ctx->instance->name));
+
+		if( options->sample || (options->raw_percent > 0 && options->raw_percent < 100) ) {
+			guint floor = options->sample ? MIN((guint) options->sample_floor_percent * SAMPLER_RATE_ONE / 100, raw_rate) : raw_rate;
+			ctx->sampler = sampler_new(floor, raw_rate);
+		}
+		if( options->aggregate_s != 0 ) {
+			ctx->aggregator = aggregator_new(
+				pool, (gint64) options->aggregate_s * G_USEC_PER_SEC, options->aggregate_url_depth,
+				(LineReaderFunc) queue_record, ctx
+			);
+		}
+		if( options->group ) {
+			ctx->grouper = grouper_new(
+				pool, options->slab_size / GROUP_MAX_FRACTION,
+				(gint64) options->group_timeout_ms * 1000,
+				(LineReaderFunc) queue_record, ctx
+			);
+		}
+	}
+
+	Output *output;
+	if( ring != NULL ) {
+		output = output_new_ring(ring, options->flush_policy, options->batch_bytes, options->batch_lines);
+	} else {
+		output = output_new(STDOUT_FILENO, options->flush_policy, options->batch_bytes, options->batch_lines);
+	}
+	if( options->instances != NULL ) output_set_instances(output, options->instances);
+	if( options->output_format == OUTPUT_FORMAT_BINARY && !output_use_binary(output, err) ) goto err_setup_output_use_binary;
+
+	SenderQueue *sender_queues = g_new0(SenderQueue, ninstances);
+	for( guint i = 0; i < ninstances; i++ ) {
+		sender_queues[i].queue = instances[i].ctx.queue;
+		sender_queues[i].stats = &stats->instance[i];
+		sender_queues[i].instance = options->instances != NULL ? i + 1 : 0;
+	}
 
 	SenderControl sender_control = {
-		.lines = NULL,
+		.queues = sender_queues,
+		.nqueues = ninstances,
+		.spill = spill,
+		.output = output,
+		.server = server,
 		.shutdown = false,
-		.lines_len = lines_len
+		.stats = stats,
+		.spin_us = options->spin_us,
+		.max_latency_us = (gint64) options->max_latency_ms * 1000,
+		.shed_records = slack > 1 ? queue_limit : 0,
+		.shed_bytes = slack > 1 ? max_bytes : 0,
+		.compressor = compressor,
+		.journal = journal,
+		.cpus = options->sender_cpus,
+		// Below the threshold the reader won't wake the sender, so it has to
+		// come back on its own to bound latency.
+		.park_timeout_us = options->wake_threshold > 1 ? options->wake_latency_us : -1
 	};
+	wakeup_init(&sender_control.wakeup);
+	// So that a stalled or missing ring reader can't hold up shutdown.
+	if( ring != NULL ) shm_ring_stop_on(ring, &sender_control.shutdown);
+	// The server waits in epoll, so it needs to be woken through an fd.
+	if( server != NULL && !wakeup_use_fd(&sender_control.wakeup, err) ) goto err_setup_wakeup_use_fd;
 	// Note that sender_control.thread might not be initialized when
 	// the thread starts.
 	sender_control.thread = g_thread_new("Rails Sender", (GThreadFunc) sender_main, &sender_control);
 
 	if( !options->low_priority && !high_priority_thread(HIGH_THREAD_PRIORITY, err) ) goto err_setup_high_priority_thread;
 
-	while( !g_atomic_int_get(&shutdown) ) {
+	// Input can only be passed straight through to a pipe as text, without
+	// instance names, and grouping, filtering, sampling, aggregation and the
+	// per-line drop policies have to see every line.
+	bool per_line = options->group || options->filter != NULL || options->sample || options->raw_percent < 100 || options->aggregate_s != 0 || options->overflow != NULL;
+	int splice_fd = -1;
+	struct stat out_stat;
+	if( !options->no_splice && !per_line && options->instances == NULL && server == NULL && ring == NULL && options->output_format == OUTPUT_FORMAT_TEXT && fstat(STDOUT_FILENO, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode) )
+		splice_fd = STDOUT_FILENO;
+
+	// Nothing new is read until the journal has been replayed.
+	bool replaying = journal != NULL;
+	for( guint i = 0; i < ninstances && !replaying; i++ ) {
+		if( !events_watch(events, varnishlog_fd(instances[i].v), INPUT_TOKEN(i), err) ) goto err_setup_events_watch_input;
+	}
+
+	for( ;; ) {
+		// The journal is only used with a single instance.
+		if( replaying && replay_journal(pool, &instances[0].ctx) ) {
+			replaying = false;
+			// Unless the child is waiting to be restarted, which watches it.
+			Varnishlog *v = instances[0].v;
+			if( varnishlog_fd(v) != -1 && !events_watch(events, varnishlog_fd(v), INPUT_TOKEN(0), err) )
+				goto err_events_watch_input;
+		}
+
+		// Signals only ever arrive here, never in the middle of a read.
+		EventsReady ready;
+		if( !events_wait(events, &ready, err) ) goto err_events_wait;
+		if( ready.shutdown ) {
+			// stdout may have just gone away. The sender still writes what is
+			// left, and should get an error for it rather than be killed.
+			signal(SIGPIPE, SIG_IGN);
+			break;
+		}
+		if( ready.dump ) dump_stats(stats);
+
 		GError *_err = NULL;
-		GString *line = read_varnishlog_entry(v, &_err);
-
-		if( line != NULL ) {
-			if( options->max_queue_size != 0 && g_atomic_int_get(lines_len) == options->max_queue_size ) {
-				g_string_free(line, true);
-				continue;
-			} else {
-				GSList *lines = (GSList *) g_atomic_pointer_and(&sender_control.lines, 0);
-				lines = g_slist_prepend(lines, line);
-
-				// We'll probably run out of memory long before this is a problem, but just in case...
-				g_assert_cmpint(g_atomic_int_get(lines_len), <, G_MAXINT);
-				g_assert_cmpint(g_atomic_int_get(lines_len), >=, 0);
-				g_atomic_int_inc(lines_len);
-
-				g_atomic_pointer_set(&sender_control.lines, lines);
-			}
+		bool wake = false;
+		Instance *in;
+		for( in = instances; in < instances + ninstances; in++ ) {
+			bool ok = read_instance(in, &ready, events, !replaying, splice_fd, read_line, &_err);
+			wake = wake || in->ctx.spilling || queue_length(in->ctx.queue) >= (guint) options->wake_threshold;
+			if( !ok ) break;
 		}
 
+		// Checked once per block rather than once per line.
+		if( wake && wakeup_parked(&sender_control.wakeup) ) wakeup_wake(&sender_control.wakeup);
+
 		if( _err != NULL ) {
-			if( g_atomic_int_get(&shutdown) ) {
+			if(
+				varnishlog_finite(in->v) &&
+				_err->domain == VARNISHLOG_BUFFER_QUARK &&
+				_err->code == VARNISHLOG_BUFFER_ERROR_EOF
+			) {
+				// Everything has been read.
 				g_error_free(_err);
 				break;
-			} else if( _err->domain == ERRNO_QUARK && _err->code == EINTR ) {
-				// Retry if the syscall was interrupted.
-				g_error_free(_err);
-				continue;
 			}
 			g_propagate_error(err, _err);
 			goto err_read_varnishlog_entry;
 		}
 	}
 
-	// This is just in case the call to ignore SIGPIPE in the signal handler
-	// failed as that call isn't checked.
+	// SIGPIPE is only ignored above on a signal, and that call isn't checked.
+	// The return codes of writes are checked instead.
 	if( signal(SIGPIPE, SIG_IGN) == SIG_ERR ) {
 		g_set_error_errno(err);
 		goto err_teardown_signal_sigpipe;
 	}
 
+	// Whatever is still open goes out incomplete rather than not at all.
+	for( guint i = 0; i < ninstances; i++ ) {
+		ReaderContext *ctx = &instances[i].ctx;
+		if( ctx->grouper != NULL && !grouper_flush(ctx->grouper, err) )
+			goto err_teardown_grouper_flush;
+		if( ctx->aggregator != NULL && !aggregator_flush(ctx->aggregator, err) )
+			goto err_teardown_aggregator_flush;
+	}
+
+	// Send the sender back to the queue once it has finished the spill, which
+	// is only used with a single instance.
+	if( instances[0].ctx.spilling ) spill_end(spill);
+
 	g_atomic_int_set(&sender_control.shutdown, true);
+	wakeup_wake(&sender_control.wakeup);
 
 	GError *_err = g_thread_join(sender_control.thread);
 	if( _err != NULL ) {
@@ -227,67 +918,153 @@ static bool reader_and_writer_main( const VarnishlogBufferOptions *options, GErr
 		goto err_teardown_g_thread_join;
 	}
 
-	g_assert_cmpuint(g_slist_length(sender_control.lines), ==, 0);
-	g_assert_cmpuint(g_atomic_int_get(lines_len), ==, 0);
-
-	if( !free_lines_len_ptr((gint *) lines_len, err) ) goto err_teardown_free_lines_len_ptr;
+	for( guint i = 0; i < ninstances; i++ ) {
+		g_assert_cmpuint(queue_length(instances[i].ctx.queue), ==, 0);
+		g_assert_cmpuint(stats->instance[i].bytes_queued, ==, 0);
+	}
+	g_assert_cmpuint(g_atomic_int_get(&stats->lines_queued), ==, 0);
+	g_assert_cmpuint(stats->bytes_queued, ==, 0);
+	// Leave the final figures in the stats file.
+	stats_publish_residency(stats);
+	free_reader_contexts(instances, ninstances);
+	if( compressor != NULL ) compressor_free(compressor);
+	wakeup_clear(&sender_control.wakeup);
+	g_free(sender_queues);
+	output_free(output);
+	if( ring != NULL ) shm_ring_free(ring);
+	if( server != NULL ) server_free(server);
+	if( journal != NULL ) journal_free(journal);
+	if( spill != NULL ) spill_free(spill);
+	for( guint i = 0; i < ninstances; i++ ) queue_free(instances[i].ctx.queue);
+
+	int stat = 0;
+	for( guint i = 0; i < ninstances; i++ ) {
+		int instance_stat;
+		bool ok = shutdown_varnishlog(instances[i].v, &instance_stat, err);
+		instances[i].v = NULL;
+		if( !ok ) goto err_teardown_shutdown_varnishlog;
+		// The first which didn't simply stop when told to.
+		if( stat == 0 && !(WIFSIGNALED(instance_stat) && WTERMSIG(instance_stat) == SIGINT) )
+			stat = instance_stat;
+	}
+	g_free(instances);
 
-	int stat;
-	if( !shutdown_varnishlog(v, &stat, err) ) goto err_teardown_shutdown_varnishlog;
+	if( !free_stats(stats, err) ) goto err_teardown_free_stats;
+	events_free(events);
+	slab_pool_free(pool);
 
-	if( !WIFSIGNALED(stat) || WTERMSIG(stat) != SIGINT )
+	if( stat != 0 )
 		return stat;
 
 	return true;
 
 err_read_varnishlog_entry:
+err_events_wait:
+err_events_watch_input:
+err_setup_events_watch_input:
 err_setup_high_priority_thread:
 err_teardown_signal_sigpipe:
-	g_atomic_int_set(&sender_control.shutdown, true);
-	g_thread_join(sender_control.thread);
-
-	g_assert_cmpuint(g_slist_length(sender_control.lines), ==, 0);
-	g_assert_cmpuint(g_atomic_int_get(lines_len), ==, 0);
+err_teardown_grouper_flush:
+err_teardown_aggregator_flush:
+	if( instances[0].ctx.spilling ) spill_end(spill);
+	stop_sender(&sender_control);
 err_teardown_g_thread_join:
-	free_lines_len_ptr((gint *) lines_len, NULL);
-err_teardown_free_lines_len_ptr:
-err_setup_new_lines_len_ptr:
-err_setup_register_signal_handlers:
-	shutdown_varnishlog(v, NULL, NULL);
+	drain_sender(&sender_control);
+err_setup_wakeup_use_fd:
+	wakeup_clear(&sender_control.wakeup);
+	g_free(sender_queues);
+err_setup_output_use_binary:
+	free_reader_contexts(instances, ninstances);
+	output_free(output);
+	if( ring != NULL ) shm_ring_free(ring);
+err_setup_shm_ring_new:
+	if( server != NULL ) server_free(server);
+err_setup_server_new:
+err_setup_pin_reader:
+	if( compressor != NULL ) compressor_free(compressor);
+	if( journal != NULL ) journal_free(journal);
+err_setup_journal_open:
+err_setup_pin_helpers:
+	if( spill != NULL ) spill_free(spill);
+err_setup_spill_new:
+err_setup_start_instance:
+	for( guint i = 0; i < started; i++ ) queue_free(instances[i].ctx.queue);
 err_teardown_shutdown_varnishlog:
-err_setup_start_varnishlog:
+	for( guint i = 0; i < started; i++ ) {
+		if( instances[i].v != NULL ) shutdown_varnishlog(instances[i].v, NULL, NULL);
+	}
+	g_free(instances);
+	free_stats(stats, NULL);
+err_teardown_free_stats:
+err_setup_new_stats:
+	events_free(events);
+err_setup_events_new:
+	slab_pool_free(pool);
+err_setup_pin_thread:
 	return false;
 }
 
-static bool set_stream_buffering( FILE *stream, int mode, GError **err ) {
-	if( setvbuf(stream, NULL, mode, 0) != 0 ) {
-		g_set_error_errno(err);
-		return false;
-	}
-	return true;
+static bool parse_cpus( const gchar *list, CpuSet **set, GError **err ) {
+	if( list == NULL ) return true;
+	*set = cpu_set_parse(list, err);
+	return *set != NULL;
 }
 
 static gboolean set_buffer_mode( const gchar *option_name, const gchar *value, gpointer data, GError **err ) {
 	(void) data, (void) option_name;
 
-	int mode = _IOFBF;
 	if(
 		g_ascii_strcasecmp("unbuffered", value) == 0 ||
 		g_ascii_strcasecmp("none", value) == 0
 	) {
-		mode = _IONBF;
+		buffer_mode = OUTPUT_FLUSH_RECORD;
 	} else if( g_ascii_strcasecmp("line", value) == 0 ) {
-		mode = _IOLBF;
+		buffer_mode = OUTPUT_FLUSH_DRAINED;
 	} else if(
 		g_ascii_strcasecmp("block", value) == 0 ||
 		g_ascii_strcasecmp("full", value) == 0
 	) {
-		mode = _IOFBF;
+		buffer_mode = OUTPUT_FLUSH_FULL;
+	} else {
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown buffer mode %s", value);
+		return false;
+	}
+
+	return true;
+}
+
+static gboolean set_drop_policy( const gchar *option_name, const gchar *value, gpointer data, GError **err ) {
+	(void) data, (void) option_name;
+
+	if( g_ascii_strcasecmp("newest", value) == 0 ) {
+		drop_policy = OVERFLOW_DROP_NEWEST;
+	} else if( g_ascii_strcasecmp("oldest", value) == 0 ) {
+		drop_policy = OVERFLOW_DROP_OLDEST;
+	} else if( g_ascii_strcasecmp("transactions", value) == 0 ) {
+		drop_policy = OVERFLOW_DROP_TRANSACTIONS;
+	} else if( g_ascii_strcasecmp("tags", value) == 0 ) {
+		drop_policy = OVERFLOW_DROP_TAGS;
+	} else {
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown drop policy %s", value);
+		return false;
+	}
+
+	return true;
+}
+
+static gboolean set_output_format( const gchar *option_name, const gchar *value, gpointer data, GError **err ) {
+	(void) data, (void) option_name;
+
+	if( g_ascii_strcasecmp("text", value) == 0 ) {
+		output_format = OUTPUT_FORMAT_TEXT;
+	} else if( g_ascii_strcasecmp("binary", value) == 0 ) {
+		output_format = OUTPUT_FORMAT_BINARY;
 	} else {
-		g_assert_not_reached();
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown output format %s", value);
+		return false;
 	}
 
-	return set_stream_buffering(stdout, mode, err);
+	return true;
 }
 
 int main( int argc, char *argv[] ) {
@@ -302,9 +1079,51 @@ int main( int argc, char *argv[] ) {
 
 	char *qlfn = NULL;
 	gint qlfd = -1;
+	gchar *command = NULL, *fifo = NULL, *replay = NULL, *replay_speed = NULL;
+	gboolean use_stdin = false;
+	gchar **command_argv = NULL;
+	gchar *include_tags = NULL, *exclude_tags = NULL, *drop_first_tags = NULL;
+	gchar **payload_prefixes = NULL, **payload_regexes = NULL;
+	gchar *reader_cpus = NULL, *sender_cpus = NULL, *child_cpus = NULL;
 	VarnishlogBufferOptions options = {
 		.max_queue_size = 0,
+		.max_queue_bytes = 0,
+		.compress_after = 0,
+		.max_restart_delay_ms = DEFAULT_MAX_RESTART_DELAY_MS,
+		.instances = NULL,
+		.ninstances = 1,
+		.journal_dir = NULL,
+		.journal_segment_size = DEFAULT_JOURNAL_SEGMENT_SIZE,
+		.journal_sync_interval_ms = DEFAULT_JOURNAL_SYNC_INTERVAL_MS,
+		.queue_capacity = 0,
+		.slab_size = DEFAULT_SLAB_SIZE,
+		.batch_bytes = DEFAULT_BATCH_BYTES,
+		.batch_lines = DEFAULT_BATCH_LINES,
+		.wake_threshold = 1,
+		.wake_latency_us = DEFAULT_WAKE_LATENCY_US,
+		.spin_us = 0,
+		.spill_dir = NULL,
+		.spill_segment_size = DEFAULT_SPILL_SEGMENT_SIZE,
+		.spill_high_water = 0,
+		.spill_max_bytes = DEFAULT_SPILL_MAX_BYTES,
 		.low_priority = false,
+		.no_splice = false,
+		.output_format = OUTPUT_FORMAT_TEXT,
+		.group = false,
+		.group_timeout_ms = DEFAULT_GROUP_TIMEOUT_MS,
+		.max_latency_ms = 0,
+		.drop_policy = OVERFLOW_DROP_NEWEST,
+		.overflow = NULL,
+		.sample = false,
+		.sample_floor_percent = DEFAULT_SAMPLE_FLOOR_PERCENT,
+		.raw_percent = 100,
+		.aggregate_s = 0,
+		.aggregate_url_depth = DEFAULT_AGGREGATE_URL_DEPTH,
+		.filter = NULL,
+		.listen_path = NULL,
+		.client_max_lag = 0,
+		.shm_ring_path = NULL,
+		.shm_ring_size = DEFAULT_SHM_RING_SIZE,
 		.queue_length_fd = -1
 	};
 
@@ -315,12 +1134,58 @@ int main( int argc, char *argv[] ) {
 			.flags = 0,
 			.arg = G_OPTION_ARG_CALLBACK,
 			.arg_data = set_buffer_mode,
-			.description = "Set the output buffering mode",
+			.description = "Set when output is flushed: every line, whenever caught up, or when a batch fills",
 			.arg_description = "(unbuffered|line|block)"
 		},
-		{ "queue-length-file", 'q', 0, G_OPTION_ARG_FILENAME, &qlfn, "Write queue length as binary data to file", "file" },
+		{ "output-format", 0, 0, G_OPTION_ARG_CALLBACK, set_output_format, "Write lines as text, or as framed records with timestamps and tag IDs", "(text|binary)" },
+		{ "queue-length-file", 'q', 0, G_OPTION_ARG_FILENAME, &qlfn, "Write queue length and statistics as binary data to file", "file" },
+		{ "command", 0, 0, G_OPTION_ARG_STRING, &command, "Read the output of CMD instead of varnishlog -Ou", "CMD" },
+		{ "stdin", 0, 0, G_OPTION_ARG_NONE, &use_stdin, "Read log lines from standard input", NULL },
+		{ "fifo", 0, 0, G_OPTION_ARG_FILENAME, &fifo, "Read log lines from a named pipe, across writers", "PATH" },
+		{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay, "Replay a captured log and exit", "FILE" },
+		{ "replay-speed", 0, 0, G_OPTION_ARG_STRING, &replay_speed, "Replay as fast as possible or at the pace the log was recorded", "(max|recorded)" },
+		{ "instance", 'n', 0, G_OPTION_ARG_STRING_ARRAY, &options.instances, "Read the varnishd instance NAME, passing -n NAME to varnishlog, and prefix its lines with NAME; may be repeated", "NAME" },
+		{ "max-restart-delay", 0, 0, G_OPTION_ARG_INT, &options.max_restart_delay_ms, "Restart varnishlog when it exits, backing off to at most MSEC between attempts; 0 exits instead", "MSEC" },
 		{ "low-priority", 'l', 0, G_OPTION_ARG_NONE, &options.low_priority, "Do not try to change to real-time priority", NULL },
-		{ "max-queue-size", 'm', 0, G_OPTION_ARG_INT, &options.max_queue_size, "Discard entries if queue grows beyond N", "N" },
+		{ "group", 0, 0, G_OPTION_ARG_NONE, &options.group, "Queue each transaction as one entry once it is complete", NULL },
+		{ "group-timeout", 0, 0, G_OPTION_ARG_INT, &options.group_timeout_ms, "With --group, queue transactions still incomplete after MSEC", "MSEC" },
+		{ "include-tags", 0, 0, G_OPTION_ARG_STRING, &include_tags, "Only queue lines with one of these tags", "TAG,..." },
+		{ "exclude-tags", 0, 0, G_OPTION_ARG_STRING, &exclude_tags, "Don't queue lines with any of these tags", "TAG,..." },
+		{ "payload-prefix", 0, 0, G_OPTION_ARG_STRING_ARRAY, &payload_prefixes, "Only queue TAG lines whose payload starts with PREFIX; may be repeated", "TAG:PREFIX" },
+		{ "payload-regex", 0, 0, G_OPTION_ARG_STRING_ARRAY, &payload_regexes, "Only queue TAG lines whose payload matches REGEX; may be repeated", "TAG:REGEX" },
+		{ "listen", 0, 0, G_OPTION_ARG_FILENAME, &options.listen_path, "Serve the queue to any number of clients on a Unix socket at PATH instead of stdout", "PATH" },
+		{ "client-max-lag", 0, 0, G_OPTION_ARG_INT, &options.client_max_lag, "With --listen, disconnect clients more than N entries behind (default: 3/4 of the queue)", "N" },
+		{ "shm-ring", 0, 0, G_OPTION_ARG_FILENAME, &options.shm_ring_path, "Write entries into a shared-memory ring at PATH for a vlb_client reader instead of stdout", "PATH" },
+		{ "shm-ring-size", 0, 0, G_OPTION_ARG_INT64, &options.shm_ring_size, "Size of the shared-memory ring (rounded up to a power of two)", "N" },
+		{ "no-splice", 0, 0, G_OPTION_ARG_NONE, &options.no_splice, "Always queue lines, even when stdout is a pipe that keeps up", NULL },
+		{ "max-queue-size", 'm', 0, G_OPTION_ARG_INT, &options.max_queue_size, "Discard entries if queue grows beyond N (default: the queue capacity)", "N" },
+		{ "drop-policy", 0, 0, G_OPTION_ARG_CALLBACK, set_drop_policy, "What to discard when the queue is full: each new line, the oldest entries, whole transactions, or low priority tags first", "(newest|oldest|transactions|tags)" },
+		{ "drop-first-tags", 0, 0, G_OPTION_ARG_STRING, &drop_first_tags, "With --drop-policy=tags, the tags to discard once the queue is half full (default: Debug, VCL_trace and other diagnostics)", "TAG,..." },
+		{ "sample", 0, 0, G_OPTION_ARG_NONE, &options.sample, "Keep only a sample of transactions while the queue is under pressure", NULL },
+		{ "sample-floor", 0, 0, G_OPTION_ARG_INT, &options.sample_floor_percent, "With --sample, always keep at least PERCENT of transactions", "PERCENT" },
+		{ "raw-percent", 0, 0, G_OPTION_ARG_INT, &options.raw_percent, "Pass on only PERCENT of transactions; with --aggregate, 0 passes on nothing but rollups", "PERCENT" },
+		{ "aggregate", 0, 0, G_OPTION_ARG_INT, &options.aggregate_s, "Also pass on a JSON rollup of request counts and response times every SEC seconds", "SEC" },
+		{ "aggregate-url-depth", 0, 0, G_OPTION_ARG_INT, &options.aggregate_url_depth, "Count URLs in rollups by their first N path segments", "N" },
+		{ "max-latency", 0, 0, G_OPTION_ARG_INT, &options.max_latency_ms, "Discard entries that have been queued for more than MSEC instead of writing them", "MSEC" },
+		{ "max-queue-bytes", 0, 0, G_OPTION_ARG_INT64, &options.max_queue_bytes, "Discard entries if queued lines take up more than N bytes, counting each block they were read in whole (see --slab-size)", "N" },
+		{ "compress-after", 0, 0, G_OPTION_ARG_INT64, &options.compress_after, "Compress queued entries in the background once they are more than N bytes behind the next one written", "N" },
+		{ "queue-capacity", 'c', 0, G_OPTION_ARG_INT, &options.queue_capacity, "Preallocate room for N queued entries (rounded up to a power of two), which also caps --max-queue-size (default: --max-queue-size, up to 1048576)", "N" },
+		{ "slab-size", 0, 0, G_OPTION_ARG_INT, &options.slab_size, "Read varnishlog output in blocks of N bytes", "N" },
+		{ "batch-bytes", 0, 0, G_OPTION_ARG_INT, &options.batch_bytes, "Write at most N bytes of output per syscall", "N" },
+		{ "batch-lines", 0, 0, G_OPTION_ARG_INT, &options.batch_lines, "Write at most N lines of output per syscall", "N" },
+		{ "wake-threshold", 0, 0, G_OPTION_ARG_INT, &options.wake_threshold, "Wake an idle sender once N lines are queued", "N" },
+		{ "wake-latency", 0, 0, G_OPTION_ARG_INT, &options.wake_latency_us, "With --wake-threshold, let lines wait at most USEC", "USEC" },
+		{ "spin", 0, 0, G_OPTION_ARG_INT, &options.spin_us, "Poll for USEC before the sender goes to sleep", "USEC" },
+		{ "spill-dir", 0, 0, G_OPTION_ARG_FILENAME, &options.spill_dir, "Overflow the queue into segment files in DIR instead of dropping entries", "DIR" },
+		{ "spill-max-bytes", 0, 0, G_OPTION_ARG_INT64, &options.spill_max_bytes, "Use at most N bytes of disk for overflow", "N" },
+		{ "spill-segment-size", 0, 0, G_OPTION_ARG_INT, &options.spill_segment_size, "Size of each overflow segment file", "N" },
+		{ "spill-high-water", 0, 0, G_OPTION_ARG_INT, &options.spill_high_water, "Start overflowing once N entries are queued (default: 3/4 of the queue)", "N" },
+		{ "journal-dir", 0, 0, G_OPTION_ARG_FILENAME, &options.journal_dir, "Keep a copy of queued entries in DIR until written, and write what is left there first on startup", "DIR" },
+		{ "journal-segment-size", 0, 0, G_OPTION_ARG_INT, &options.journal_segment_size, "Size of each journal segment file", "N" },
+		{ "journal-sync-interval", 0, 0, G_OPTION_ARG_INT, &options.journal_sync_interval_ms, "Sync the journal to disk every MSEC", "MSEC" },
+		{ "reader-cpus", 0, 0, G_OPTION_ARG_STRING, &reader_cpus, "Run the reading thread on these CPUs, and keep the queues on their NUMA node", "LIST" },
+		{ "sender-cpus", 0, 0, G_OPTION_ARG_STRING, &sender_cpus, "Run the writing thread on these CPUs", "LIST" },
+		{ "child-cpus", 0, 0, G_OPTION_ARG_STRING, &child_cpus, "Run varnishlog on these CPUs", "LIST" },
 		{ NULL, 0, 0, 0, NULL, NULL, NULL }
 	};
 
@@ -332,6 +1197,250 @@ int main( int argc, char *argv[] ) {
 		goto err_setup_option_error;
 	}
 
+	if( options.max_queue_size < 0 || options.queue_capacity < 0 || options.max_queue_bytes < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Queue sizes must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.slab_size < 4096 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Slab size must be at least 4096 bytes");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.batch_bytes <= 0 || options.batch_lines <= 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Batch limits must be positive");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.wake_threshold <= 0 || options.wake_latency_us <= 0 || options.spin_us < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Wakeup options out of range");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.spill_segment_size < 4096 || options.spill_segment_size % 4096 != 0 || options.spill_max_bytes < 0 || options.spill_high_water < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Spill options out of range");
+		crash = false;
+		goto err_setup_option_error;
+	}
+
+	if( options.journal_segment_size < 4096 || options.journal_segment_size % 4096 != 0 || options.journal_sync_interval_ms <= 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Journal options out of range");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.journal_dir != NULL && (options.spill_dir != NULL || options.listen_path != NULL) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--journal-dir can't be used with --spill-dir or --listen");
+		crash = false;
+		goto err_setup_option_error;
+	}
+
+	if( options.listen_path != NULL && options.spill_dir != NULL ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--listen can't be used with --spill-dir");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.shm_ring_path != NULL && options.listen_path != NULL ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Only one of --listen and --shm-ring may be given");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( output_format == OUTPUT_FORMAT_BINARY && (options.listen_path != NULL || options.shm_ring_path != NULL) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--output-format=binary is only for stdout");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.shm_ring_size < MIN_SHM_RING_SIZE || options.shm_ring_size > G_MAXINT64 / 4 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Shared-memory ring size out of range");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.client_max_lag < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Client lag must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	options.drop_policy = drop_policy;
+	// --drop-policy=oldest doubles the queue; see reader_and_writer_main.
+	guint slack = options.drop_policy == OVERFLOW_DROP_OLDEST ? 2 : 1;
+	if( (guint) options.queue_capacity > MAX_QUEUE_CAPACITY / slack ) {
+		g_set_error(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Queue capacity must be at most %u", MAX_QUEUE_CAPACITY / slack);
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.drop_policy != OVERFLOW_DROP_NEWEST && options.spill_dir != NULL ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--drop-policy can't be used with --spill-dir");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.drop_policy == OVERFLOW_DROP_OLDEST && options.listen_path != NULL ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--drop-policy=oldest can't be used with --listen; see --client-max-lag");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.drop_policy == OVERFLOW_DROP_TAGS && options.group ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--drop-policy=tags can't be used with --group");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.sample_floor_percent < 1 || options.sample_floor_percent > 100 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Sample floor must be between 1 and 100 percent");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.raw_percent < 0 || options.raw_percent > 100 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Raw percentage must be between 0 and 100");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.raw_percent == 0 && options.aggregate_s == 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--raw-percent=0 needs --aggregate");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.aggregate_s < 0 || options.aggregate_url_depth < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Aggregation options must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.max_latency_ms < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Maximum latency must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.max_latency_ms != 0 && options.listen_path != NULL ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--max-latency can't be used with --listen; see --client-max-lag");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.compress_after < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--compress-after must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.compress_after != 0 && (options.group || options.listen_path != NULL) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--compress-after can't be used with --group or --listen");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.max_restart_delay_ms < 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Maximum restart delay must not be negative");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.group_timeout_ms <= 0 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Group timeout must be positive");
+		crash = false;
+		goto err_setup_option_error;
+	}
+
+	if( (command != NULL) + use_stdin + (fifo != NULL) + (replay != NULL) > 1 ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Only one of --command, --stdin, --fifo and --replay may be given");
+		crash = false;
+		goto err_setup_option_error;
+	}
+
+	if( options.instances != NULL ) {
+		options.ninstances = g_strv_length(options.instances);
+		if( options.ninstances > MAX_INSTANCES ) {
+			g_set_error(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "At most %d instances may be given", MAX_INSTANCES);
+			crash = false;
+			goto err_setup_option_error;
+		}
+		for( guint i = 0; i < options.ninstances; i++ ) {
+			gsize len = strlen(options.instances[i]);
+			if( len == 0 || len >= STATS_INSTANCE_NAME_SIZE ) {
+				g_set_error(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Instance names must be 1 to %d bytes long", STATS_INSTANCE_NAME_SIZE - 1);
+				crash = false;
+				goto err_setup_option_error;
+			}
+		}
+	}
+	if( options.instances != NULL && (use_stdin || fifo != NULL || replay != NULL) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--instance runs varnishlog, so can't be used with --stdin, --fifo or --replay");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.instances != NULL && (options.spill_dir != NULL || options.journal_dir != NULL || options.listen_path != NULL || options.compress_after != 0) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--instance can't be used with --spill-dir, --journal-dir, --listen or --compress-after");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( options.instances != NULL && (options.sample || options.raw_percent != 100 || options.drop_policy == OVERFLOW_DROP_TRANSACTIONS || options.drop_policy == OVERFLOW_DROP_TAGS) ) {
+		g_set_error_literal(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--instance can't be used with --sample, --raw-percent, or --drop-policy=transactions or tags");
+		crash = false;
+		goto err_setup_option_error;
+	}
+	if( replay_speed != NULL && g_strcmp0(replay_speed, "max") != 0 && g_strcmp0(replay_speed, "recorded") != 0 ) {
+		g_set_error(&err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown replay speed %s", replay_speed);
+		crash = false;
+		goto err_setup_option_error;
+	}
+
+	if( include_tags != NULL || exclude_tags != NULL || payload_prefixes != NULL || payload_regexes != NULL ) {
+		options.filter = filter_new(include_tags, exclude_tags, payload_prefixes, payload_regexes, &err);
+		if( options.filter == NULL ) {
+			crash = false;
+			goto err_setup_option_error;
+		}
+	}
+
+	// Grouped transactions are already queued or dropped whole.
+	if( (options.drop_policy == OVERFLOW_DROP_TRANSACTIONS && !options.group) || options.drop_policy == OVERFLOW_DROP_TAGS ) {
+		options.overflow = overflow_new(options.drop_policy, drop_first_tags, &err);
+		if( options.overflow == NULL ) {
+			crash = false;
+			goto err_setup_option_error;
+		}
+	}
+
+	if(
+		!parse_cpus(reader_cpus, &options.reader_cpus, &err) ||
+		!parse_cpus(sender_cpus, &options.sender_cpus, &err) ||
+		!parse_cpus(child_cpus, &options.child_cpus, &err)
+	) {
+		crash = false;
+		goto err_setup_option_error;
+	}
+	// The sender and children would otherwise inherit the reader's CPUs.
+	if( options.reader_cpus != NULL ) {
+		if( options.sender_cpus == NULL && (options.sender_cpus = cpu_set_current(&err)) == NULL ) goto err_setup_option_error;
+		if( options.child_cpus == NULL && (options.child_cpus = cpu_set_current(&err)) == NULL ) goto err_setup_option_error;
+	}
+
+	options.input.lowprio = options.low_priority;
+	options.input.cpus = options.child_cpus;
+	options.input.max_restart_delay_us = (gint64) options.max_restart_delay_ms * 1000;
+	if( use_stdin ) {
+		options.input.source = VARNISHLOG_SOURCE_STDIN;
+	} else if( fifo != NULL ) {
+		options.input.source = VARNISHLOG_SOURCE_FIFO;
+		options.input.path = fifo;
+	} else if( replay != NULL ) {
+		options.input.source = VARNISHLOG_SOURCE_FILE;
+		options.input.path = replay;
+		options.input.realtime = g_strcmp0(replay_speed, "recorded") == 0;
+	} else {
+		options.input.source = VARNISHLOG_SOURCE_COMMAND;
+		if( command != NULL ) {
+			if( !g_shell_parse_argv(command, NULL, &command_argv, &err) ) {
+				crash = false;
+				goto err_setup_option_error;
+			}
+			options.input.argv = command_argv;
+		}
+	}
+
+	if( buffer_mode < 0 ) {
+		// Match stdio's defaults: line buffered on a terminal, block otherwise.
+		options.flush_policy = isatty(STDOUT_FILENO) ? OUTPUT_FLUSH_DRAINED : OUTPUT_FLUSH_FULL;
+	} else {
+		options.flush_policy = buffer_mode;
+	}
+	options.output_format = output_format;
+	if( options.queue_capacity == 0 ) {
+		options.queue_capacity = options.max_queue_size != 0 ? MIN(options.max_queue_size, DEFAULT_QUEUE_CAPACITY) : DEFAULT_QUEUE_CAPACITY;
+	}
+
 	if( qlfn != NULL ) {
 		qlfd = open(qlfn, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 		if( qlfd == -1 ) {
@@ -339,7 +1448,7 @@ int main( int argc, char *argv[] ) {
 			goto err_setup_open_dev_zero;
 		}
 
-		if( truncate(qlfn, sizeof(gint)) == -1 ) {
+		if( truncate(qlfn, sizeof(Stats)) == -1 ) {
 			g_set_error_errno(&err);
 			goto err_setup_truncate_qlfn;
 		}
@@ -373,6 +1482,29 @@ int main( int argc, char *argv[] ) {
 
 		g_free(qlfn);
 	}
+	g_strfreev(options.instances);
+	g_free(options.spill_dir);
+	g_free(options.journal_dir);
+	g_free(options.listen_path);
+	g_free(options.shm_ring_path);
+	g_strfreev(command_argv);
+	g_free(command);
+	g_free(fifo);
+	g_free(replay);
+	g_free(replay_speed);
+	if( options.filter != NULL ) filter_free(options.filter);
+	if( options.overflow != NULL ) overflow_free(options.overflow);
+	g_free(drop_first_tags);
+	g_free(include_tags);
+	g_free(exclude_tags);
+	g_strfreev(payload_prefixes);
+	g_strfreev(payload_regexes);
+	g_free(reader_cpus);
+	g_free(sender_cpus);
+	g_free(child_cpus);
+	if( options.reader_cpus != NULL ) cpu_set_free(options.reader_cpus);
+	if( options.sender_cpus != NULL ) cpu_set_free(options.sender_cpus);
+	if( options.child_cpus != NULL ) cpu_set_free(options.child_cpus);
 
 	g_option_context_free(option_context);
 
@@ -392,6 +1524,29 @@ err_teardown_unlink_qlfn:
 err_setup_open_dev_zero:
 	if( qlfn != NULL ) g_free(qlfn);
 err_setup_option_error:
+	g_strfreev(options.instances);
+	g_free(options.spill_dir);
+	g_free(options.journal_dir);
+	g_free(options.listen_path);
+	g_free(options.shm_ring_path);
+	g_strfreev(command_argv);
+	g_free(command);
+	g_free(fifo);
+	g_free(replay);
+	g_free(replay_speed);
+	if( options.filter != NULL ) filter_free(options.filter);
+	if( options.overflow != NULL ) overflow_free(options.overflow);
+	g_free(drop_first_tags);
+	g_free(include_tags);
+	g_free(exclude_tags);
+	g_strfreev(payload_prefixes);
+	g_strfreev(payload_regexes);
+	g_free(reader_cpus);
+	g_free(sender_cpus);
+	g_free(child_cpus);
+	if( options.reader_cpus != NULL ) cpu_set_free(options.reader_cpus);
+	if( options.sender_cpus != NULL ) cpu_set_free(options.sender_cpus);
+	if( options.child_cpus != NULL ) cpu_set_free(options.child_cpus);
 	g_option_context_free(option_context);
 
 	if( crash ) {
@@ -0,0 +1,337 @@
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "shm_ring.h"
+#include "vlb_binary.h"
+#include "vsl.h"
+#include "output.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct Output {
+	int fd;
+	// Records go here instead of fd if set.
+	ShmRing *ring;
+	// With a ring, where each record's iovecs start, and room to join those
+	// of a record split by prefixes.
+	guint *record_iov;
+	gchar *joined;
+	gsize joined_size;
+	guint64 oversize, oversize_bytes;
+	OutputFlushPolicy policy;
+	gsize max_bytes, bytes;
+	guint max_records, nrecords;
+	struct iovec *iov;
+	guint niov, iov_capacity;
+	guint64 writes;
+
+	OutputFormat format;
+	// In binary mode, iov alternates between a record header from here and
+	// its payload, so headers[i] goes with iov[2 * i].
+	VlbBinaryRecord *headers;
+	// Realtime minus monotonic, taken at the start of each batch.
+	gint64 clock_offset;
+
+	// NULL unless output_set_instances was called. Each prefix is the name
+	// followed by a space.
+	gchar **names, **prefixes;
+	guint ninstances;
+};
+
+Output *output_new( int fd, OutputFlushPolicy policy, gsize max_bytes, guint max_records ) {
+	g_assert(max_records > 0);
+
+	Output *out = g_slice_new0(Output);
+	out->fd = fd;
+	out->policy = policy;
+	out->max_bytes = max_bytes;
+	out->max_records = max_records;
+	out->iov = g_new(struct iovec, max_records);
+	out->iov_capacity = max_records;
+	out->format = OUTPUT_FORMAT_TEXT;
+	return out;
+}
+
+Output *output_new_ring( ShmRing *ring, OutputFlushPolicy policy, gsize max_bytes, guint max_records ) {
+	Output *out = output_new(-1, policy, max_bytes, max_records);
+	out->ring = ring;
+	out->record_iov = g_new(guint, max_records);
+	return out;
+}
+
+void output_free( Output *out ) {
+	g_strfreev(out->names);
+	g_strfreev(out->prefixes);
+	g_free(out->iov);
+	g_free(out->headers);
+	g_free(out->record_iov);
+	g_free(out->joined);
+	g_slice_free(Output, out);
+}
+
+OutputFlushPolicy output_policy( const Output *out ) {
+	return out->policy;
+}
+
+void output_set_instances( Output *out, gchar **names ) {
+	g_assert(out->format == OUTPUT_FORMAT_TEXT && out->names == NULL);
+
+	out->names = g_strdupv(names);
+	out->ninstances = g_strv_length(names);
+	out->prefixes = g_new0(gchar *, out->ninstances + 1);
+	for( guint i = 0; i < out->ninstances; i++ ) out->prefixes[i] = g_strconcat(names[i], " ", NULL);
+}
+
+static void reserve_iov( Output *out, guint n ) {
+	if( out->niov + n <= out->iov_capacity ) return;
+
+	do out->iov_capacity *= 2; while( out->niov + n > out->iov_capacity );
+	out->iov = g_renew(struct iovec, out->iov, out->iov_capacity);
+	if( out->format != OUTPUT_FORMAT_BINARY ) return;
+
+	out->headers = g_renew(VlbBinaryRecord, out->headers, out->iov_capacity / 2);
+	for( guint i = 0; i < out->niov; i += 2 ) out->iov[i].iov_base = &out->headers[i / 2];
+}
+
+static void add_iov( Output *out, const void *data, gsize len ) {
+	out->iov[out->niov].iov_base = (void *) data;
+	out->iov[out->niov].iov_len = len;
+	out->niov++;
+	out->bytes += len;
+}
+
+// A record can be a whole transaction, so each of its lines gets a prefix.
+static void add_prefixed( Output *out, const gchar *prefix, const gchar *data, gsize len ) {
+	gsize prefix_len = strlen(prefix);
+	const gchar *end = data + len;
+	while( data < end ) {
+		const gchar *nl = memchr(data, '\n', end - data);
+		const gchar *next = nl != NULL ? nl + 1 : end;
+
+		reserve_iov(out, 2);
+		add_iov(out, prefix, prefix_len);
+		add_iov(out, data, next - data);
+		data = next;
+	}
+}
+
+// Likewise each line gets a frame.
+static void add_binary( Output *out, guint instance, const gchar *data, gsize len, gint64 read_at ) {
+	if( out->nrecords == 0 ) out->clock_offset = g_get_real_time() - g_get_monotonic_time();
+
+	const gchar *end = data + len;
+	while( data < end ) {
+		const gchar *nl = memchr(data, '\n', end - data);
+		const gchar *next = nl != NULL ? nl + 1 : end;
+		if( nl == NULL ) nl = end;
+
+		reserve_iov(out, 2);
+		VlbBinaryRecord *header = &out->headers[out->niov / 2];
+		memset(header, 0, sizeof(*header));
+
+		VslLine line;
+		if( vsl_parse(data, nl - data, &line) && (header->tag = vsl_tag_id(line.tag, line.tag_len)) != VLB_BINARY_TAG_UNKNOWN ) {
+			header->marker = line.marker;
+			header->id = line.id;
+		} else {
+			line.payload = data;
+			line.payload_len = nl - data;
+		}
+		header->length = sizeof(*header) + line.payload_len;
+		header->instance = instance;
+		if( read_at != 0 ) {
+			header->monotonic_us = read_at;
+			header->realtime_us = read_at + out->clock_offset;
+		}
+
+		add_iov(out, header, sizeof(*header));
+		add_iov(out, line.payload, line.payload_len);
+		data = next;
+	}
+}
+
+bool output_add( Output *out, guint instance, const gchar *data, gsize len, gint64 read_at ) {
+	g_assert(out->nrecords < out->max_records);
+	g_assert(instance <= out->ninstances && (instance != 0) == (out->names != NULL));
+
+	if( out->record_iov != NULL ) out->record_iov[out->nrecords] = out->niov;
+	if( out->format == OUTPUT_FORMAT_BINARY ) {
+		add_binary(out, instance, data, len, read_at);
+	} else if( instance != 0 ) {
+		add_prefixed(out, out->prefixes[instance - 1], data, len);
+	} else {
+		add_iov(out, data, len);
+	}
+	out->nrecords++;
+
+	return
+		out->policy == OUTPUT_FLUSH_RECORD ||
+		out->nrecords == out->max_records ||
+		out->bytes >= out->max_bytes;
+}
+
+guint output_pending( const Output *out ) {
+	return out->nrecords;
+}
+
+gsize output_pending_bytes( const Output *out ) {
+	return out->bytes;
+}
+
+guint64 output_writes( const Output *out ) {
+	return out->writes;
+}
+
+guint64 output_oversize( const Output *out, guint64 *bytes ) {
+	*bytes = out->oversize_bytes;
+	return out->oversize;
+}
+
+static bool wait_writable( int fd, GError **err ) {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	if( poll(&pfd, 1, -1) == -1 && errno != EINTR ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	return true;
+}
+
+// Joins the iovecs of a prefixed record, so that it goes into the ring as one.
+static const gchar *join_iov( Output *out, const struct iovec *iov, guint iovcnt, gsize *len ) {
+	*len = 0;
+	for( guint i = 0; i < iovcnt; i++ ) *len += iov[i].iov_len;
+	if( *len > out->joined_size ) {
+		out->joined_size = *len;
+		out->joined = g_realloc(out->joined, out->joined_size);
+	}
+
+	gchar *p = out->joined;
+	for( guint i = 0; i < iovcnt; i++ ) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	return out->joined;
+}
+
+// Each record is copied into the ring whole, and the consumer is only told
+// about them once the whole batch is in. Lines can be longer than any ring,
+// so one that can never fit is discarded rather than stopping the output.
+static bool flush_ring( Output *out, GError **err ) {
+	for( guint i = 0; i < out->nrecords; i++ ) {
+		guint first = out->record_iov[i];
+		guint end = i + 1 < out->nrecords ? out->record_iov[i + 1] : out->niov;
+
+		const gchar *data = out->iov[first].iov_base;
+		gsize len = out->iov[first].iov_len;
+		if( end - first != 1 ) data = join_iov(out, &out->iov[first], end - first, &len);
+		if( !shm_ring_fits(out->ring, len) ) {
+			out->oversize++;
+			out->oversize_bytes += len;
+			continue;
+		}
+		if( !shm_ring_write(out->ring, data, len, err) ) return false;
+	}
+	shm_ring_publish(out->ring);
+	out->writes++;
+
+	out->nrecords = 0;
+	out->niov = 0;
+	out->bytes = 0;
+
+	return true;
+}
+
+static bool write_iov( Output *out, struct iovec *iov, guint iovcnt, GError **err ) {
+	while( iovcnt > 0 ) {
+		ssize_t nwritten = writev(out->fd, iov, MIN(iovcnt, IOV_MAX));
+		out->writes++;
+		if( nwritten == -1 ) {
+			if( errno == EINTR ) continue;
+			if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				if( !wait_writable(out->fd, err) ) return false;
+				continue;
+			}
+			g_set_error_errno(err);
+			return false;
+		}
+
+		// Skip whatever was completely written and trim a partially written
+		// record so the next writev starts where this one stopped.
+		gsize n = nwritten;
+		while( iovcnt > 0 && n >= iov->iov_len ) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if( n > 0 ) {
+			iov->iov_base = (gchar *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+bool output_flush( Output *out, GError **err ) {
+	if( out->ring != NULL ) return flush_ring(out, err);
+
+	if( !write_iov(out, out->iov, out->niov, err) ) return false;
+
+	out->nrecords = 0;
+	out->niov = 0;
+	out->bytes = 0;
+
+	return true;
+}
+
+// Names longer than a length byte can hold are rejected with the options.
+static void append_name( GByteArray *table, const gchar *name ) {
+	guint8 name_len = strlen(name);
+	g_byte_array_append(table, &name_len, 1);
+	g_byte_array_append(table, (const guint8 *) name, name_len);
+}
+
+bool output_use_binary( Output *out, GError **err ) {
+	g_assert(out->ring == NULL && out->niov == 0);
+
+	GByteArray *tables = g_byte_array_new();
+	for( guint id = 1; id <= vsl_tag_count(); id++ ) append_name(tables, vsl_tag_name(id));
+	guint tags_size = tables->len;
+	for( guint i = 0; i < out->ninstances; i++ ) append_name(tables, out->names[i]);
+
+	VlbBinaryHeader header = {
+		.magic = VLB_BINARY_MAGIC,
+		.version = VLB_BINARY_VERSION,
+		.header_size = sizeof(header),
+		.record_header_size = sizeof(VlbBinaryRecord),
+		.ntags = vsl_tag_count(),
+		.tags_size = tags_size,
+		.ninstances = out->ninstances,
+		.instances_size = tables->len - tags_size
+	};
+	struct iovec iov[] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = tables->data, .iov_len = tables->len }
+	};
+	bool ok = write_iov(out, iov, G_N_ELEMENTS(iov), err);
+	g_byte_array_free(tables, true);
+	if( !ok ) return false;
+
+	// Every record takes at least a header and a payload.
+	out->format = OUTPUT_FORMAT_BINARY;
+	out->iov_capacity = out->max_records * 2;
+	out->iov = g_renew(struct iovec, out->iov, out->iov_capacity);
+	out->headers = g_new(VlbBinaryRecord, out->max_records);
+	return true;
+}
@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "vsl.h"
+#include "overflow.h"
+
+// Low priority tags go once the queue is half full, and new transactions
+// once it is seven eighths full, leaving room for open ones to finish.
+#define PRIORITY_PRESSURE (OVERFLOW_PRESSURE_FULL / 2)
+#define TRANSACTION_PRESSURE (OVERFLOW_PRESSURE_FULL - OVERFLOW_PRESSURE_FULL / 8)
+// Tag IDs fit in a byte.
+#define MAX_TAG_IDS 256
+
+#define DEFAULT_LOW_TAGS "Debug,VCL_trace,VCL_Log,Hash,WorkThread,Backend_health,CLI,ExpBan,ExpKill,VSL,Witness,Notice"
+
+struct Overflow {
+	OverflowPolicy policy;
+	// Indexed by vsl_tag_id.
+	bool low[MAX_TAG_IDS];
+	// Transactions whose remaining lines are dropped, keyed like the grouper:
+	// the fd or vxid and the c/b marker.
+	GHashTable *doomed;
+};
+
+// Tag names from the command line are matched case insensitively, like the
+// filters.
+static bool set_low_tags( Overflow *o, const gchar *list, GError **err ) {
+	gchar **tags = g_strsplit(list, ",", -1);
+	bool ok = true;
+	for( gchar **tag = tags; *tag != NULL && ok; tag++ ) {
+		g_strstrip(*tag);
+		if( **tag == '\0' ) continue;
+
+		guint id;
+		for( id = 1; id <= vsl_tag_count(); id++ ) {
+			if( g_ascii_strcasecmp(vsl_tag_name(id), *tag) == 0 ) break;
+		}
+		if( id > vsl_tag_count() ) {
+			g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown tag %s", *tag);
+			ok = false;
+		} else {
+			o->low[id] = true;
+		}
+	}
+	g_strfreev(tags);
+	return ok;
+}
+
+Overflow *overflow_new( OverflowPolicy policy, const gchar *low_tags, GError **err ) {
+	g_assert(vsl_tag_count() < MAX_TAG_IDS);
+
+	Overflow *o = g_slice_new0(Overflow);
+	o->policy = policy;
+	o->doomed = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+
+	if( !set_low_tags(o, low_tags != NULL ? low_tags : DEFAULT_LOW_TAGS, err) ) {
+		overflow_free(o);
+		return NULL;
+	}
+
+	return o;
+}
+
+void overflow_free( Overflow *o ) {
+	g_hash_table_destroy(o->doomed);
+	g_slice_free(Overflow, o);
+}
+
+// Returns false if the line isn't part of a transaction.
+static bool parse_line( const gchar *p, gsize len, gint64 *key, guint *tag ) {
+	VslLine line;
+	if( !vsl_parse(p, len, &line) || (line.marker != 'c' && line.marker != 'b') ) return false;
+	*key = (gint64) (line.id << 8) | line.marker;
+	*tag = vsl_tag_id(line.tag, line.tag_len);
+	return true;
+}
+
+static void doom( Overflow *o, gint64 key ) {
+	gint64 *k = g_new(gint64, 1);
+	*k = key;
+	g_hash_table_replace(o->doomed, k, NULL);
+}
+
+static OverflowReason check_transaction( Overflow *o, const gchar *p, gsize len, guint pressure ) {
+	gint64 key;
+	guint tag;
+	if( !parse_line(p, len, &key, &tag) ) return OVERFLOW_KEEP;
+
+	// A new transaction replaces whatever was doomed under the same key, in
+	// case its end was never seen.
+	if( vsl_tag_begins(tag) ) {
+		if( pressure < TRANSACTION_PRESSURE ) {
+			g_hash_table_remove(o->doomed, &key);
+			return OVERFLOW_KEEP;
+		}
+		doom(o, key);
+		return OVERFLOW_TRANSACTION;
+	}
+
+	if( g_hash_table_size(o->doomed) == 0 || !g_hash_table_contains(o->doomed, &key) ) return OVERFLOW_KEEP;
+	if( vsl_tag_ends(tag) ) g_hash_table_remove(o->doomed, &key);
+	return OVERFLOW_TRANSACTION;
+}
+
+static OverflowReason check_priority( Overflow *o, const gchar *p, gsize len ) {
+	VslLine line;
+	if( !vsl_parse(p, len, &line) ) return OVERFLOW_KEEP;
+	return o->low[vsl_tag_id(line.tag, line.tag_len)] ? OVERFLOW_PRIORITY : OVERFLOW_KEEP;
+}
+
+OverflowReason overflow_check( Overflow *o, const gchar *line, gsize len, guint pressure ) {
+	switch( o->policy ) {
+		case OVERFLOW_DROP_TAGS:
+			if( pressure < PRIORITY_PRESSURE ) return OVERFLOW_KEEP;
+			return check_priority(o, line, len);
+		case OVERFLOW_DROP_TRANSACTIONS:
+			if( pressure < TRANSACTION_PRESSURE && g_hash_table_size(o->doomed) == 0 ) return OVERFLOW_KEEP;
+			return check_transaction(o, line, len, pressure);
+		default:
+			return OVERFLOW_KEEP;
+	}
+}
+
+void overflow_dropped( Overflow *o, const gchar *line, gsize len ) {
+	if( o->policy != OVERFLOW_DROP_TRANSACTIONS ) return;
+
+	gint64 key;
+	guint tag;
+	if( !parse_line(line, len, &key, &tag) ) return;
+	if( vsl_tag_ends(tag) ) {
+		g_hash_table_remove(o->doomed, &key);
+	} else {
+		doom(o, key);
+	}
+}
@@ -1,10 +1,18 @@
+#ifdef __linux__
+// For sched_setaffinity and the CPU_* macros.
+#define _GNU_SOURCE
+#endif
 #include <stdbool.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <sched.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include <glib.h>
 
@@ -41,3 +49,104 @@ bool set_thread_priority( pthread_t thread, int sched, int prio, GError **err )
 bool high_priority_thread( int prio, GError **err ) {
 	return set_thread_priority(pthread_self(), SCHED_FIFO, prio, err);
 }
+
+#ifdef __linux__
+struct CpuSet {
+	cpu_set_t cpus;
+};
+
+CpuSet *cpu_set_parse( const gchar *list, GError **err ) {
+	CpuSet *set = g_new0(CpuSet, 1);
+	CPU_ZERO(&set->cpus);
+
+	const gchar *p = list;
+	do {
+		gchar *end;
+		if( !g_ascii_isdigit(*p) ) goto err_bad_value;
+		guint64 first = g_ascii_strtoull(p, &end, 10), last = first;
+		if( *end == '-' ) {
+			p = end + 1;
+			if( !g_ascii_isdigit(*p) ) goto err_bad_value;
+			last = g_ascii_strtoull(p, &end, 10);
+		}
+		if( first > last || last >= CPU_SETSIZE ) goto err_bad_value;
+		for( guint64 cpu = first; cpu <= last; cpu++ )
+			CPU_SET(cpu, &set->cpus);
+		p = end;
+	} while( *p++ == ',' );
+	if( *(p - 1) != '\0' ) goto err_bad_value;
+
+	return set;
+
+err_bad_value:
+	g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Invalid CPU list '%s', expected e.g. 0-3,8 with CPUs below %d", list, CPU_SETSIZE);
+	g_free(set);
+	return NULL;
+}
+
+CpuSet *cpu_set_current( GError **err ) {
+	CpuSet *set = g_new0(CpuSet, 1);
+	if( sched_getaffinity(0, sizeof(set->cpus), &set->cpus) == -1 ) {
+		g_set_error_errno(err);
+		g_free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void cpu_set_mask( const CpuSet *set, guint64 *mask, guint n ) {
+	memset(mask, 0, n * sizeof(*mask));
+	for( guint cpu = 0; cpu < n * 64 && cpu < CPU_SETSIZE; cpu++ ) {
+		if( CPU_ISSET(cpu, &set->cpus) ) mask[cpu / 64] |= G_GUINT64_CONSTANT(1) << (cpu % 64);
+	}
+}
+
+bool pin_thread( const CpuSet *set, GError **err ) {
+	if( sched_setaffinity(0, sizeof(set->cpus), &set->cpus) == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	return true;
+}
+
+bool current_numa_node( guint *node ) {
+	unsigned cpu, n;
+	if( syscall(SYS_getcpu, &cpu, &n, NULL) == -1 ) return false;
+	*node = n;
+	return true;
+}
+#else
+struct CpuSet {
+	int unused;
+};
+
+CpuSet *cpu_set_parse( const gchar *list, GError **err ) {
+	(void) list;
+	g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "CPU lists are only supported on linux");
+	return NULL;
+}
+
+CpuSet *cpu_set_current( GError **err ) {
+	g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "CPU lists are only supported on linux");
+	return NULL;
+}
+
+void cpu_set_mask( const CpuSet *set, guint64 *mask, guint n ) {
+	(void) set;
+	memset(mask, 0, n * sizeof(*mask));
+}
+
+bool pin_thread( const CpuSet *set, GError **err ) {
+	(void) set, (void) err;
+	return true;
+}
+
+bool current_numa_node( guint *node ) {
+	(void) node;
+	return false;
+}
+#endif
+
+void cpu_set_free( CpuSet *set ) {
+	g_free(set);
+}
@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "slab.h"
+#include "queue.h"
+
+// Indices run freely and are masked on access, so head - tail is always the
+// number of queued records even across wrap-around.
+struct Queue {
+	// Read-only after construction.
+	QueueRecord *records;
+	guint mask, limit;
+
+	// Written by the producer only.
+	cache_aligned struct {
+		volatile guint head;
+		guint cached_tail;
+	} producer;
+
+	// Written by the consumer only.
+	cache_aligned struct {
+		volatile guint tail;
+		guint cached_head;
+	} consumer;
+};
+
+static guint load_acquire( volatile guint *p ) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release( volatile guint *p, guint v ) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static guint round_up_pow2( guint n ) {
+	guint ret = 1;
+	while( ret < n ) ret <<= 1;
+	return ret;
+}
+
+Queue *queue_new( guint capacity, guint limit, GError **err ) {
+	g_assert(capacity > 0 && capacity <= G_MAXINT / 2 + 1);
+	capacity = round_up_pow2(capacity);
+	if( limit == 0 || limit > capacity ) limit = capacity;
+
+	Queue *q;
+	if( (errno = posix_memalign((void **) &q, CACHE_LINE_SIZE, sizeof(Queue))) != 0 ) {
+		g_set_error_errno(err);
+		return NULL;
+	}
+	memset(q, 0, sizeof(*q));
+
+	if( (errno = posix_memalign((void **) &q->records, CACHE_LINE_SIZE, capacity * sizeof(QueueRecord))) != 0 ) {
+		g_set_error_errno(err);
+		free(q);
+		return NULL;
+	}
+
+	q->mask = capacity - 1;
+	q->limit = limit;
+
+	return q;
+}
+
+void queue_free( Queue *q ) {
+	free(q->records);
+	free(q);
+}
+
+guint queue_capacity( const Queue *q ) {
+	return q->mask + 1;
+}
+
+guint queue_length( const Queue *q ) {
+	guint tail = __atomic_load_n(&q->consumer.tail, __ATOMIC_RELAXED);
+	return __atomic_load_n(&q->producer.head, __ATOMIC_RELAXED) - tail;
+}
+
+bool queue_push( Queue *q, const QueueRecord *rec ) {
+	guint head = q->producer.head;
+
+	// Only look at the consumer's cache line when our cached view says full.
+	if( head - q->producer.cached_tail >= q->limit ) {
+		q->producer.cached_tail = load_acquire(&q->consumer.tail);
+		if( head - q->producer.cached_tail >= q->limit ) return false;
+	}
+
+	q->records[head & q->mask] = *rec;
+	store_release(&q->producer.head, head + 1);
+
+	return true;
+}
+
+// Always goes to the producer's cache line: records the sender is still
+// holding in a batch would otherwise hide newer ones behind a stale head.
+guint queue_peek( Queue *q ) {
+	q->consumer.cached_head = load_acquire(&q->producer.head);
+	return q->consumer.cached_head - q->consumer.tail;
+}
+
+QueueRecord *queue_at( Queue *q, guint i ) {
+	g_assert(i < q->consumer.cached_head - q->consumer.tail);
+	return &q->records[(q->consumer.tail + i) & q->mask];
+}
+
+void queue_release( Queue *q, guint n ) {
+	g_assert(n <= q->consumer.cached_head - q->consumer.tail);
+	store_release(&q->consumer.tail, q->consumer.tail + n);
+}
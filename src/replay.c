@@ -0,0 +1,117 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "replay.h"
+
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+
+// Lines look like "%5d %-12s %c %s": an fd or vxid, the tag, the c/b/-
+// marker and the payload. Returns the payload if the tag matches.
+static const char *match_tag( const char *line, const char *tag ) {
+	const char *p = line + strspn(line, " ");
+	p += strcspn(p, " ");
+	p += strspn(p, " ");
+
+	size_t tag_len = strlen(tag);
+	if( strncmp(p, tag, tag_len) != 0 || p[tag_len] != ' ' ) return NULL;
+	p += tag_len;
+	p += strspn(p, " ");
+
+	p += strcspn(p, " ");
+	return p + strspn(p, " ");
+}
+
+// The time a request started, from varnish 3's ReqEnd or varnish 4's
+// Timestamp records. Returns a negative value for any other line.
+static double line_timestamp( const char *line ) {
+	const char *payload;
+	if( (payload = match_tag(line, "ReqEnd")) != NULL ) {
+		// ReqEnd: xid start end ...
+		payload += strcspn(payload, " ");
+	} else if( (payload = match_tag(line, "Timestamp")) != NULL ) {
+		// Timestamp: Label: absolute since-start since-last
+		payload = strchr(payload, ':');
+		if( payload == NULL ) return -1;
+		payload++;
+	} else {
+		return -1;
+	}
+
+	char *end;
+	double ts = g_ascii_strtod(payload, &end);
+	return end == payload ? -1 : ts;
+}
+
+bool replay_file( const gchar *path, int fd, GError **err ) {
+	FILE *in = fopen(path, "r");
+	if( in == NULL ) {
+		g_set_error_errno(err);
+		goto err_fopen;
+	}
+
+	FILE *out = fdopen(fd, "w");
+	if( out == NULL ) {
+		g_set_error_errno(err);
+		goto err_fdopen;
+	}
+	setvbuf(out, NULL, _IOFBF, REPLAY_BUFFER_SIZE);
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	double first_ts = -1;
+	gint64 started = 0;
+
+	errno = 0;
+	while( (len = getline(&line, &cap, in)) != -1 ) {
+		double ts = line_timestamp(line);
+		if( ts >= 0 ) {
+			if( first_ts < 0 ) {
+				first_ts = ts;
+				started = g_get_monotonic_time();
+			}
+
+			// Lines aren't strictly ordered, so only ever wait for ones ahead of
+			// the clock.
+			gint64 due = started + (gint64) ((ts - first_ts) * G_USEC_PER_SEC);
+			gint64 now = g_get_monotonic_time();
+			if( due > now ) {
+				if( fflush(out) == EOF ) goto err_write;
+				g_usleep(due - now);
+			}
+		}
+
+		if( fwrite(line, 1, len, out) != (size_t) len ) goto err_write;
+	}
+	if( ferror(in) ) {
+		g_set_error_errno(err);
+		goto err_getline;
+	}
+
+	if( fclose(out) == EOF ) {
+		out = NULL;
+		goto err_write;
+	}
+	free(line);
+	fclose(in);
+
+	return true;
+
+err_write:
+	g_set_error_errno(err);
+err_getline:
+	if( out != NULL ) fclose(out);
+	free(line);
+err_fdopen:
+	fclose(in);
+err_fopen:
+	return false;
+}
@@ -0,0 +1,103 @@
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "vsl.h"
+#include "sampler.h"
+
+#define ADJUST_INTERVAL_US 100000
+// Back off while the queue is over half full, or over a quarter full and
+// still growing. Recover once it is under a quarter full and not growing.
+#define BACK_OFF_FILL 0.5
+#define RECOVER_FILL 0.25
+// Each step takes a quarter off the rate, and gives back an eighth of it, or
+// at least 1/64 so recovery from the floor doesn't take forever.
+#define BACK_OFF_SHIFT 2
+#define RECOVER_SHIFT 3
+#define MIN_RECOVER_STEP (SAMPLER_RATE_ONE / 64)
+
+struct Sampler {
+	guint rate, floor, ceiling;
+	gint64 adjusted_at;
+	gdouble last_fill;
+	guint64 transactions_dropped;
+	// Transactions being dropped, keyed like the grouper: the fd or vxid and
+	// the c/b marker.
+	GHashTable *dropped;
+};
+
+Sampler *sampler_new( guint floor, guint ceiling ) {
+	g_assert(floor <= ceiling && ceiling <= SAMPLER_RATE_ONE);
+
+	Sampler *s = g_slice_new0(Sampler);
+	s->rate = ceiling;
+	s->floor = floor;
+	s->ceiling = ceiling;
+	s->dropped = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	return s;
+}
+
+void sampler_free( Sampler *s ) {
+	g_hash_table_destroy(s->dropped);
+	g_slice_free(Sampler, s);
+}
+
+static guint32 hash_transaction( gint64 key, const gchar *payload, gsize len ) {
+	guint64 h = (guint64) key;
+	for( gsize i = 0; i < len; i++ ) h = (h ^ (guchar) payload[i]) * G_GUINT64_CONSTANT(0x100000001b3);
+	// The splitmix64 finalizer, so nearby keys land far apart.
+	h ^= h >> 30;
+	h *= G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+	h ^= h >> 27;
+	h *= G_GUINT64_CONSTANT(0x94d049bb133111eb);
+	h ^= h >> 31;
+	return h;
+}
+
+bool sampler_keep( Sampler *s, const gchar *p, gsize len ) {
+	if( s->rate == SAMPLER_RATE_ONE && g_hash_table_size(s->dropped) == 0 ) return true;
+
+	VslLine line;
+	if( !vsl_parse(p, len, &line) || (line.marker != 'c' && line.marker != 'b') ) return true;
+	gint64 key = (gint64) (line.id << 8) | line.marker;
+	guint tag = vsl_tag_id(line.tag, line.tag_len);
+
+	if( vsl_tag_begins(tag) ) {
+		bool keep = hash_transaction(key, line.payload, line.payload_len) % SAMPLER_RATE_ONE < s->rate;
+		if( keep ) {
+			g_hash_table_remove(s->dropped, &key);
+		} else {
+			gint64 *k = g_new(gint64, 1);
+			*k = key;
+			g_hash_table_replace(s->dropped, k, NULL);
+			s->transactions_dropped++;
+		}
+		return keep;
+	}
+
+	if( g_hash_table_size(s->dropped) == 0 || !g_hash_table_contains(s->dropped, &key) ) return true;
+	if( vsl_tag_ends(tag) ) g_hash_table_remove(s->dropped, &key);
+	return false;
+}
+
+void sampler_adjust( Sampler *s, gint64 now, gdouble fill ) {
+	if( now - s->adjusted_at < ADJUST_INTERVAL_US ) return;
+	bool growing = fill > s->last_fill;
+	s->adjusted_at = now;
+	s->last_fill = fill;
+
+	if( fill >= BACK_OFF_FILL || (fill >= RECOVER_FILL && growing) ) {
+		s->rate = MAX(s->floor, s->rate - (s->rate >> BACK_OFF_SHIFT));
+	} else if( fill < RECOVER_FILL && !growing ) {
+		s->rate = MIN(s->ceiling, s->rate + MAX(s->rate >> RECOVER_SHIFT, MIN_RECOVER_STEP));
+	}
+}
+
+guint sampler_rate( const Sampler *s ) {
+	return s->rate;
+}
+
+guint64 sampler_transactions_dropped( const Sampler *s ) {
+	return s->transactions_dropped;
+}
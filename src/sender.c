@@ -0,0 +1,301 @@
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "slab.h"
+#include "queue.h"
+#include "stats.h"
+#include "compressor.h"
+#include "journal.h"
+#include "spill.h"
+#include "shm_ring.h"
+#include "output.h"
+#include "wakeup.h"
+#include "server.h"
+#include "sender.h"
+#include "priority.h"
+
+// Each queue's share of a round is in proportion to its backlog, with at
+// least one record each, so the busiest instance is drained fastest without
+// holding up the others for long.
+#define ROUND_RECORDS 256
+
+void sender_release( SenderControl *control, SenderQueue *q, guint n, gint64 written_at ) {
+	Stats *stats = control->stats;
+	gint lines = 0;
+	guint64 bytes = 0, length = 0;
+	for( guint i = 0; i < n; i++ ) {
+		const QueueRecord *rec = queue_at(q->queue, i);
+		if( rec->slab == NULL ) continue;
+		bytes += QUEUE_RECORD_COST + slab_credit(rec->slab);
+		length += rec->length;
+		if( written_at != 0 ) stats_add_residency(stats, written_at - rec->queued_at);
+		slab_unref(rec->slab);
+		lines++;
+	}
+	queue_release(q->queue, n);
+	g_atomic_int_add(&stats->lines_queued, -lines);
+	__atomic_sub_fetch(&stats->bytes_queued, bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&q->stats->lines_queued, lines, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&q->stats->bytes_queued, bytes, __ATOMIC_RELAXED);
+	if( control->compressor != NULL ) compressor_consumed(control->compressor, length);
+	if( control->journal != NULL ) journal_ack(control->journal, lines);
+
+	if( written_at != 0 && written_at - control->published_at >= STATS_PUBLISH_INTERVAL_US ) {
+		stats_publish_residency(stats);
+		control->published_at = written_at;
+	}
+}
+
+// The records in the output batch are always the oldest ones of each queue,
+// or the next ones in the spill; they are only released once they've been
+// written.
+static bool flush_batch( SenderControl *control, GError **err ) {
+	Output *out = control->output;
+	Stats *stats = control->stats;
+
+	guint n = output_pending(out);
+	if( n == 0 ) return true;
+	gsize bytes = output_pending_bytes(out);
+	bool ok = output_flush(out, err);
+	__atomic_store_n(&stats->write_syscalls, output_writes(out), __ATOMIC_RELAXED);
+	if( !ok ) return false;
+
+	guint64 oversize_bytes, oversize = output_oversize(out, &oversize_bytes);
+	guint64 discarded = oversize - stats->lines_dropped_oversize;
+	guint64 discarded_bytes = oversize_bytes - stats->bytes_dropped_oversize;
+	__atomic_store_n(&stats->lines_dropped_oversize, oversize, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->bytes_dropped_oversize, oversize_bytes, __ATOMIC_RELAXED);
+
+	stats_add(&stats->lines_written, n - discarded);
+	stats_add(&stats->bytes_written, bytes - discarded_bytes);
+	__atomic_store_n(&stats->last_write_time, g_get_real_time(), __ATOMIC_RELAXED);
+
+	gint64 now = g_get_monotonic_time();
+	for( guint i = 0; i < control->nqueues; i++ ) {
+		SenderQueue *q = &control->queues[i];
+		if( q->batched == 0 ) continue;
+		stats_add(&q->stats->lines_written, q->batched);
+		stats_add(&q->stats->bytes_written, q->batched_bytes);
+		// Spilled records are counted against the queue, but aren't in it.
+		if( !control->in_spill ) sender_release(control, q, q->batched, now);
+		q->batched = 0;
+		q->batched_bytes = 0;
+	}
+	if( control->in_spill ) spill_release(control->spill);
+	return true;
+}
+
+// Records are queued in time order, so the expired ones are all at the head.
+static void expire_records( SenderControl *control, SenderQueue *q, gint64 now ) {
+	Queue *queue = q->queue;
+	Stats *stats = control->stats;
+
+	guint n = queue_peek(queue), expired = 0;
+	guint64 bytes = 0;
+	while( expired < n ) {
+		const QueueRecord *rec = queue_at(queue, expired);
+		if( rec->slab == NULL || now - rec->queued_at <= control->max_latency_us ) break;
+		bytes += rec->length;
+		expired++;
+	}
+	if( expired == 0 ) return;
+
+	sender_release(control, q, expired, 0);
+	stats_add(&stats->lines_expired, expired);
+	stats_add(&stats->bytes_expired, bytes);
+	stats_add(&q->stats->lines_shed, expired);
+	stats_add(&q->stats->bytes_shed, bytes);
+}
+
+// Only called with nothing of q batched, so everything peeked can be
+// discarded.
+static void shed_oldest( SenderControl *control, SenderQueue *q ) {
+	Queue *queue = q->queue;
+	Stats *stats = control->stats;
+
+	guint n = queue_peek(queue), shed = 0;
+	guint64 queued = stats_instance_bytes_held(stats, q->stats), cost = 0, bytes = 0;
+	// A slab's queued records follow one another, so its size comes off once
+	// all of them it has queued so far are shed.
+	Slab *slab = NULL;
+	gint run = 0;
+	while( shed < n ) {
+		bool over_records = control->shed_records != 0 && n - shed > control->shed_records;
+		bool over_bytes = control->shed_bytes != 0 && queued > cost + control->shed_bytes;
+		if( !over_records && !over_bytes ) break;
+
+		const QueueRecord *rec = queue_at(queue, shed);
+		if( rec->slab == NULL ) break;
+		if( rec->slab != slab ) {
+			slab = rec->slab;
+			run = 0;
+		}
+		cost += QUEUE_RECORD_COST;
+		if( ++run == g_atomic_int_get(&slab->queued) ) cost += slab->size;
+		bytes += rec->length;
+		shed++;
+	}
+	if( shed == 0 ) return;
+
+	sender_release(control, q, shed, 0);
+	stats_add(&stats->lines_dropped_oldest, shed);
+	stats_add(&stats->bytes_dropped_oldest, bytes);
+	stats_add(&q->stats->lines_shed, shed);
+	stats_add(&q->stats->bytes_shed, bytes);
+}
+
+// Adds at most limit more of q's records to the batch.
+static bool send_from_queue( SenderControl *control, SenderQueue *q, guint limit, GError **err ) {
+	Queue *queue = q->queue;
+	Output *out = control->output;
+
+	// Records already batched will be written regardless, so records are only
+	// shed or expired before a new batch starts.
+	if( q->batched == 0 ) {
+		if( control->shed_records != 0 || control->shed_bytes != 0 ) shed_oldest(control, q);
+		if( control->max_latency_us != 0 ) expire_records(control, q, g_get_monotonic_time());
+	}
+
+	guint n = MIN(queue_peek(queue) - q->batched, limit);
+	for( guint i = 0; i < n; i++ ) {
+		// Flushing releases what was batched, so the next record is always
+		// the first one not yet batched.
+		const QueueRecord *rec = queue_at(queue, q->batched);
+		if( rec->slab == NULL ) {
+			// Everything queued after this marker follows data spilled to disk.
+			if( !flush_batch(control, err) ) return false;
+			control->in_spill = true;
+			return true;
+		}
+
+		if( control->compressor != NULL && !compressor_warm(control->compressor, rec->slab, err) ) return false;
+		q->batched++;
+		q->batched_bytes += rec->length;
+		if( output_add(out, q->instance, rec->slab->data + rec->offset, rec->length, rec->queued_at) ) {
+			if( !flush_batch(control, err) ) return false;
+		}
+	}
+
+	return true;
+}
+
+static guint backlog( const SenderQueue *q ) {
+	return queue_peek(q->queue) - q->batched;
+}
+
+static bool send_round( SenderControl *control, GError **err ) {
+	if( control->nqueues == 1 ) return send_from_queue(control, &control->queues[0], G_MAXUINT, err);
+
+	guint64 total = 0;
+	for( guint i = 0; i < control->nqueues; i++ ) total += backlog(&control->queues[i]);
+	if( total == 0 ) return true;
+
+	for( guint i = 0; i < control->nqueues; i++ ) {
+		SenderQueue *q = &control->queues[i];
+		guint n = backlog(q);
+		if( n == 0 ) continue;
+		guint share = MAX(1, (guint64) n * ROUND_RECORDS / total);
+		if( !send_from_queue(control, q, share, err) ) return false;
+	}
+	return true;
+}
+
+// Only ever with a single queue.
+static bool send_from_spill( SenderControl *control, GError **err ) {
+	SenderQueue *q = &control->queues[0];
+	const gchar *data;
+	gsize len;
+	SpillStatus status;
+
+	while( (status = spill_next(control->spill, &data, &len)) == SPILL_RECORD ) {
+		q->batched++;
+		q->batched_bytes += len;
+		if( output_add(control->output, q->instance, data, len, 0) && !flush_batch(control, err) ) return false;
+	}
+
+	if( status == SPILL_END ) {
+		if( !flush_batch(control, err) ) return false;
+		control->in_spill = false;
+		// The marker that sent us to the spill is still at the head.
+		sender_release(control, q, 1, 0);
+	}
+
+	return true;
+}
+
+static bool sender_has_work( SenderControl *control ) {
+	if( control->in_spill ) return spill_readable(control->spill);
+	for( guint i = 0; i < control->nqueues; i++ ) {
+		if( backlog(&control->queues[i]) > 0 ) return true;
+	}
+	return false;
+}
+
+static bool sender_ready( SenderControl *control ) {
+	return sender_has_work(control) || g_atomic_int_get(&control->shutdown);
+}
+
+GError *sender_main( SenderControl *control ) {
+	GError *err = NULL;
+	if( control->cpus != NULL && !pin_thread(control->cpus, &err) ) return err;
+
+	if( control->server != NULL ) return server_main(control);
+
+	Output *out = control->output;
+
+	while( true ) {
+		bool idle = !sender_has_work(control);
+
+		if( control->in_spill ) {
+			if( !send_from_spill(control, &err) ) goto out_error;
+		} else {
+			if( !send_round(control, &err) ) goto out_error;
+		}
+
+		bool stopping = g_atomic_int_get(&control->shutdown);
+		if( output_pending(out) > 0 && (output_policy(out) != OUTPUT_FLUSH_FULL || stopping) ) {
+			if( !flush_batch(control, &err) ) goto out_error;
+		}
+
+		if( stopping ) {
+			if( !sender_has_work(control) ) {
+				break;
+			} else {
+				continue;
+			}
+		}
+
+		if( idle ) {
+			wakeup_wait(
+				&control->wakeup,
+				(WakeupReadyFunc) sender_ready, control,
+				control->spin_us, control->park_timeout_us
+			);
+		}
+	}
+
+	return NULL;
+
+out_error:
+	return err;
+}
+
+void stop_sender( SenderControl *control ) {
+	g_atomic_int_set(&control->shutdown, true);
+	wakeup_wake(&control->wakeup);
+	g_thread_join(control->thread);
+}
+
+void drain_sender( SenderControl *control ) {
+	control->journal = NULL;
+	for( guint i = 0; i < control->nqueues; i++ ) {
+		SenderQueue *q = &control->queues[i];
+		guint n;
+		while( (n = queue_peek(q->queue)) != 0 )
+			sender_release(control, q, n, 0);
+	}
+}
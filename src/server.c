@@ -0,0 +1,380 @@
+#ifdef __linux__
+// For accept4.
+#define _GNU_SOURCE
+#endif
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "slab.h"
+#include "queue.h"
+#include "stats.h"
+#include "spill.h"
+#include "shm_ring.h"
+#include "output.h"
+#include "wakeup.h"
+#include "server.h"
+#include "compressor.h"
+#include "journal.h"
+#include "sender.h"
+
+#define LISTEN_BACKLOG 16
+#define MAX_EVENTS 64
+// Once stopping, how long clients get to catch up before they're dropped.
+#define DRAIN_TIMEOUT_US (5 * G_USEC_PER_SEC)
+
+typedef struct Client {
+	int fd;
+	// Records from the oldest queued one which this client has written, and
+	// how much of the next one.
+	guint cursor;
+	gsize offset;
+	// Cleared when a write would block, set again by EPOLLOUT.
+	bool writable;
+	bool closed;
+	struct Client *next;
+} Client;
+
+struct Server {
+	gchar *path;
+	int listen_fd, epoll_fd;
+	guint max_lag;
+	gsize max_bytes;
+	guint max_records;
+	struct iovec *iov;
+
+	Client *clients;
+	guint64 writes;
+};
+
+static bool make_socket( Server *s, GError **err ) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if( strlen(s->path) >= sizeof(addr.sun_path) ) {
+		errno = ENAMETOOLONG;
+		g_set_error_errno(err);
+		return false;
+	}
+	strcpy(addr.sun_path, s->path);
+
+	// A socket left behind by an earlier run would make bind fail.
+	struct stat st;
+	if( lstat(s->path, &st) == 0 && S_ISSOCK(st.st_mode) ) unlink(s->path);
+
+	s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( s->listen_fd == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+
+	if(
+		bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+		listen(s->listen_fd, LISTEN_BACKLOG) == -1
+	) {
+		g_set_error_errno(err);
+		return false;
+	}
+
+	return true;
+}
+
+Server *server_new( const gchar *path, guint max_lag, gsize max_bytes, guint max_records, GError **err ) {
+	Server *s = g_slice_new0(Server);
+	s->path = g_strdup(path);
+	s->listen_fd = -1;
+	s->epoll_fd = -1;
+	s->max_lag = max_lag;
+	s->max_bytes = max_bytes;
+	s->max_records = max_records;
+	s->iov = g_new(struct iovec, max_records);
+
+#ifdef __linux__
+	if( !make_socket(s, err) ) goto err;
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if( s->epoll_fd == -1 ) {
+		g_set_error_errno(err);
+		goto err;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if( epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) == -1 ) {
+		g_set_error_errno(err);
+		goto err;
+	}
+
+	return s;
+#else
+	errno = ENOSYS;
+	g_set_error_errno(err);
+	goto err;
+#endif
+
+err:
+	server_free(s);
+	return NULL;
+}
+
+static void free_client( Client *c ) {
+	close(c->fd);
+	g_slice_free(Client, c);
+}
+
+void server_free( Server *s ) {
+	Client *next;
+	for( Client *c = s->clients; c != NULL; c = next ) {
+		next = c->next;
+		free_client(c);
+	}
+
+	if( s->epoll_fd != -1 ) close(s->epoll_fd);
+	if( s->listen_fd != -1 ) {
+		close(s->listen_fd);
+		unlink(s->path);
+	}
+	g_free(s->iov);
+	g_free(s->path);
+	g_slice_free(Server, s);
+}
+
+#ifdef __linux__
+// Events carry the Wakeup for its eventfd, NULL for the listening socket and
+// the Client for anything else.
+static bool add_fd( Server *s, int fd, guint32 events, gpointer ptr, GError **err ) {
+	struct epoll_event ev = { .events = events, .data.ptr = ptr };
+	if( epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	return true;
+}
+
+// New clients start from the oldest record still queued.
+static void accept_clients( Server *s, Stats *stats ) {
+	while( true ) {
+		int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		// Anything from EAGAIN to EMFILE leaves the rest in the backlog for
+		// next time.
+		if( fd == -1 ) return;
+
+		Client *c = g_slice_new0(Client);
+		c->fd = fd;
+		c->writable = true;
+		// Edge triggered, so EPOLLOUT only arrives after a write would block.
+		if( !add_fd(s, fd, EPOLLIN | EPOLLOUT | EPOLLET, c, NULL) ) {
+			free_client(c);
+			continue;
+		}
+
+		c->next = s->clients;
+		s->clients = c;
+		stats_add(&stats->clients_accepted, 1);
+		__atomic_store_n(&stats->clients_connected, stats->clients_connected + 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void client_event( Client *c, guint32 events ) {
+	if( events & (EPOLLERR | EPOLLHUP) ) c->closed = true;
+	if( events & EPOLLOUT ) c->writable = true;
+	if( events & EPOLLIN ) {
+		// Clients have nothing to say. End of file only means they've shut
+		// down their side, and they may still be reading; a client that has
+		// gone is seen by EPOLLHUP or a failed write.
+		gchar buf[256];
+		while( read(c->fd, buf, sizeof(buf)) > 0 );
+	}
+}
+
+// Writes as much as the client will take of the first n queued records.
+// Returns false if the client should be disconnected.
+static bool write_client( Server *s, Queue *queue, Client *c, guint n ) {
+	while( c->writable && c->cursor < n ) {
+		guint count = 0;
+		gsize bytes = 0;
+		for( guint i = c->cursor; i < n && count < s->max_records && bytes < s->max_bytes; i++ ) {
+			const QueueRecord *rec = queue_at(queue, i);
+			gsize skip = i == c->cursor ? c->offset : 0;
+			s->iov[count].iov_base = rec->slab->data + rec->offset + skip;
+			s->iov[count].iov_len = rec->length - skip;
+			bytes += rec->length - skip;
+			count++;
+		}
+
+		struct msghdr msg = { .msg_iov = s->iov, .msg_iovlen = count };
+		// MSG_NOSIGNAL, as a client going away mustn't raise SIGPIPE.
+		ssize_t nwritten = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		s->writes++;
+		if( nwritten == -1 ) {
+			if( errno == EINTR ) continue;
+			if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				c->writable = false;
+				break;
+			}
+			return false;
+		}
+
+		gsize left = nwritten;
+		while( left > 0 ) {
+			gsize rest = queue_at(queue, c->cursor)->length - c->offset;
+			if( left < rest ) {
+				c->offset += left;
+				break;
+			}
+			left -= rest;
+			c->cursor++;
+			c->offset = 0;
+		}
+	}
+	return true;
+}
+
+// Serves every client and drops those which have gone or fallen too far
+// behind. Returns how many records every remaining client has written.
+static guint serve_clients( Server *s, Queue *queue, Stats *stats, guint n ) {
+	guint done = n;
+	for( Client **p = &s->clients; *p != NULL; ) {
+		Client *c = *p;
+		bool keep = !c->closed && write_client(s, queue, c, n);
+		if( keep && s->max_lag != 0 && n - c->cursor > s->max_lag ) {
+			stats_add(&stats->clients_lagged, 1);
+			keep = false;
+		}
+
+		if( !keep ) {
+			*p = c->next;
+			free_client(c);
+			__atomic_store_n(&stats->clients_connected, stats->clients_connected - 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		done = MIN(done, c->cursor);
+		p = &c->next;
+	}
+	return done;
+}
+
+// Disconnects every client when they haven't all caught up by the time the
+// server has to stop, counting those short of the first n records as lagged.
+static void drop_clients( Server *s, Stats *stats, guint n ) {
+	Client *next;
+	for( Client *c = s->clients; c != NULL; c = next ) {
+		next = c->next;
+		if( c->cursor < n ) stats_add(&stats->clients_lagged, 1);
+		free_client(c);
+		__atomic_store_n(&stats->clients_connected, stats->clients_connected - 1, __ATOMIC_RELAXED);
+	}
+	s->clients = NULL;
+}
+
+typedef struct ReadyCheck {
+	Queue *queue;
+	guint seen;
+	volatile gint *shutdown;
+} ReadyCheck;
+
+static bool server_ready( ReadyCheck *check ) {
+	return queue_peek(check->queue) > check->seen || g_atomic_int_get(check->shutdown);
+}
+
+GError *server_main( SenderControl *control ) {
+	GError *err = NULL;
+	Server *s = control->server;
+	// Only ever a single queue.
+	SenderQueue *q = &control->queues[0];
+	Queue *queue = q->queue;
+	Stats *stats = control->stats;
+	Wakeup *wakeup = &control->wakeup;
+
+	if( !add_fd(s, wakeup_fd(wakeup), EPOLLIN | EPOLLET, wakeup, &err) ) return err;
+
+	// As in sender_main, come back on our own if the reader might not wake us.
+	int timeout_ms = control->park_timeout_us < 0 ? -1 : (int) ((control->park_timeout_us + 999) / 1000);
+	struct epoll_event events[MAX_EVENTS];
+	gint64 drain_deadline = 0;
+	while( true ) {
+		bool stopping = g_atomic_int_get(&control->shutdown);
+		guint n = queue_peek(queue);
+
+		guint done = serve_clients(s, queue, stats, n);
+		// Without any clients, records are kept for the first to connect.
+		if( s->clients != NULL && done > 0 ) {
+			gsize bytes = 0;
+			for( guint i = 0; i < done; i++ ) bytes += queue_at(queue, i)->length;
+			sender_release(control, q, done, g_get_monotonic_time());
+			for( Client *c = s->clients; c != NULL; c = c->next ) c->cursor -= done;
+			n -= done;
+
+			stats_add(&stats->lines_written, done);
+			stats_add(&stats->bytes_written, bytes);
+			stats_add(&q->stats->lines_written, done);
+			stats_add(&q->stats->bytes_written, bytes);
+			__atomic_store_n(&stats->last_write_time, g_get_real_time(), __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&stats->write_syscalls, s->writes, __ATOMIC_RELAXED);
+
+		int wait_ms = timeout_ms;
+		if( stopping ) {
+			gint64 now = g_get_monotonic_time();
+			if( drain_deadline == 0 ) drain_deadline = now + DRAIN_TIMEOUT_US;
+
+			// The reader has finished, so nothing new will be queued.
+			if( s->clients == NULL || n == 0 ) {
+				sender_release(control, q, queue_peek(queue), 0);
+				break;
+			}
+			// A client which stopped reading would otherwise hold up the exit
+			// forever.
+			if( now >= drain_deadline ) {
+				drop_clients(s, stats, n);
+				sender_release(control, q, queue_peek(queue), 0);
+				break;
+			}
+
+			int left_ms = (drain_deadline - now + 999) / 1000;
+			if( wait_ms < 0 || left_ms < wait_ms ) wait_ms = left_ms;
+		}
+
+		ReadyCheck check = { .queue = queue, .seen = n, .shutdown = &control->shutdown };
+		int nevents = 0;
+		if( stopping || wakeup_prepare(wakeup, (WakeupReadyFunc) server_ready, &check) ) {
+			nevents = epoll_wait(s->epoll_fd, events, MAX_EVENTS, wait_ms);
+		}
+		wakeup_finish(wakeup);
+
+		if( nevents == -1 ) {
+			if( errno == EINTR ) continue;
+			g_set_error_errno(&err);
+			return err;
+		}
+
+		for( int i = 0; i < nevents; i++ ) {
+			gpointer ptr = events[i].data.ptr;
+			if( ptr == NULL ) {
+				accept_clients(s, stats);
+			} else if( ptr != wakeup ) {
+				client_event(ptr, events[i].events);
+			}
+		}
+	}
+
+	return NULL;
+}
+#else
+GError *server_main( SenderControl *control ) {
+	(void) control;
+	g_assert_not_reached();
+}
+#endif
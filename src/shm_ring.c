@@ -0,0 +1,216 @@
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "errors.h"
+#include "vlb_ring.h"
+#include "shm_ring.h"
+
+#ifndef __linux__
+#define POLL_SLEEP_US 50
+#endif
+
+// A producer waiting for space wakes this often to check whether it's
+// stopping, and once it is, gives up when the consumer has taken nothing for
+// STOP_TIMEOUT_US.
+#define WAIT_INTERVAL_NS 100000000L
+#define STOP_TIMEOUT_US 1000000
+
+struct ShmRing {
+	gchar *path;
+	VlbRingHeader *header;
+	gchar *data;
+	gsize map_size;
+	guint64 mask;
+	// Written but not yet published.
+	guint64 head;
+	// The last tail seen, so the consumer's cache line is only read when the
+	// ring looks full.
+	guint64 cached_tail;
+	// See shm_ring_stop_on.
+	volatile gint *stop;
+};
+
+// The ring is shared between processes, so these aren't private futexes.
+static void futex_wait( volatile guint32 *word, guint32 value ) {
+#ifdef __linux__
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = WAIT_INTERVAL_NS };
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+	(void) word, (void) value;
+	usleep(POLL_SLEEP_US);
+#endif
+}
+
+static void futex_wake( volatile guint32 *word ) {
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+	(void) word;
+#endif
+}
+
+static guint64 round_up_pow2( guint64 n ) {
+	guint64 ret = 1;
+	while( ret < n ) ret <<= 1;
+	return ret;
+}
+
+ShmRing *shm_ring_new( const gchar *path, gsize size, GError **err ) {
+	size = round_up_pow2(size);
+	gsize map_size = VLB_RING_HEADER_SIZE + size;
+
+	// The client writes its cursor into the file, so it has to open it for
+	// writing too; read permission alone would be no use to anyone else.
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if( fd == -1 ) {
+		g_set_error_errno(err);
+		goto err_open;
+	}
+	if( ftruncate(fd, map_size) == -1 ) {
+		g_set_error_errno(err);
+		goto err_ftruncate;
+	}
+
+	gchar *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( map == MAP_FAILED ) {
+		g_set_error_errno(err);
+		goto err_mmap;
+	}
+	close(fd);
+
+	ShmRing *r = g_slice_new0(ShmRing);
+	r->path = g_strdup(path);
+	r->header = (VlbRingHeader *) map;
+	r->data = map + VLB_RING_HEADER_SIZE;
+	r->map_size = map_size;
+	r->mask = size - 1;
+
+	r->header->header_size = VLB_RING_HEADER_SIZE;
+	r->header->size = size;
+	r->header->version = VLB_RING_VERSION;
+	// Clients check the magic number last.
+	__atomic_store_n(&r->header->magic, VLB_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return r;
+
+err_mmap:
+err_ftruncate:
+	close(fd);
+	unlink(path);
+err_open:
+	return NULL;
+}
+
+void shm_ring_free( ShmRing *r ) {
+	shm_ring_publish(r);
+	__atomic_store_n(&r->header->closed, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->header->consumer_waiting, false, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->header->data_seq, 1, __ATOMIC_RELEASE);
+	futex_wake(&r->header->data_seq);
+
+	munmap(r->header, r->map_size);
+	unlink(r->path);
+	g_free(r->path);
+	g_slice_free(ShmRing, r);
+}
+
+static guint64 ring_size( const ShmRing *r ) {
+	return r->mask + 1;
+}
+
+void shm_ring_stop_on( ShmRing *r, volatile gint *stop ) {
+	r->stop = stop;
+}
+
+// Waits until the consumer has left at least need bytes free.
+static bool wait_for_space( ShmRing *r, guint64 need, GError **err ) {
+	VlbRingHeader *h = r->header;
+	gint64 stalled_since = 0;
+
+	while( ring_size(r) - (r->head - r->cached_tail) < need ) {
+		guint64 last_tail = r->cached_tail;
+		r->cached_tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+		if( ring_size(r) - (r->head - r->cached_tail) >= need ) break;
+
+		if( r->cached_tail != last_tail ) stalled_since = 0;
+		if( r->stop != NULL && g_atomic_int_get(r->stop) ) {
+			gint64 now = g_get_monotonic_time();
+			if( stalled_since == 0 ) {
+				stalled_since = now;
+			} else if( now - stalled_since >= STOP_TIMEOUT_US ) {
+				g_set_error(err, VARNISHLOG_BUFFER_QUARK, VARNISHLOG_BUFFER_ERROR_UNSPEC, "Stopped waiting for the --shm-ring reader, which has taken nothing for %d ms", STOP_TIMEOUT_US / 1000);
+				return false;
+			}
+		}
+
+		// The consumer can only make room out of what it can see.
+		shm_ring_publish(r);
+
+		// Paired with the fence in vlb_client_release, as in wakeup.c.
+		guint32 seq = __atomic_load_n(&h->space_seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->producer_waiting, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		r->cached_tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+		if( ring_size(r) - (r->head - r->cached_tail) < need ) futex_wait(&h->space_seq, seq);
+		__atomic_store_n(&h->producer_waiting, false, __ATOMIC_RELAXED);
+	}
+	return true;
+}
+
+// Leaves room for a wrap, so a record can always be fitted in eventually.
+bool shm_ring_fits( const ShmRing *r, gsize len ) {
+	return VLB_RING_RECORD_SIZE(len) <= ring_size(r) / 2 && len < VLB_RING_WRAP;
+}
+
+bool shm_ring_write( ShmRing *r, const gchar *data, gsize len, GError **err ) {
+	guint64 need = VLB_RING_RECORD_SIZE(len);
+	if( !shm_ring_fits(r, len) ) {
+		errno = EMSGSIZE;
+		g_set_error_errno(err);
+		return false;
+	}
+
+	guint64 pos = r->head & r->mask;
+	guint64 contiguous = ring_size(r) - pos;
+	if( need > contiguous ) {
+		if( !wait_for_space(r, contiguous + need, err) ) return false;
+		*(guint32 *) (r->data + pos) = VLB_RING_WRAP;
+		r->head += contiguous;
+		pos = 0;
+	} else {
+		if( !wait_for_space(r, need, err) ) return false;
+	}
+
+	*(guint32 *) (r->data + pos) = len;
+	memcpy(r->data + pos + sizeof(guint32), data, len);
+	r->head += need;
+	return true;
+}
+
+void shm_ring_publish( ShmRing *r ) {
+	VlbRingHeader *h = r->header;
+	if( r->head == h->head ) return;
+
+	__atomic_store_n(&h->head, r->head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if( __atomic_load_n(&h->consumer_waiting, __ATOMIC_RELAXED) ) {
+		__atomic_store_n(&h->consumer_waiting, false, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->data_seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&h->data_seq);
+	}
+}
@@ -0,0 +1,139 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "slab.h"
+
+#define SLAB_BIAS (1 << 30)
+
+// Slabs are returned by whichever thread drops the last reference, so the free
+// list is locked. That only happens once per slab, not once per line.
+struct SlabPool {
+	gsize slab_size;
+	guint max_free, nfree, outstanding;
+	Slab *free;
+	GMutex lock;
+};
+
+SlabPool *slab_pool_new( gsize slab_size, guint max_free ) {
+	SlabPool *pool = g_slice_new0(SlabPool);
+	pool->slab_size = slab_size;
+	pool->max_free = max_free;
+	g_mutex_init(&pool->lock);
+	return pool;
+}
+
+static void slab_free( Slab *slab ) {
+	free(slab->data);
+	free(slab->compressed);
+	g_slice_free(Slab, slab);
+}
+
+void slab_pool_free( SlabPool *pool ) {
+	g_assert_cmpuint(pool->outstanding, ==, 0);
+
+	Slab *next;
+	for( Slab *slab = pool->free; slab != NULL; slab = next ) {
+		next = slab->next;
+		slab_free(slab);
+	}
+
+	g_mutex_clear(&pool->lock);
+	g_slice_free(SlabPool, pool);
+}
+
+gsize slab_pool_slab_size( const SlabPool *pool ) {
+	return pool->slab_size;
+}
+
+Slab *slab_pool_get( SlabPool *pool, gsize min_size, GError **err ) {
+	Slab *slab = NULL;
+
+	g_mutex_lock(&pool->lock);
+	if( min_size <= pool->slab_size && pool->free != NULL ) {
+		slab = pool->free;
+		pool->free = slab->next;
+		pool->nfree--;
+	}
+	pool->outstanding++;
+	g_mutex_unlock(&pool->lock);
+
+	if( slab == NULL ) {
+		gsize size = MAX(min_size, pool->slab_size);
+		gchar *data = malloc(size);
+		if( data == NULL ) {
+			g_set_error_errno(err);
+			g_mutex_lock(&pool->lock);
+			pool->outstanding--;
+			g_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+
+		slab = g_slice_new(Slab);
+		slab->data = data;
+		slab->size = size;
+		slab->pool = pool;
+	}
+
+	slab->refs = 1;
+	slab->len = 0;
+	slab->next = NULL;
+	slab->state = 0;
+	slab->compressed = NULL;
+	slab->compressed_len = 0;
+	slab->offered = false;
+	slab->queued = 0;
+
+	return slab;
+}
+
+void slab_ref_n( Slab *slab, gint n ) {
+	g_atomic_int_add(&slab->refs, n);
+}
+
+void slab_unref( Slab *slab ) {
+	if( !g_atomic_int_dec_and_test(&slab->refs) ) return;
+
+	SlabPool *pool = slab->pool;
+	g_mutex_lock(&pool->lock);
+	pool->outstanding--;
+	// Oversized slabs only exist for unusually long lines; don't keep them.
+	if( slab->data != NULL && slab->size == pool->slab_size && pool->nfree < pool->max_free ) {
+		slab->next = pool->free;
+		pool->free = slab;
+		pool->nfree++;
+		slab = NULL;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	if( slab != NULL ) slab_free(slab);
+}
+
+void slab_hold( Slab *slab ) {
+	slab_ref_n(slab, SLAB_BIAS - 1);
+}
+
+void slab_settle( Slab *slab, gint handed_out ) {
+	g_assert_cmpint(handed_out, <, SLAB_BIAS);
+	slab_ref_n(slab, handed_out - SLAB_BIAS + 1);
+	slab_unref(slab);
+}
+
+bool slab_sealed( Slab *slab ) {
+	return g_atomic_int_get(&slab->refs) < SLAB_BIAS;
+}
+
+// The reader counts a record after queuing it, so the sender can release it
+// first and the count dip below 0. Every charge is still matched by a credit,
+// since the count goes from 0 to 1 as often as from 1 to 0.
+gsize slab_charge( Slab *slab ) {
+	return g_atomic_int_add(&slab->queued, 1) == 0 ? slab->size : 0;
+}
+
+gsize slab_credit( Slab *slab ) {
+	return g_atomic_int_dec_and_test(&slab->queued) ? slab->size : 0;
+}
@@ -0,0 +1,302 @@
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "errors.h"
+#include "spill.h"
+
+#define RECORD_ALIGN 8
+
+// Lengths this large can't occur in a segment, so they mark control records.
+#define MARK_NEXT_SEGMENT (G_MAXUINT32 - 1)
+#define MARK_END G_MAXUINT32
+
+typedef struct SpillRecordHeader {
+	guint32 length, reserved;
+} SpillRecordHeader;
+
+typedef struct SpillSegment {
+	gchar *path;
+	int fd;
+	gchar *base;
+	// Both published by the producer with release semantics. next is set
+	// before the marker pointing at it is committed.
+	volatile gsize committed;
+	struct SpillSegment *volatile next;
+} SpillSegment;
+
+struct Spill {
+	gchar *dir;
+	gsize segment_size;
+	guint max_segments, next_id;
+	volatile gint nsegments;
+
+	// A consumed segment is kept mapped for reuse rather than deleted.
+	GMutex spare_lock;
+	SpillSegment *spare;
+
+	// Record bytes only; control records aren't counted.
+	cache_aligned struct {
+		SpillSegment *seg;
+		gsize off;
+		volatile guint64 appended;
+	} producer;
+
+	cache_aligned struct {
+		SpillSegment *seg, *release_seg;
+		gsize off;
+		guint64 read;
+		volatile guint64 released;
+	} consumer;
+};
+
+static gsize record_size( gsize len ) {
+	return (sizeof(SpillRecordHeader) + len + RECORD_ALIGN - 1) & ~(gsize) (RECORD_ALIGN - 1);
+}
+
+static void segment_free( SpillSegment *seg, gsize size ) {
+	munmap(seg->base, size);
+	close(seg->fd);
+	unlink(seg->path);
+	g_free(seg->path);
+	g_slice_free(SpillSegment, seg);
+}
+
+static SpillSegment *segment_new( Spill *s, GError **err ) {
+	SpillSegment *seg = g_slice_new0(SpillSegment);
+	seg->path = g_strdup_printf("%s/spill-%08u.seg", s->dir, s->next_id++);
+
+	seg->fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if( seg->fd == -1 ) {
+		g_set_error_errno(err);
+		goto err_open;
+	}
+
+	// Reserve the blocks up front; running out of space while writing through
+	// the mapping would raise SIGBUS instead.
+	if( (errno = posix_fallocate(seg->fd, 0, s->segment_size)) != 0 ) {
+		g_set_error_errno(err);
+		goto err_fallocate;
+	}
+
+	seg->base = mmap(NULL, s->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if( seg->base == MAP_FAILED ) {
+		g_set_error_errno(err);
+		goto err_mmap;
+	}
+
+	return seg;
+
+err_mmap:
+err_fallocate:
+	close(seg->fd);
+	unlink(seg->path);
+err_open:
+	g_free(seg->path);
+	g_slice_free(SpillSegment, seg);
+	return NULL;
+}
+
+// Returns NULL without setting err if the disk budget is used up.
+static SpillSegment *segment_get( Spill *s, GError **err ) {
+	g_mutex_lock(&s->spare_lock);
+	SpillSegment *seg = s->spare;
+	s->spare = NULL;
+	g_mutex_unlock(&s->spare_lock);
+
+	if( seg == NULL ) {
+		if( (guint) g_atomic_int_get(&s->nsegments) >= s->max_segments ) return NULL;
+
+		GError *_err = NULL;
+		seg = segment_new(s, &_err);
+		if( seg == NULL ) {
+			// A full disk is just another way of running out of budget.
+			if( _err->domain == ERRNO_QUARK && (_err->code == ENOSPC || _err->code == EDQUOT) ) {
+				g_error_free(_err);
+			} else {
+				g_propagate_error(err, _err);
+			}
+			return NULL;
+		}
+		g_atomic_int_inc(&s->nsegments);
+	}
+
+	seg->committed = 0;
+	seg->next = NULL;
+	return seg;
+}
+
+static void segment_retire( Spill *s, SpillSegment *seg ) {
+	g_mutex_lock(&s->spare_lock);
+	if( s->spare == NULL ) {
+		s->spare = seg;
+		seg = NULL;
+	}
+	g_mutex_unlock(&s->spare_lock);
+
+	if( seg != NULL ) {
+		segment_free(seg, s->segment_size);
+		g_atomic_int_add(&s->nsegments, -1);
+	}
+}
+
+Spill *spill_new( const gchar *dir, gsize segment_size, guint64 max_bytes, GError **err ) {
+	g_assert(segment_size % RECORD_ALIGN == 0);
+
+	// The consumer only gives up a segment once it has moved on to the next,
+	// so at least two must fit in the budget.
+	if( max_bytes / segment_size < 2 ) {
+		g_set_error(
+			err,
+			VARNISHLOG_BUFFER_QUARK,
+			VARNISHLOG_BUFFER_ERROR_UNSPEC,
+			"Spill budget must hold at least two %" G_GSIZE_FORMAT " byte segments",
+			segment_size
+		);
+		return NULL;
+	}
+
+	if( g_mkdir_with_parents(dir, S_IRWXU) == -1 ) {
+		g_set_error_errno(err);
+		return NULL;
+	}
+
+	Spill *s;
+	if( (errno = posix_memalign((void **) &s, CACHE_LINE_SIZE, sizeof(Spill))) != 0 ) {
+		g_set_error_errno(err);
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+
+	s->dir = g_strdup(dir);
+	s->segment_size = segment_size;
+	s->max_segments = MIN(max_bytes / segment_size, G_MAXINT);
+	g_mutex_init(&s->spare_lock);
+
+	SpillSegment *seg = segment_new(s, err);
+	if( seg == NULL ) {
+		g_mutex_clear(&s->spare_lock);
+		g_free(s->dir);
+		free(s);
+		return NULL;
+	}
+	s->nsegments = 1;
+
+	s->producer.seg = seg;
+	s->consumer.seg = seg;
+	s->consumer.release_seg = seg;
+
+	return s;
+}
+
+void spill_free( Spill *s ) {
+	SpillSegment *next;
+	for( SpillSegment *seg = s->consumer.release_seg; seg != NULL; seg = next ) {
+		next = seg->next;
+		segment_free(seg, s->segment_size);
+	}
+	if( s->spare != NULL ) segment_free(s->spare, s->segment_size);
+
+	g_mutex_clear(&s->spare_lock);
+	g_free(s->dir);
+	free(s);
+}
+
+static void commit( Spill *s, gsize off ) {
+	s->producer.off = off;
+	__atomic_store_n(&s->producer.seg->committed, off, __ATOMIC_RELEASE);
+}
+
+static void write_mark( Spill *s, guint32 mark ) {
+	SpillRecordHeader *hdr = (SpillRecordHeader *) (s->producer.seg->base + s->producer.off);
+	hdr->length = mark;
+	commit(s, s->producer.off + sizeof(*hdr));
+}
+
+// Every record leaves room behind it for a control record, so a marker can
+// always be written into the current segment.
+static bool reserve( Spill *s, gsize size, GError **err ) {
+	if( s->producer.off + size + sizeof(SpillRecordHeader) <= s->segment_size ) return true;
+
+	SpillSegment *next = segment_get(s, err);
+	if( next == NULL ) return false;
+
+	__atomic_store_n(&s->producer.seg->next, next, __ATOMIC_RELEASE);
+	write_mark(s, MARK_NEXT_SEGMENT);
+
+	s->producer.seg = next;
+	s->producer.off = 0;
+
+	return true;
+}
+
+bool spill_append( Spill *s, const gchar *data, gsize len, GError **err ) {
+	gsize size = record_size(len);
+	if( size + sizeof(SpillRecordHeader) > s->segment_size ) return false;
+	if( !reserve(s, size, err) ) return false;
+
+	SpillRecordHeader *hdr = (SpillRecordHeader *) (s->producer.seg->base + s->producer.off);
+	hdr->length = len;
+	memcpy(hdr + 1, data, len);
+	commit(s, s->producer.off + size);
+
+	__atomic_store_n(&s->producer.appended, s->producer.appended + size, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+void spill_end( Spill *s ) {
+	write_mark(s, MARK_END);
+}
+
+guint64 spill_pending_bytes( Spill *s ) {
+	guint64 released = __atomic_load_n(&s->consumer.released, __ATOMIC_RELAXED);
+	return __atomic_load_n(&s->producer.appended, __ATOMIC_RELAXED) - released;
+}
+
+bool spill_readable( Spill *s ) {
+	return s->consumer.off < __atomic_load_n(&s->consumer.seg->committed, __ATOMIC_ACQUIRE);
+}
+
+SpillStatus spill_next( Spill *s, const gchar **data, gsize *len ) {
+	while( true ) {
+		SpillSegment *seg = s->consumer.seg;
+		if( s->consumer.off >= __atomic_load_n(&seg->committed, __ATOMIC_ACQUIRE) )
+			return SPILL_EMPTY;
+
+		const SpillRecordHeader *hdr = (const SpillRecordHeader *) (seg->base + s->consumer.off);
+		if( hdr->length == MARK_NEXT_SEGMENT ) {
+			s->consumer.seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+			s->consumer.off = 0;
+			continue;
+		} else if( hdr->length == MARK_END ) {
+			s->consumer.off += sizeof(*hdr);
+			return SPILL_END;
+		}
+
+		gsize size = record_size(hdr->length);
+		*data = (const gchar *) (hdr + 1);
+		*len = hdr->length;
+		s->consumer.off += size;
+		s->consumer.read += size;
+		return SPILL_RECORD;
+	}
+}
+
+void spill_release( Spill *s ) {
+	while( s->consumer.release_seg != s->consumer.seg ) {
+		SpillSegment *next = s->consumer.release_seg->next;
+		segment_retire(s, s->consumer.release_seg);
+		s->consumer.release_seg = next;
+	}
+	__atomic_store_n(&s->consumer.released, s->consumer.read, __ATOMIC_RELAXED);
+}
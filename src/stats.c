@@ -0,0 +1,98 @@
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "stats.h"
+
+void stats_init( Stats *stats ) {
+	stats->magic = STATS_MAGIC;
+	stats->version = STATS_VERSION;
+	stats->size = sizeof(Stats);
+	stats->residency_buckets = STATS_RESIDENCY_BUCKETS;
+	stats->residency_sub_bits = STATS_RESIDENCY_SUB_BITS;
+	stats->residency_hdr_buckets = STATS_RESIDENCY_HDR_BUCKETS;
+	stats->sample_rate_ppm = 1000000;
+	stats->instance_size = sizeof(StatsInstance);
+	stats->reader_numa_node = G_MAXUINT32;
+}
+
+// With a single writer per field a plain store is enough, and avoids the
+// locked instruction an atomic add would need.
+void stats_add( volatile guint64 *field, guint64 n ) {
+	__atomic_store_n(field, *field + n, __ATOMIC_RELAXED);
+}
+
+void stats_max( volatile guint64 *field, guint64 value ) {
+	if( value > *field ) __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+// Compression is credited a moment after the records it covers are released,
+// so the saving can briefly exceed what is queued.
+static guint64 held( const Stats *stats, const volatile guint64 *bytes_queued ) {
+	guint64 queued = __atomic_load_n(bytes_queued, __ATOMIC_RELAXED);
+	guint64 saved = __atomic_load_n(&stats->bytes_compression_saved, __ATOMIC_RELAXED);
+	return queued > saved ? queued - saved : 0;
+}
+
+guint64 stats_bytes_held( const Stats *stats ) {
+	return held(stats, &stats->bytes_queued);
+}
+
+guint64 stats_instance_bytes_held( const Stats *stats, const StatsInstance *instance ) {
+	return held(stats, &instance->bytes_queued);
+}
+
+#define SUB_BUCKETS (1 << STATS_RESIDENCY_SUB_BITS)
+
+// Values below SUB_BUCKETS are their own bucket. Above that the exponent
+// picks a row of SUB_BUCKETS buckets and the bits after the leading one pick
+// the column.
+guint stats_histogram_bucket( guint64 us ) {
+	if( us < SUB_BUCKETS ) return us;
+	guint exp = 63 - __builtin_clzll(us);
+	if( exp > STATS_RESIDENCY_MAX_EXP ) return STATS_RESIDENCY_HDR_BUCKETS - 1;
+	guint sub = (us >> (exp - STATS_RESIDENCY_SUB_BITS)) - SUB_BUCKETS;
+	return ((exp - STATS_RESIDENCY_SUB_BITS + 1) << STATS_RESIDENCY_SUB_BITS) + sub;
+}
+
+guint64 stats_histogram_floor( guint i ) {
+	if( i < SUB_BUCKETS ) return i;
+	guint exp = (i >> STATS_RESIDENCY_SUB_BITS) + STATS_RESIDENCY_SUB_BITS - 1;
+	guint64 sub = i & (SUB_BUCKETS - 1);
+	return (SUB_BUCKETS + sub) << (exp - STATS_RESIDENCY_SUB_BITS);
+}
+
+void stats_add_residency( Stats *stats, gint64 us ) {
+	if( us < 0 ) us = 0;
+	guint bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	stats_add(&stats->residency_us[MIN(bucket, STATS_RESIDENCY_BUCKETS - 1)], 1);
+	stats_add(&stats->residency_hdr[stats_histogram_bucket(us)], 1);
+	stats_max(&stats->residency_max_us, us);
+}
+
+guint64 stats_histogram_percentile( const volatile guint64 *buckets, double p ) {
+	guint64 counts[STATS_RESIDENCY_HDR_BUCKETS];
+	guint64 total = 0;
+	for( guint i = 0; i < STATS_RESIDENCY_HDR_BUCKETS; i++ ) {
+		counts[i] = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+	if( total == 0 ) return 0;
+
+	guint64 want = (guint64) (total * p), seen = 0;
+	for( guint i = 0; i < STATS_RESIDENCY_HDR_BUCKETS; i++ ) {
+		seen += counts[i];
+		if( seen > want ) return stats_histogram_floor(i);
+	}
+	return stats_histogram_floor(STATS_RESIDENCY_HDR_BUCKETS - 1);
+}
+
+guint64 stats_residency_percentile( const Stats *stats, double p ) {
+	return stats_histogram_percentile(stats->residency_hdr, p);
+}
+
+void stats_publish_residency( Stats *stats ) {
+	__atomic_store_n(&stats->residency_p50_us, stats_residency_percentile(stats, 0.5), __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->residency_p99_us, stats_residency_percentile(stats, 0.99), __ATOMIC_RELAXED);
+}
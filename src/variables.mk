@@ -1,4 +1,4 @@
-SRC_SOURCES := main.c die.c errors.c glib_extra.c priority.c varnishlog.c
+SRC_SOURCES := main.c aggregator.c compressor.c die.c errors.c events.c filter.c glib_extra.c grouper.c journal.c line_reader.c output.c overflow.c priority.c replay.c queue.c sampler.c sender.c server.c shm_ring.c slab.c spill.c stats.c varnishlog.c vsl.c wakeup.c
 SRC_SOURCES := $(SRC_SOURCES:%=$(CURDIR)/%)
 
 SRC_OBJECTS := $(SRC_SOURCES:.c=.o)
@@ -7,3 +7,12 @@ SRC_OBJECTS := $(SRC_OBJECTS:.cpp=.o)
 SRC_DEPS := $(SRC_OBJECTS:.o=.d)
 
 ALL_OBJECTS := $(ALL_OBJECTS) $(SRC_OBJECTS)
+
+# The --shm-ring client library, which is linked into consumers rather than
+# varnishlog-buffer itself.
+CLIENT_SOURCES := vlb_client.c
+CLIENT_SOURCES := $(CLIENT_SOURCES:%=$(CURDIR)/%)
+
+CLIENT_OBJECTS := $(CLIENT_SOURCES:.c=.o)
+
+CLIENT_DEPS := $(CLIENT_OBJECTS:.o=.d)
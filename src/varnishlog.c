@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
@@ -12,18 +14,47 @@
 
 #include "common.h"
 #include "glib_extra.h"
+#include "slab.h"
+#include "line_reader.h"
 #include "varnishlog.h"
 #include "die.h"
 #include "priority.h"
 #include "errors.h"
+#include "replay.h"
+
+// The first restart waits this long; see VarnishlogInput.
+#define MIN_RESTART_DELAY_US (100 * 1000)
+// The first child has to have produced output or run this long for its exit
+// to be restarted rather than fatal.
+#define MIN_FIRST_RUN_US (1000 * 1000)
 
 struct Varnishlog {
+	const VarnishlogInput *input;
+	// What a child runs. Built up front, so that as little as possible is
+	// done between fork and exec.
+	gchar **argv;
+	SlabPool *pool;
 	pid_t *pid;
-	FILE *stdout;
+	// How the child exited, once it has been reaped.
+	int stat;
+	int stdout_fd;
+	LineReader *reader;
+	// NULL unless there is a child.
 	GIOChannel *error_channel;
+	// Set once the child has closed its end of the error pipe.
+	bool error_finished;
+	bool finite;
+
+	// For a supervised child. restart_at is zero while one is running.
+	gint64 started_at, restart_at, restart_delay_us;
+	guint restarts;
+	// Whether the current child has written anything.
+	bool produced;
 };
 
-bool shutdown_varnishlog( Varnishlog *v, int *stat, GError **err ) {
+// Stops the child if there is one and closes the input, so that another
+// child can be started in its place.
+static bool stop_input( Varnishlog *v, int *stat, GError **err ) {
 	if( v->pid != NULL ) {
 		errno = 0;
 		if( kill(*v->pid, SIGINT) == -1 ) {
@@ -40,14 +71,21 @@ bool shutdown_varnishlog( Varnishlog *v, int *stat, GError **err ) {
 
 		g_free(v->pid);
 		v->pid = NULL;
+	} else if( stat != NULL ) {
+		*stat = v->stat;
+	}
+
+	if( v->reader != NULL ) {
+		line_reader_free(v->reader);
+		v->reader = NULL;
 	}
 
-	if( v->stdout != NULL ) {
-		if( fclose(v->stdout) != 0 ) {
+	if( v->stdout_fd != -1 ) {
+		if( close(v->stdout_fd) == -1 ) {
 			g_set_error_errno(err);
 			return false;
 		}
-		v->stdout = NULL;
+		v->stdout_fd = -1;
 	}
 
 	if( v->error_channel != NULL ) {
@@ -59,34 +97,50 @@ bool shutdown_varnishlog( Varnishlog *v, int *stat, GError **err ) {
 		g_io_channel_unref(v->error_channel);
 		v->error_channel = NULL;
 	}
+	v->error_finished = true;
 
-	g_slice_free(Varnishlog, v);
+	return true;
+}
 
+bool shutdown_varnishlog( Varnishlog *v, int *stat, GError **err ) {
+	if( !stop_input(v, stat, err) ) return false;
+	g_strfreev(v->argv);
+	g_slice_free(Varnishlog, v);
 	return true;
 }
 
 __attribute__((noreturn))
-static void start_varnishlog_child_noreturn( int pipes[2], gboolean lowprio, GIOChannel *error_out ) {
+static void start_varnishlog_child_noreturn( int pipes[2], const VarnishlogInput *input, char **argv, GIOChannel *error_out ) {
 	GError *err = NULL;
 
+	// The reader's signals are blocked so that it can wait for them; the
+	// child should get them as usual.
+	sigset_t mask;
+	sigemptyset(&mask);
+	if( sigprocmask(SIG_SETMASK, &mask, NULL) == -1 ) goto out_sigprocmask;
+
 	if( close(1) == -1 ) goto out_close_1;
 	if( dup2(pipes[1], 1) == -1 ) goto out_dup2;
 
-	// The priority is arbitrarily chosen. Priorities range from 1 - 99. See chrt -m
-	if( !lowprio && !high_priority_process(10, &err) ) goto out_high_priority_process;
+	if( input->cpus != NULL && !pin_thread(input->cpus, &err) ) goto out_pin_thread;
 
-	char *argv[] = {
-		"varnishlog",
-		"-Ou",
-		NULL
-	};
+	if( input->source == VARNISHLOG_SOURCE_FILE ) {
+		if( !replay_file(input->path, 1, &err) ) goto out_replay_file;
+		exit(EXIT_SUCCESS);
+	}
+
+	// The priority is arbitrarily chosen. Priorities range from 1 - 99. See chrt -m
+	if( !input->lowprio && !high_priority_process(10, &err) ) goto out_high_priority_process;
 
 	execvp(argv[0], argv);
 	// Fall through to error cases if we get here.
 
 out_dup2:
 out_close_1:
+out_sigprocmask:
 	g_set_error_errno(&err);
+out_pin_thread:
+out_replay_file:
 out_high_priority_process:
 	if( !write_gerror(error_out, err, NULL) )
 		g_die(err);
@@ -94,18 +148,6 @@ out_high_priority_process:
 	g_assert(false); // l'impossible!
 }
 
-static volatile gint child_error_waiting = false;
-static int child_error_fd;
-
-// Be careful, this function is called in a signal handler context.
-static void child_error_io_ready() {
-	int saved_errno = errno;
-	errno = 0;
-	if( fcntl(child_error_fd, F_GETFD) != -1 || errno != EBADF )
-		g_atomic_int_set(&child_error_waiting, true);
-	errno = saved_errno;
-}
-
 static bool set_cloexec( int fd, GError **err ) {
 	int flags = fcntl(fd, F_GETFD);
 	if( flags == -1 ) {
@@ -121,8 +163,8 @@ static bool set_cloexec( int fd, GError **err ) {
 	return true;
 }
 
-// Note that only one Varnishlog may exist at a time.
-Varnishlog *start_varnishlog( gboolean lowprio, GError **err ) {
+// Note that each Varnishlog only has one child at a time.
+static bool start_child( Varnishlog *v, GError **err ) {
 	int pipes[2], error_pipes[2];
 	bool closed_pipes_1 = false, closed_error_pipes_1 = false;
 
@@ -136,31 +178,11 @@ Varnishlog *start_varnishlog( gboolean lowprio, GError **err ) {
 		goto out_error_pipes;
 	}
 
-	child_error_fd = error_pipes[0];
-
-	if( fcntl(error_pipes[0], F_SETFL, O_ASYNC) == -1 ) {
-		g_set_error_errno(err);
-		goto out_error_pipes_fcntl;
-	}
-
-	if( fcntl(error_pipes[0], F_SETOWN, getpid()) == -1 ) {
-		g_set_error_errno(err);
-		goto out_error_pipes_fcntl;
-	}
-
 	if( !set_cloexec(error_pipes[0], err) ) goto out_set_cloexec;
 	if( !set_cloexec(error_pipes[1], err) ) goto out_set_cloexec;
 	if( !set_cloexec(pipes[0], err) ) goto out_set_cloexec;
 	if( !set_cloexec(pipes[1], err) ) goto out_set_cloexec;
 
-	struct sigaction act, oact;
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = (void (*)( int )) child_error_io_ready;
-	if( sigaction(SIGIO, &act, &oact) == -1 ) {
-		g_set_error_errno(err);
-		goto out_error_pipes_sigaction;
-	}
-
 	GIOChannel *error_write = g_io_channel_unix_new(error_pipes[1]),
 	           *error_read = g_io_channel_unix_new(error_pipes[0]);
 
@@ -176,7 +198,7 @@ Varnishlog *start_varnishlog( gboolean lowprio, GError **err ) {
 		goto out_fork;
 	} else if( pid == 0 ) {
 		g_io_channel_unref(error_read);
-		start_varnishlog_child_noreturn(pipes, lowprio, error_write);
+		start_varnishlog_child_noreturn(pipes, v->input, v->argv, error_write);
 	}
 
 	g_io_channel_unref(error_write);
@@ -193,21 +215,18 @@ Varnishlog *start_varnishlog( gboolean lowprio, GError **err ) {
 	}
 	closed_error_pipes_1 = true;
 
-	FILE *child_stdout;
-	if( (child_stdout = fdopen(pipes[0], "r")) == NULL ) {
-		g_set_error_errno(err);
-		goto out_fdopen_pipes_0;
-	}
-
-	Varnishlog *v = g_slice_new(Varnishlog);
 	v->pid = g_new(pid_t, 1);
 	*v->pid = pid;
+	v->stat = 0;
 	v->error_channel = error_read;
-	v->stdout = child_stdout;
+	v->error_finished = false;
+	v->stdout_fd = pipes[0];
+	v->reader = line_reader_new(pipes[0], v->pool);
+	v->started_at = g_get_monotonic_time();
+	v->produced = false;
 
-	return v;
+	return true;
 
-out_fdopen_pipes_0:
 out_close_error_pipes_1:
 out_close_pipes_1:
 	kill(pid, SIGINT);
@@ -216,59 +235,233 @@ out_error_read_set_encoding:
 out_error_write_set_encoding:
 	g_io_channel_unref(error_read);
 	g_io_channel_unref(error_write);
-	sigaction(SIGIO, &oact, &act);
-out_error_pipes_sigaction:
 out_set_cloexec:
-out_error_pipes_fcntl:
 	close(error_pipes[0]);
 	if( !closed_error_pipes_1 ) close(error_pipes[1]);
 out_error_pipes:
 	close(pipes[0]);
 	if( !closed_pipes_1 ) close(pipes[1]);
 out_pipes:
-	return NULL;
+	return false;
+}
+
+static bool open_input( Varnishlog *v, GError **err ) {
+	const VarnishlogInput *input = v->input;
+	int fd;
+	switch( input->source ) {
+		case VARNISHLOG_SOURCE_STDIN:
+			fd = dup(STDIN_FILENO);
+			break;
+		case VARNISHLOG_SOURCE_FIFO:
+			// Holding the write end open ourselves means we never see end of file
+			// when a writer goes away, and the next one can simply carry on.
+			fd = open(input->path, O_RDWR);
+			break;
+		case VARNISHLOG_SOURCE_FILE:
+			fd = open(input->path, O_RDONLY);
+			break;
+		default:
+			g_assert_not_reached();
+	}
+	if( fd == -1 ) {
+		g_set_error_errno(err);
+		goto out_open;
+	}
+
+	if( !set_cloexec(fd, err) ) goto out_set_cloexec;
+
+	v->stdout_fd = fd;
+	v->reader = line_reader_new(fd, v->pool);
+	v->finite = input->source != VARNISHLOG_SOURCE_FIFO;
+
+	return true;
+
+out_set_cloexec:
+	close(fd);
+out_open:
+	return false;
+}
+
+static gchar **child_argv( const VarnishlogInput *input ) {
+	static gchar *default_argv[] = {
+		"varnishlog",
+		"-Ou",
+		NULL
+	};
+	gchar **argv = input->argv != NULL ? input->argv : default_argv;
+	if( input->instance == NULL ) return g_strdupv(argv);
+
+	guint argc = g_strv_length(argv);
+	gchar **with_instance = g_new(gchar *, argc + 3);
+	for( guint i = 0; i < argc; i++ ) with_instance[i] = g_strdup(argv[i]);
+	with_instance[argc] = g_strdup("-n");
+	with_instance[argc + 1] = g_strdup(input->instance);
+	with_instance[argc + 2] = NULL;
+	return with_instance;
+}
+
+Varnishlog *start_varnishlog( const VarnishlogInput *input, SlabPool *pool, GError **err ) {
+	Varnishlog *v = g_slice_new0(Varnishlog);
+	v->input = input;
+	v->pool = pool;
+	v->stdout_fd = -1;
+	v->error_finished = true;
+	v->finite = input->source != VARNISHLOG_SOURCE_COMMAND;
+	v->restart_delay_us = MIN_RESTART_DELAY_US;
+
+	// Paced replay runs in a child so the reader sees it like any other pipe.
+	bool started;
+	if(
+		input->source == VARNISHLOG_SOURCE_COMMAND ||
+		(input->source == VARNISHLOG_SOURCE_FILE && input->realtime)
+	) {
+		if( input->source == VARNISHLOG_SOURCE_COMMAND ) v->argv = child_argv(input);
+		started = start_child(v, err);
+	} else {
+		started = open_input(v, err);
+	}
+	if( !started ) {
+		g_strfreev(v->argv);
+		g_slice_free(Varnishlog, v);
+		return NULL;
+	}
+	return v;
+}
+
+bool varnishlog_finite( const Varnishlog *v ) {
+	return v->finite;
+}
+
+int varnishlog_fd( const Varnishlog *v ) {
+	return v->stdout_fd;
+}
+
+bool varnishlog_supervised( const Varnishlog *v ) {
+	return v->input->source == VARNISHLOG_SOURCE_COMMAND && v->input->max_restart_delay_us > 0;
+}
+
+bool varnishlog_lost( const Varnishlog *v, const GError *err ) {
+	if( !varnishlog_supervised(v) ) return false;
+	// An error from the first child, or it exiting straight away, is most
+	// likely down to how it was run, such as a bad -n, so isn't retried.
+	if( v->restarts > 0 ) return true;
+	return
+		err->domain == VARNISHLOG_BUFFER_QUARK &&
+		err->code == VARNISHLOG_BUFFER_ERROR_EOF &&
+		(v->produced || g_get_monotonic_time() - v->started_at >= MIN_FIRST_RUN_US);
+}
+
+bool varnishlog_stop_child( Varnishlog *v, int *stat, GError **err ) {
+	g_assert(varnishlog_supervised(v) && v->restart_at == 0);
+
+	if( !stop_input(v, stat, err) ) return false;
+	// Already handed over, rather than left for shutdown_varnishlog.
+	v->stat = 0;
+
+	// A child which lasted reasonably long starts the backoff over.
+	gint64 now = g_get_monotonic_time();
+	if( now - v->started_at >= v->input->max_restart_delay_us ) v->restart_delay_us = MIN_RESTART_DELAY_US;
+	v->restart_at = now + v->restart_delay_us;
+	v->restart_delay_us = MIN(v->restart_delay_us * 2, v->input->max_restart_delay_us);
+	return true;
+}
+
+gint64 varnishlog_restart_at( const Varnishlog *v ) {
+	return v->restart_at;
+}
+
+bool varnishlog_restart( Varnishlog *v, GError **err ) {
+	g_assert(v->restart_at != 0);
+
+	v->restarts++;
+	if( !start_child(v, err) ) {
+		v->restart_at = g_get_monotonic_time() + v->restart_delay_us;
+		v->restart_delay_us = MIN(v->restart_delay_us * 2, v->input->max_restart_delay_us);
+		return false;
+	}
+	v->restart_at = 0;
+	return true;
+}
+
+int varnishlog_error_fd( const Varnishlog *v ) {
+	if( v->error_finished ) return -1;
+	return g_io_channel_unix_get_fd(v->error_channel);
+}
+
+bool varnishlog_read_error( Varnishlog *v, GError **err ) {
+	g_assert(!v->error_finished);
+
+	GError *_err = NULL;
+	GError *cld_err = read_gerror(v->error_channel, &_err);
+	if( cld_err != NULL ) {
+		g_propagate_error(err, cld_err);
+		return false;
+	} else if( _err != NULL ) {
+		g_propagate_error(err, _err);
+		return false;
+	}
+	// The child has gone, or exec'd and so closed its end.
+	v->error_finished = true;
+	return true;
+}
+
+bool varnishlog_reap( Varnishlog *v, GError **err ) {
+	if( v->pid == NULL ) return true;
+
+	pid_t pid = waitpid(*v->pid, &v->stat, WNOHANG);
+	if( pid == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	} else if( pid == 0 ) {
+		return true;
+	}
+
+	// Nothing is left to kill, so a recycled pid can't be hit by mistake.
+	g_free(v->pid);
+	v->pid = NULL;
+	return true;
 }
 
 static bool set_error_from_child_if_pending( Varnishlog *v, GError **err ) {
-	if( !g_atomic_int_get(&child_error_waiting) ) return false;
+	if( v->error_finished ) return false;
+
+	// The child writes its error before it exits, so by the time its output
+	// ends the error is there to read.
+	struct pollfd pfd = { .fd = g_io_channel_unix_get_fd(v->error_channel), .events = POLLIN };
+	if( poll(&pfd, 1, 0) != 1 ) return false;
 
 	GError *cld_err = read_gerror(v->error_channel, err);
-	g_atomic_int_set(&child_error_waiting, false);
 	if( cld_err == NULL ) return false;
-	// Note that there is a race here if the child wants to send more errors.
-	//                                Meh.
 	g_propagate_error(err, cld_err);
 	return true;
 }
 
-GString *read_varnishlog_entry( Varnishlog *v, GError **err ) {
-	size_t allocation;
-	char *line = NULL;
-	errno = 0;
-	ssize_t slen = getline(&line, &allocation, v->stdout);
-	int saved_errno = errno;
-	if( slen == -1 ) {
-		GError *_err = NULL;
-		if( set_error_from_child_if_pending(v, &_err) ) {
-			// Got an error from the child.
-			g_propagate_error(err, _err);
+// Prefers an error reported by the child over the one from reading its output.
+static gssize check_read( Varnishlog *v, gssize nread, GError *_err, GError **err ) {
+	if( nread == -1 ) {
+		GError *cld_err = NULL;
+		if( set_error_from_child_if_pending(v, &cld_err) || cld_err != NULL ) {
+			// Got an error from the child, or failed to read it.
+			g_error_free(_err);
+			g_propagate_error(err, cld_err);
 		} else {
-			// Didn't get an error from the child.
-			if( _err == NULL ) {
-				errno = saved_errno;
-				set_gerror_getline(v->stdout, err);
-			} else {
-				g_propagate_error(err, _err);
-			}
+			g_propagate_error(err, _err);
 		}
-		clearerr(v->stdout);
-		return NULL;
+		return -1;
 	}
-	if( line[slen - 1] == '\n' ) line[slen - 1] = '\0';
 
-	GString *ret = g_string_wrap(line, slen, allocation);
+	if( nread > 0 ) v->produced = true;
+	return nread;
+}
 
-	set_error_from_child_if_pending(v, err);
+gssize read_varnishlog_entries( Varnishlog *v, LineReaderFunc func, gpointer data, GError **err ) {
+	GError *_err = NULL;
+	gssize nread = line_reader_read(v->reader, func, data, &_err);
+	return check_read(v, nread, _err, err);
+}
 
-	return ret;
+gssize splice_varnishlog_entries( Varnishlog *v, int out_fd, LineReaderFunc func, gpointer data, GError **err ) {
+	GError *_err = NULL;
+	gssize nread = line_reader_splice(v->reader, out_fd, func, data, &_err);
+	return check_read(v, nread, _err, err);
 }
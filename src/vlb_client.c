@@ -0,0 +1,175 @@
+// The consumer side of --shm-ring. This is linked into other programs, so
+// unlike the rest of varnishlog-buffer it doesn't use glib.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "vlb_ring.h"
+#include "vlb_client.h"
+
+#ifndef __linux__
+#define POLL_SLEEP_US 50
+#endif
+
+struct vlb_client {
+	VlbRingHeader *header;
+	const char *data;
+	size_t map_size;
+	uint64_t mask;
+	// How far records have been handed out, ahead of the shared tail until
+	// they are released.
+	uint64_t pos;
+	uint64_t cached_head;
+};
+
+// Returns false on timeout.
+static bool futex_wait( volatile uint32_t *word, uint32_t value, int timeout_ms ) {
+#ifdef __linux__
+	struct timespec ts, *tsp = NULL;
+	if( timeout_ms >= 0 ) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	return syscall(SYS_futex, word, FUTEX_WAIT, value, tsp, NULL, 0) == 0 || errno != ETIMEDOUT;
+#else
+	(void) word, (void) value;
+	if( timeout_ms >= 0 && timeout_ms * 1000 < POLL_SLEEP_US ) return false;
+	usleep(POLL_SLEEP_US);
+	return true;
+#endif
+}
+
+static void futex_wake( volatile uint32_t *word ) {
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+	(void) word;
+#endif
+}
+
+vlb_client *vlb_client_open( const char *path ) {
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if( fd == -1 ) return NULL;
+
+	struct stat st;
+	if( fstat(fd, &st) == -1 ) goto err;
+	if( (size_t) st.st_size < VLB_RING_HEADER_SIZE ) {
+		errno = EPROTO;
+		goto err;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( map == MAP_FAILED ) goto err;
+	close(fd);
+
+	VlbRingHeader *h = (VlbRingHeader *) map;
+	if(
+		__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != VLB_RING_MAGIC ||
+		h->version != VLB_RING_VERSION ||
+		h->header_size + h->size > (uint64_t) st.st_size
+	) {
+		munmap(map, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	vlb_client *c = calloc(1, sizeof(*c));
+	if( c == NULL ) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	c->header = h;
+	c->data = map + h->header_size;
+	c->map_size = st.st_size;
+	c->mask = h->size - 1;
+	c->pos = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+	c->cached_head = c->pos;
+	return c;
+
+err:
+	close(fd);
+	return NULL;
+}
+
+void vlb_client_close( vlb_client *c ) {
+	vlb_client_release(c);
+	munmap(c->header, c->map_size);
+	free(c);
+}
+
+// Returns false on timeout.
+static bool wait_for_data( vlb_client *c, int timeout_ms ) {
+	VlbRingHeader *h = c->header;
+
+	// Paired with the fence in shm_ring_publish.
+	uint32_t seq = __atomic_load_n(&h->data_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->consumer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	c->cached_head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	bool woken = true;
+	if( c->cached_head == c->pos && !__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) )
+		woken = futex_wait(&h->data_seq, seq, timeout_ms);
+	__atomic_store_n(&h->consumer_waiting, 0, __ATOMIC_RELAXED);
+
+	c->cached_head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	return woken;
+}
+
+int vlb_client_next( vlb_client *c, const char **data, size_t *len, int timeout_ms ) {
+	VlbRingHeader *h = c->header;
+
+	while( c->cached_head == c->pos ) {
+		c->cached_head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if( c->cached_head != c->pos ) break;
+
+		if( __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) ) {
+			// closed is set after the last move of head, so one more look is
+			// enough.
+			c->cached_head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+			if( c->cached_head != c->pos ) break;
+			errno = EPIPE;
+			return -1;
+		}
+
+		if( !wait_for_data(c, timeout_ms) && c->cached_head == c->pos ) return 0;
+	}
+
+	uint64_t off = c->pos & c->mask;
+	uint32_t length = *(const uint32_t *) (c->data + off);
+	if( length == VLB_RING_WRAP ) {
+		c->pos += h->size - off;
+		off = 0;
+		length = *(const uint32_t *) c->data;
+	}
+
+	*data = c->data + off + sizeof(uint32_t);
+	*len = length;
+	c->pos += VLB_RING_RECORD_SIZE(length);
+	return 1;
+}
+
+void vlb_client_release( vlb_client *c ) {
+	VlbRingHeader *h = c->header;
+	if( __atomic_load_n(&h->tail, __ATOMIC_RELAXED) == c->pos ) return;
+
+	__atomic_store_n(&h->tail, c->pos, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if( __atomic_load_n(&h->producer_waiting, __ATOMIC_RELAXED) ) {
+		__atomic_store_n(&h->producer_waiting, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->space_seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&h->space_seq);
+	}
+}
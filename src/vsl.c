@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "common.h"
+#include "vsl.h"
+
+bool vsl_parse( const gchar *p, gsize len, VslLine *out ) {
+	const gchar *e = p + len;
+	if( e > p && e[-1] == '\n' ) e--;
+	while( p < e && *p == ' ' ) p++;
+
+	guint64 id = 0;
+	const gchar *digits = p;
+	while( p < e && *p >= '0' && *p <= '9' ) id = id * 10 + (*p++ - '0');
+	if( p == digits || p == e || *p != ' ' ) return false;
+	while( p < e && *p == ' ' ) p++;
+
+	const gchar *tag = p;
+	while( p < e && *p != ' ' ) p++;
+	if( p == tag ) return false;
+	gsize tag_len = p - tag;
+	while( p < e && *p == ' ' ) p++;
+
+	// The marker is a single character, followed by the payload if any.
+	if( p == e || (p + 1 < e && p[1] != ' ') ) return false;
+	gchar marker = *p++;
+	if( p < e ) p++;
+
+	out->id = id;
+	out->tag = tag;
+	out->tag_len = tag_len;
+	out->marker = marker;
+	out->payload = p;
+	out->payload_len = e - p;
+	return true;
+}
+
+// Append only: a tag's ID is its position here.
+static const gchar *const tag_names[] = {
+	// Varnish 3.
+	"Debug", "Error", "CLI", "StatSess", "ReqEnd", "SessionOpen", "SessionClose",
+	"BackendOpen", "BackendXID", "BackendReuse", "BackendClose", "HttpGarbage",
+	"Backend", "Length", "FetchError", "RxRequest", "RxResponse", "RxStatus",
+	"RxURL", "RxProtocol", "RxHeader", "TxRequest", "TxResponse", "TxStatus",
+	"TxURL", "TxProtocol", "TxHeader", "ObjRequest", "ObjResponse", "ObjStatus",
+	"ObjURL", "ObjProtocol", "ObjHeader", "LostHeader", "TTL", "Fetch_Body",
+	"VCL_acl", "VCL_call", "VCL_trace", "VCL_return", "VCL_error", "ReqStart",
+	"Hit", "HitPass", "ExpBan", "ExpKill", "WorkThread", "ESI_xmlerror", "Hash",
+	"Backend_health", "VCL_Log", "Gzip",
+	// Added in varnish 4 and later.
+	"Begin", "End", "Link", "SessOpen", "SessClose", "BackendStart", "Timestamp",
+	"ReqAcct", "BereqAcct", "PipeAcct", "ReqMethod", "ReqURL", "ReqProtocol",
+	"ReqHeader", "ReqUnset", "RespStatus", "RespReason", "RespProtocol",
+	"RespHeader", "RespUnset", "BereqMethod", "BereqURL", "BereqProtocol",
+	"BereqHeader", "BereqUnset", "BerespStatus", "BerespReason",
+	"BerespProtocol", "BerespHeader", "BerespUnset", "ObjMethod", "ObjReason",
+	"ObjUnset", "VCL_Error", "VCL_use", "Storage", "Proxy", "ProxyGarbage",
+	"VSL", "H2RxHdr", "H2RxBody", "H2TxHdr", "H2TxBody", "VfpAcct", "VdpAcct",
+	"Witness", "HitMiss", "Filters", "SessError", "Notice"
+};
+
+#define NTAGS (sizeof(tag_names) / sizeof(*tag_names))
+// A power of two comfortably bigger than NTAGS, so probes stay short.
+#define TAG_SLOTS 512
+
+// Open addressing over IDs; 0 is an empty slot.
+static guint8 tag_slots[TAG_SLOTS];
+
+enum {
+	TAG_BEGIN = 1 << 0,
+	TAG_END = 1 << 1
+};
+
+// Indexed by ID.
+static guint8 tag_flags[NTAGS + 1];
+
+static const gchar *const begin_tags[] = { "ReqStart", "SessionOpen", "BackendOpen", "Begin" };
+// The grouper's end tags.
+static const gchar *const end_tags[] = { "ReqEnd", "StatSess", "BackendReuse", "BackendClose", "End" };
+
+static guint tag_hash( const gchar *tag, gsize len ) {
+	guint32 h = 2166136261u;
+	for( gsize i = 0; i < len; i++ ) h = (h ^ (guchar) tag[i]) * 16777619u;
+	return h & (TAG_SLOTS - 1);
+}
+
+static guint lookup_tag( const gchar *tag, gsize len ) {
+	for( guint slot = tag_hash(tag, len); tag_slots[slot] != 0; slot = (slot + 1) & (TAG_SLOTS - 1) ) {
+		const gchar *name = tag_names[tag_slots[slot] - 1];
+		if( strncmp(name, tag, len) == 0 && name[len] == '\0' ) return tag_slots[slot];
+	}
+	return 0;
+}
+
+static void set_flags( const gchar *const *names, gsize n, guint8 flag ) {
+	for( gsize i = 0; i < n; i++ ) tag_flags[lookup_tag(names[i], strlen(names[i]))] |= flag;
+}
+
+static void init_tags( void ) {
+	static gsize initialized = 0;
+	if( !g_once_init_enter(&initialized) ) return;
+
+	G_STATIC_ASSERT(NTAGS < G_MAXUINT8);
+	for( guint id = 1; id <= NTAGS; id++ ) {
+		const gchar *name = tag_names[id - 1];
+		guint slot = tag_hash(name, strlen(name));
+		while( tag_slots[slot] != 0 ) slot = (slot + 1) & (TAG_SLOTS - 1);
+		tag_slots[slot] = id;
+	}
+	set_flags(begin_tags, G_N_ELEMENTS(begin_tags), TAG_BEGIN);
+	set_flags(end_tags, G_N_ELEMENTS(end_tags), TAG_END);
+
+	g_once_init_leave(&initialized, 1);
+}
+
+guint vsl_tag_id( const gchar *tag, gsize len ) {
+	init_tags();
+	return lookup_tag(tag, len);
+}
+
+bool vsl_tag_begins( guint id ) {
+	init_tags();
+	return tag_flags[id] & TAG_BEGIN;
+}
+
+bool vsl_tag_ends( guint id ) {
+	init_tags();
+	return tag_flags[id] & TAG_END;
+}
+
+guint vsl_tag_count( void ) {
+	return NTAGS;
+}
+
+const gchar *vsl_tag_name( guint id ) {
+	g_assert(id >= 1 && id <= NTAGS);
+	return tag_names[id - 1];
+}
@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#include "common.h"
+#include "glib_extra.h"
+#include "wakeup.h"
+
+#ifndef __linux__
+#define POLL_SLEEP_US 50
+#endif
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+void wakeup_init( Wakeup *w ) {
+	w->parked = false;
+	w->fd = -1;
+}
+
+bool wakeup_use_fd( Wakeup *w, GError **err ) {
+#ifdef __linux__
+	w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if( w->fd == -1 ) {
+		g_set_error_errno(err);
+		return false;
+	}
+	return true;
+#else
+	errno = ENOSYS;
+	g_set_error_errno(err);
+	return false;
+#endif
+}
+
+int wakeup_fd( const Wakeup *w ) {
+	return w->fd;
+}
+
+void wakeup_clear( Wakeup *w ) {
+	if( w->fd != -1 ) close(w->fd);
+	w->fd = -1;
+}
+
+static void park( Wakeup *w, gint64 timeout_us ) {
+#ifdef __linux__
+	struct timespec ts, *tsp = NULL;
+	if( timeout_us >= 0 ) {
+		ts.tv_sec = timeout_us / G_USEC_PER_SEC;
+		ts.tv_nsec = (timeout_us % G_USEC_PER_SEC) * 1000;
+		tsp = &ts;
+	}
+	// Returns immediately with EAGAIN if we were woken before getting here;
+	// spurious returns are harmless as the caller re-checks for work.
+	syscall(SYS_futex, &w->parked, FUTEX_WAIT_PRIVATE, true, tsp, NULL, 0);
+#else
+	if( timeout_us < 0 || timeout_us > POLL_SLEEP_US ) timeout_us = POLL_SLEEP_US;
+	usleep(timeout_us);
+#endif
+}
+
+void wakeup_wait( Wakeup *w, WakeupReadyFunc ready, gpointer data, gint64 spin_us, gint64 timeout_us ) {
+	if( spin_us > 0 ) {
+		gint64 until = g_get_monotonic_time() + spin_us;
+		do {
+			for( int i = 0; i < 64; i++ ) {
+				if( ready(data) ) return;
+				cpu_relax();
+			}
+		} while( g_get_monotonic_time() < until );
+	}
+
+	// Announce the park before the last check. Paired with the fence in
+	// wakeup_parked either we see the producer's work or it sees us parked.
+	g_atomic_int_set(&w->parked, true);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if( !ready(data) ) park(w, timeout_us);
+	g_atomic_int_set(&w->parked, false);
+}
+
+bool wakeup_prepare( Wakeup *w, WakeupReadyFunc ready, gpointer data ) {
+	g_atomic_int_set(&w->parked, true);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return !ready(data);
+}
+
+void wakeup_finish( Wakeup *w ) {
+	g_atomic_int_set(&w->parked, false);
+}
+
+bool wakeup_parked( Wakeup *w ) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&w->parked, __ATOMIC_RELAXED);
+}
+
+void wakeup_wake( Wakeup *w ) {
+	// Only the first waker after a park needs to make the syscall.
+	if( !g_atomic_int_compare_and_exchange(&w->parked, true, false) ) return;
+#ifdef __linux__
+	if( w->fd != -1 ) {
+		// This only fails if the counter would overflow, and then it is
+		// readable anyway.
+		guint64 one = 1;
+		while( write(w->fd, &one, sizeof(one)) == -1 && errno == EINTR );
+		return;
+	}
+	syscall(SYS_futex, &w->parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}